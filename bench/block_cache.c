@@ -0,0 +1,128 @@
+#include "rvemu.h"
+
+/*
+    Block cache stress benchmark.
+
+    Readers look up random pcs from a populated cache, announcing a
+    quiescent state before each lookup the way machine_step does, while
+    one writer keeps inserting fresh blocks so the table grows and old
+    tables go through reclamation under their feet. Every hit is checked
+    against the pc asked for. Prints lookups per second for 1, 2, 4, ...
+    readers, up to the thread count given (default: online cpus).
+
+      make bench && bench/block_cache [max threads] [seconds per step]
+*/
+
+#define PREFILL (1 << 16)
+
+static block_cache_t *cache;
+static volatile bool stop;
+static u64 writer_pc;
+
+static block_t *make_block(u64 pc) {
+  block_t *b = calloc(1, sizeof(block_t) + sizeof(inst_t));
+  if (!b) {
+    fatal("out of memory");
+  }
+  b->pc = pc;
+  b->num_insts = 1;
+  return b;
+}
+
+typedef struct {
+  u64 seed;
+  u64 lookups;
+} reader_t;
+
+static void *reader_main(void *arg) {
+  reader_t *r = arg;
+  u64 x = r->seed | 1;
+  u64 n = 0;
+  while (!stop) {
+    for (int i = 0; i < 1024; i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      u64 pc = (x % PREFILL) * 4;
+      qsbr_quiescent();
+      block_t *b = block_cache_lookup(cache, pc);
+      if (!b || b->pc != pc) {
+        fatalf("lookup of %lx returned %p", pc, (void *)b);
+      }
+    }
+    n += 1024;
+  }
+  qsbr_offline();
+  r->lookups = n;
+  return NULL;
+}
+
+// inserts above the prefilled range, so readers never see these miss.
+static void *writer_main(void *arg) {
+  while (!stop) {
+    block_cache_insert(cache, make_block(writer_pc));
+    writer_pc += 4;
+  }
+  return NULL;
+}
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double run(int threads, double secs) {
+  cache = block_cache_new();
+  for (u64 i = 0; i < PREFILL; i++) {
+    block_cache_insert(cache, make_block(i * 4));
+  }
+  writer_pc = PREFILL * 4;
+  stop = false;
+
+  pthread_t writer;
+  pthread_t *readers = calloc(threads, sizeof(pthread_t));
+  reader_t *state = calloc(threads, sizeof(reader_t));
+  if (!readers || !state) {
+    fatal("out of memory");
+  }
+
+  u64 start = now_ns();
+  pthread_create(&writer, NULL, writer_main, NULL);
+  for (int i = 0; i < threads; i++) {
+    state[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+    pthread_create(&readers[i], NULL, reader_main, &state[i]);
+  }
+  usleep(secs * 1e6);
+  stop = true;
+
+  u64 lookups = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(readers[i], NULL);
+    lookups += state[i].lookups;
+  }
+  pthread_join(writer, NULL);
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("%7d %14.0f %14.0f %10lu\n", threads, lookups / elapsed,
+         lookups / elapsed / threads, cache->num_blocks);
+  block_cache_free(cache);
+  free(readers);
+  free(state);
+  return lookups / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int max = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  double secs = argc > 2 ? atof(argv[2]) : 1.0;
+
+  printf("%7s %14s %14s %10s\n", "threads", "lookups/s", "per thread",
+         "blocks");
+  for (int t = 1; t <= max; t *= 2) {
+    run(t, secs);
+    if (t < max && t * 2 > max) {
+      run(max, secs);
+    }
+  }
+  return 0;
+}
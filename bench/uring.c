@@ -0,0 +1,86 @@
+#include "rvemu.h"
+
+/*
+    io_uring transfer benchmark.
+
+    Reads a scratch file with positioned reads of 4K up to 16M, each size
+    once with a plain pread and once through uring_rw, the two paths a
+    guest pread64 can take, and prints MB/s for both. Transfers the ring
+    leaves to the caller (URING_CHUNK and below) show as "-". The file is
+    read once first, so this measures the page cache unless the file is on
+    a device that does not cache.
+
+      make bench && bench/uring [file] [seconds per size]
+*/
+
+#define FILE_SIZE (64ULL << 20)
+#define MAX_XFER  (16ULL << 20)
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// MB/s reading xfer bytes at a time for about secs seconds, or a negative
+// number if the ring would not take transfers that size.
+static double run(uring_t *ring, int fd, u8 *buf, u64 xfer, double secs) {
+  u64 bytes = 0, off = 0;
+  u64 start = now_ns(), deadline = start + secs * 1e9;
+  while (now_ns() < deadline) {
+    for (int i = 0; i < 16; i++) {
+      i64 res;
+      if (!ring) {
+        res = pread(fd, buf, xfer, off);
+      } else if (!uring_rw(ring, false, fd, buf, xfer, off, &res)) {
+        return -1;
+      }
+      if (res != (i64)xfer) {
+        fatalf("short read: %ld", res);
+      }
+      bytes += xfer;
+      off = (off + xfer) % FILE_SIZE;
+    }
+  }
+  return bytes / ((now_ns() - start) / 1e9) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  char *path = argc > 1 ? argv[1] : "bench_uring.tmp";
+  double secs = argc > 2 ? atof(argv[2]) : 0.5;
+
+  uring_t *ring = uring_open();
+  if (!ring) {
+    fatal("io_uring unavailable");
+  }
+
+  u8 *buf = malloc(MAX_XFER);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (!buf || fd == -1) {
+    fatal(strerror(errno));
+  }
+  memset(buf, 0xa5, MAX_XFER);
+  for (u64 off = 0; off < FILE_SIZE; off += MAX_XFER) {
+    if (pwrite(fd, buf, MAX_XFER, off) != (ssize_t)MAX_XFER) {
+      fatal(strerror(errno));
+    }
+  }
+  run(NULL, fd, buf, MAX_XFER, secs);
+
+  printf("%10s %12s %12s\n", "size", "pread MB/s", "uring MB/s");
+  for (u64 xfer = 4096; xfer <= MAX_XFER; xfer *= 4) {
+    double plain = run(NULL, fd, buf, xfer, secs);
+    double uring = run(ring, fd, buf, xfer, secs);
+    if (uring < 0) {
+      printf("%9luK %12.0f %12s\n", xfer >> 10, plain, "-");
+    } else {
+      printf("%9luK %12.0f %12.0f\n", xfer >> 10, plain, uring);
+    }
+  }
+
+  close(fd);
+  unlink(path);
+  uring_close(ring);
+  free(buf);
+  return 0;
+}
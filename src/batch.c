@@ -0,0 +1,507 @@
+#include "rvemu.h"
+
+extern char **environ;
+
+/*
+    Batch runner.
+
+    Runs a list of guest jobs in one process on a pool of worker threads,
+    instead of one rvemu process per job. Each job gets a fresh machine_t
+    of its own, with its stdin and stdout pointed at files through its fd
+    table; guests of the same binary share the loaded image and its
+    decoded blocks.
+
+    Jobs are dealt round-robin onto one work-stealing deque per worker
+    (Chase-Lev). A worker takes its own jobs from the bottom of its deque
+    and, once that is empty, steals from the top of the others', so a few
+    long jobs do not leave the rest of the pool idle.
+
+    With a time slice, jobs are instead multiplexed M:N: every job sits in
+    one FIFO run queue, a worker runs the job at its head for a slice of
+    guest instructions and puts it back at the tail unless it exited. Each
+    job is loaded when it first runs and freed when it exits, and every
+    live job gets the same share of instructions per round. Each loaded
+    job holds a GUEST_MEMORY_SIZE window of address space, which a 47-bit
+    host only has room for about 2000 of, so at most MAX_LOADED are in
+    the queue at once and the rest start as those exit. A guest that
+    blocks in a syscall holds its worker meanwhile, except with
+    --io-uring, where its reads and writes park the job, and the worker
+    goes on with the next one until the transfer is done.
+
+    The job file has one job per line, '#' starting a comment:
+      <stdin file> <stdout file> <program> [args...]
+    where '-' for either file leaves it as rvemu's own. A job whose
+    program or files cannot be opened fails with exit code 127 and the
+    reason in the report; the rest of the batch runs on.
+*/
+
+#define JOB_FAILED 127
+
+#define DEQUE_EMPTY -1
+#define DEQUE_ABORT -2
+
+#define MAX_LOADED 1024
+
+typedef struct {
+  char *in;
+  char *out;
+  int argc;
+  char **argv;
+  machine_t *m;
+  // held until the report, which is about every guest the image ever had.
+  image_t *image;
+  int exit_code;
+  // the file that kept the job from starting and why, if one did.
+  char *error_path;
+  int error;
+  u64 private_bytes;
+  u64 insts;
+  u64 slices;
+  u64 start;
+  u64 ns;
+} job_t;
+
+// top and bottom on their own cache lines: thieves hammer one, the owner
+// the other.
+typedef struct {
+  _Alignas(64) i64 top;
+  _Alignas(64) i64 bottom;
+  int *jobs;
+  i64 cap;
+} deque_t;
+
+typedef struct batch_t batch_t;
+
+typedef struct {
+  int id;
+  batch_t *batch;
+  deque_t deque;
+  pthread_t thread;
+} worker_t;
+
+struct batch_t {
+  job_t *jobs;
+  int num_jobs;
+  worker_t *workers;
+  int num_workers;
+  machine_t *tmpl;
+  char *vfs;
+  bool io_uring;
+  u64 slice;
+  // the M:N run queue: a ring of job indices.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int *queue;
+  int head;
+  int queued;
+  int running;
+  // jobs in the queue or running, and the first one not yet admitted.
+  int loaded;
+  int next;
+  // queued jobs that went back waiting on an io_uring transfer.
+  int parked;
+  bool *waiting;
+};
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// owner only.
+static void deque_push(deque_t *d, int job) {
+  i64 b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  d->jobs[b % d->cap] = job;
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+// owner only.
+static int deque_pop(deque_t *d) {
+  i64 b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  i64 t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+  int job = DEQUE_EMPTY;
+  if (t <= b) {
+    job = d->jobs[b % d->cap];
+    if (t == b) {
+      // the last one: race any thief for it.
+      if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        job = DEQUE_EMPTY;
+      }
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return job;
+}
+
+static int deque_steal(deque_t *d) {
+  i64 t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  i64 b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b) {
+    return DEQUE_EMPTY;
+  }
+  int job = d->jobs[t % d->cap];
+  if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return DEQUE_ABORT;
+  }
+  return job;
+}
+
+// nothing is ever pushed once the workers start, so a full pass finding
+// every deque empty means the batch is done.
+static int next_job(batch_t *b, worker_t *w) {
+  int job = deque_pop(&w->deque);
+  while (job == DEQUE_EMPTY) {
+    bool lost = false;
+    for (int i = 1; i < b->num_workers && job < 0; i++) {
+      worker_t *victim = &b->workers[(w->id + i) % b->num_workers];
+      job = deque_steal(&victim->deque);
+      lost |= job == DEQUE_ABORT;
+    }
+    if (job >= 0 || !lost) {
+      break;
+    }
+    job = DEQUE_EMPTY;
+  }
+  return job < 0 ? DEQUE_EMPTY : job;
+}
+
+// returns 0 or the errno of a file that could not be opened.
+static int job_stdio(machine_t *m, int guest, char *path, int flags) {
+  if (strcmp(path, "-") == 0) {
+    return 0;
+  }
+  int fd = open(path, flags | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return errno;
+  }
+  fd_install(m->fds, guest, (fd_entry_t){fd, NULL});
+  return 0;
+}
+
+static bool job_fail(job_t *job, char *path, int err) {
+  job->error_path = path;
+  job->error = err;
+  job->exit_code = JOB_FAILED;
+  job->ns = now_ns() - job->start;
+  return false;
+}
+
+// a job that cannot start is over: it is recorded as failed, and false
+// returned.
+static bool job_start(batch_t *b, job_t *job) {
+  machine_t *m = calloc(1, sizeof(machine_t));
+  if (!m) {
+    fatal("out of memory");
+  }
+  m->stack_size = b->tmpl->stack_size;
+  m->stack_huge = b->tmpl->stack_huge;
+  m->unbuffered = b->tmpl->unbuffered;
+  m->state.vlenb = b->tmpl->state.vlenb;
+
+  job->start = now_ns();
+  int err = machine_load_program(m, job->argv[0]);
+  if (err) {
+    free(m);
+    return job_fail(job, job->argv[0], err);
+  }
+  machine_setup(m, job->argc, job->argv, environ);
+  char *path = job->in;
+  if (!(err = job_stdio(m, 0, path, O_RDONLY))) {
+    path = job->out;
+    err = job_stdio(m, 1, path, O_WRONLY | O_CREAT | O_TRUNC);
+  }
+  if (err) {
+    machine_free(m);
+    free(m);
+    return job_fail(job, path, err);
+  }
+  if (b->io_uring) {
+    m->uring = uring_open();
+    m->async_io = b->slice != 0;
+  }
+  if (b->vfs) {
+    m->vfs = vfs_open(b->vfs);
+  }
+  job->m = m;
+  return true;
+}
+
+static void job_finish(job_t *job) {
+  job->insts = job->m->state.insts;
+  job->exit_code = job->m->exit_code;
+  // measured while the guest is still loaded, at its largest.
+  job->private_bytes = mmu_private_bytes(job->m->mmu);
+  job->image = image_ref(job->m->mmu->image);
+  machine_free(job->m);
+  free(job->m);
+  job->m = NULL;
+  job->ns = now_ns() - job->start;
+}
+
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+  for (int i; (i = next_job(w->batch, w)) != DEQUE_EMPTY;) {
+    job_t *job = &w->batch->jobs[i];
+    if (!job_start(w->batch, job)) {
+      continue;
+    }
+    while (machine_step(job->m, 0) != halt) {
+    }
+    job->slices = 1;
+    job_finish(job);
+  }
+  return NULL;
+}
+
+// called with the lock held.
+static void admit_jobs(batch_t *b) {
+  while (b->loaded < MAX_LOADED && b->next < b->num_jobs) {
+    b->queue[(b->head + b->queued) % b->num_jobs] = b->next++;
+    b->queued++;
+    b->loaded++;
+  }
+}
+
+// a worker waits while the queue is empty but jobs are still out running,
+// since they may come back; once nothing is queued or running, all exit.
+static void *slice_worker_main(void *arg) {
+  batch_t *b = ((worker_t *)arg)->batch;
+  pthread_mutex_lock(&b->lock);
+  while (true) {
+    while (b->queued == 0 && b->running > 0) {
+      pthread_cond_wait(&b->cond, &b->lock);
+    }
+    if (b->queued == 0) {
+      break;
+    }
+    int i = b->queue[b->head];
+    b->head = (b->head + 1) % b->num_jobs;
+    b->queued--;
+    b->running++;
+    // with nothing queued but other parked jobs, polling round them would
+    // only spin; wait for this one's transfer in the kernel instead.
+    bool idle = false;
+    if (b->waiting[i]) {
+      b->waiting[i] = false;
+      b->parked--;
+      idle = b->parked == b->queued;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    job_t *job = &b->jobs[i];
+    enum exit_reason_t reason = halt;
+    if (job->m || job_start(b, job)) {
+      if (idle) {
+        uring_wait(job->m->uring);
+      }
+      reason = machine_step(job->m, b->slice);
+      job->slices += reason != io_wait;
+      if (reason == halt) {
+        job_finish(job);
+      }
+    }
+    bool done = reason == halt;
+
+    pthread_mutex_lock(&b->lock);
+    b->running--;
+    if (!done) {
+      b->queue[(b->head + b->queued) % b->num_jobs] = i;
+      b->queued++;
+      if (reason == io_wait) {
+        b->waiting[i] = true;
+        b->parked++;
+      }
+      pthread_cond_signal(&b->cond);
+    } else {
+      b->loaded--;
+      admit_jobs(b);
+      if (b->queued > 0) {
+        pthread_cond_signal(&b->cond);
+      } else if (b->running == 0) {
+        pthread_cond_broadcast(&b->cond);
+      }
+    }
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+static void parse_jobs(batch_t *b, char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fatalf("%s: %s", path, strerror(errno));
+  }
+
+  char *line = NULL;
+  size_t line_cap = 0;
+  int cap = 0;
+  while (getline(&line, &line_cap, f) != -1) {
+    char *hash = strchr(line, '#');
+    if (hash) {
+      *hash = '\0';
+    }
+
+    char *words[3 + 256];
+    int n = 0;
+    char *save;
+    for (char *w = strtok_r(line, " \t\n", &save);
+         w && n < (int)ARRAY_SIZE(words); w = strtok_r(NULL, " \t\n", &save)) {
+      words[n++] = strdup(w);
+    }
+    if (n == 0) {
+      continue;
+    }
+    if (n < 3) {
+      fatalf("%s: a job needs <stdin> <stdout> <program>", path);
+    }
+
+    if (b->num_jobs == cap) {
+      cap = cap ? cap * 2 : 64;
+      b->jobs = realloc(b->jobs, cap * sizeof(job_t));
+      if (!b->jobs) {
+        fatal("out of memory");
+      }
+    }
+    job_t *job = &b->jobs[b->num_jobs++];
+    *job = (job_t){.in = words[0], .out = words[1], .argc = n - 2};
+    job->argv = calloc(n - 1, sizeof(char *));
+    if (!job->argv) {
+      fatal("out of memory");
+    }
+    memcpy(job->argv, &words[2], (n - 2) * sizeof(char *));
+  }
+  free(line);
+  fclose(f);
+}
+
+static void batch_report(batch_t *b, u64 ns, FILE *out) {
+  fprintf(out, "%6s %5s %14s %8s %12s %8s %10s  %s\n", "job", "exit",
+          "insts", "slices", "wall ms", "MIPS", "priv KiB", "program");
+  u64 insts = 0;
+  for (int i = 0; i < b->num_jobs; i++) {
+    job_t *job = &b->jobs[i];
+    insts += job->insts;
+    fprintf(out, "%6d %5d %14lu %8lu %12.1f %8.1f %10lu  %s", i,
+            job->exit_code, job->insts, job->slices, job->ns / 1e6,
+            job->ns ? job->insts * 1e3 / job->ns : 0.0,
+            job->private_bytes / 1024, job->argv[0]);
+    if (job->error) {
+      fprintf(out, " (%s: %s)", job->error_path, strerror(job->error));
+    }
+    fputc('\n', out);
+  }
+
+  // one line per image, for the first job that ran it.
+  for (int i = 0; i < b->num_jobs; i++) {
+    image_t *image = b->jobs[i].image;
+    bool seen = false;
+    for (int j = 0; j < i && !seen; j++) {
+      seen = b->jobs[j].image == image;
+    }
+    if (!image || seen) {
+      continue;
+    }
+    int guests = 0;
+    u64 private_bytes = 0;
+    for (int j = i; j < b->num_jobs; j++) {
+      if (b->jobs[j].image == image) {
+        guests++;
+        private_bytes += b->jobs[j].private_bytes;
+      }
+    }
+    image_report(out, image, guests, private_bytes / guests);
+  }
+  fprintf(out,
+          "%d jobs on %d workers in %.1f ms: %.1f jobs/s, %lu insts, "
+          "%.1f MIPS\n",
+          b->num_jobs, b->num_workers, ns / 1e6, b->num_jobs * 1e9 / ns,
+          insts, ns ? insts * 1e3 / ns : 0.0);
+}
+
+// returns 0 if every job exited 0, 1 otherwise. A non-zero slice, in guest
+// instructions, multiplexes the jobs M:N instead of running each to the end.
+int batch_run(char *path, int workers, u64 slice, machine_t *tmpl, char *vfs,
+              bool io_uring) {
+  batch_t b = {.tmpl = tmpl, .vfs = vfs, .io_uring = io_uring, .slice = slice};
+  parse_jobs(&b, path);
+  b.num_workers = MAX(1, MIN(workers, b.num_jobs));
+  b.workers = aligned_alloc(64, b.num_workers * sizeof(worker_t));
+  if (!b.workers) {
+    fatal("out of memory");
+  }
+  memset(b.workers, 0, b.num_workers * sizeof(worker_t));
+
+  for (int i = 0; i < b.num_workers; i++) {
+    worker_t *w = &b.workers[i];
+    w->id = i;
+    w->batch = &b;
+    w->deque.cap = b.num_jobs / b.num_workers + 1;
+    w->deque.jobs = calloc(w->deque.cap, sizeof(int));
+    if (!w->deque.jobs) {
+      fatal("out of memory");
+    }
+  }
+  if (slice) {
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+    b.queue = calloc(MAX(b.num_jobs, 1), sizeof(int));
+    b.waiting = calloc(MAX(b.num_jobs, 1), sizeof(bool));
+    if (!b.queue || !b.waiting) {
+      fatal("out of memory");
+    }
+    admit_jobs(&b);
+  } else {
+    for (int i = 0; i < b.num_jobs; i++) {
+      deque_push(&b.workers[i % b.num_workers].deque, i);
+    }
+  }
+
+  u64 start = now_ns();
+  for (int i = 0; i < b.num_workers; i++) {
+    if (pthread_create(&b.workers[i].thread, NULL,
+                       slice ? slice_worker_main : worker_main,
+                       &b.workers[i])) {
+      fatal("could not start a batch worker");
+    }
+  }
+  for (int i = 0; i < b.num_workers; i++) {
+    pthread_join(b.workers[i].thread, NULL);
+  }
+  batch_report(&b, now_ns() - start, stderr);
+
+  int ret = 0;
+  for (int i = 0; i < b.num_jobs; i++) {
+    job_t *job = &b.jobs[i];
+    ret |= job->exit_code != 0;
+    if (job->image) {
+      image_put(job->image);
+    }
+    free(job->in);
+    free(job->out);
+    for (int j = 0; j < job->argc; j++) {
+      free(job->argv[j]);
+    }
+    free(job->argv);
+  }
+  for (int i = 0; i < b.num_workers; i++) {
+    free(b.workers[i].deque.jobs);
+  }
+  if (slice) {
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.cond);
+    free(b.queue);
+    free(b.waiting);
+  }
+  free(b.workers);
+  free(b.jobs);
+  return ret;
+}
@@ -0,0 +1,269 @@
+#include "rvemu.h"
+
+/*
+    Decoded block cache.
+
+    Maps a guest pc to the block decoded there. Execution threads look
+    blocks up without taking a lock or writing anything shared: the table
+    is open-addressed with linear probing, slots only ever go from empty to
+    a block, and a reader simply walks from the hash slot to the block or
+    an empty slot. Inserts serialise on the cache lock. A table that fills
+    past half is replaced by a bigger copy, published with one pointer
+    store.
+
+    The old table cannot be freed while a reader may still be walking it.
+    That is settled by quiescent-state based reclamation (QSBR, the
+    userspace RCU flavour): each thread that looks blocks up announces,
+    before every lookup, the global epoch it has seen, meaning it holds no
+    table pointer from before it. A retired table is freed once every
+    thread has announced an epoch at least as new as the retirement.
+    Threads announce themselves offline while in a syscall or outside the
+    emulator, so a blocked thread holds up nothing.
+
+    Blocks are never retired: they live as long as the cache.
+*/
+
+#define BLOCK_TABLE_MIN  1024
+#define QSBR_OFFLINE     UINT64_MAX
+
+struct block_table_t {
+  u64 mask;
+  u64 used;
+  block_t *slots[];
+};
+
+typedef struct qsbr_rec_t {
+  u64 seen;
+  bool dead;
+  struct qsbr_rec_t *next;
+} qsbr_rec_t;
+
+typedef struct retired_t {
+  void *ptr;
+  u64 epoch;
+  struct retired_t *next;
+} retired_t;
+
+static pthread_mutex_t qsbr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t qsbr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t qsbr_key;
+static qsbr_rec_t *qsbr_recs;
+static retired_t *qsbr_retired;
+static u64 qsbr_epoch = 1;
+static __thread qsbr_rec_t *qsbr_self;
+
+static void qsbr_thread_exit(void *arg) {
+  qsbr_rec_t *r = arg;
+  __atomic_store_n(&r->seen, QSBR_OFFLINE, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&qsbr_lock);
+  r->dead = true;
+  pthread_mutex_unlock(&qsbr_lock);
+}
+
+static void qsbr_init(void) {
+  pthread_key_create(&qsbr_key, qsbr_thread_exit);
+}
+
+// records of exited threads are reused rather than freed, so a scan never
+// races a free.
+static qsbr_rec_t *qsbr_register(void) {
+  pthread_once(&qsbr_once, qsbr_init);
+  pthread_mutex_lock(&qsbr_lock);
+  qsbr_rec_t *r = qsbr_recs;
+  while (r && !r->dead) {
+    r = r->next;
+  }
+  if (!r) {
+    r = calloc(1, sizeof(qsbr_rec_t));
+    if (!r) {
+      fatal("out of memory");
+    }
+    r->next = qsbr_recs;
+    qsbr_recs = r;
+  }
+  r->dead = false;
+  r->seen = QSBR_OFFLINE;
+  pthread_mutex_unlock(&qsbr_lock);
+
+  pthread_setspecific(qsbr_key, r);
+  qsbr_self = r;
+  return r;
+}
+
+void qsbr_quiescent(void) {
+  qsbr_rec_t *r = qsbr_self ? qsbr_self : qsbr_register();
+  u64 epoch = __atomic_load_n(&qsbr_epoch, __ATOMIC_ACQUIRE);
+  if (r->seen != QSBR_OFFLINE) {
+    __atomic_store_n(&r->seen, epoch, __ATOMIC_RELEASE);
+    return;
+  }
+  // coming online: a reclaimer must see this before we load any table.
+  __atomic_store_n(&r->seen, epoch, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void qsbr_offline(void) {
+  if (qsbr_self) {
+    __atomic_store_n(&qsbr_self->seen, QSBR_OFFLINE, __ATOMIC_RELEASE);
+  }
+}
+
+// frees whatever every thread has moved past. Called with qsbr_lock held.
+static void qsbr_reclaim(void) {
+  u64 oldest = QSBR_OFFLINE;
+  for (qsbr_rec_t *r = qsbr_recs; r; r = r->next) {
+    oldest = MIN(oldest, __atomic_load_n(&r->seen, __ATOMIC_SEQ_CST));
+  }
+
+  retired_t **p = &qsbr_retired;
+  while (*p) {
+    retired_t *ret = *p;
+    if (ret->epoch <= oldest) {
+      *p = ret->next;
+      free(ret->ptr);
+      free(ret);
+    } else {
+      p = &ret->next;
+    }
+  }
+}
+
+// ptr must already be unreachable from anything published.
+static void qsbr_retire(void *ptr) {
+  retired_t *ret = malloc(sizeof(retired_t));
+  if (!ret) {
+    fatal("out of memory");
+  }
+  ret->ptr = ptr;
+
+  pthread_mutex_lock(&qsbr_lock);
+  ret->epoch = __atomic_add_fetch(&qsbr_epoch, 1, __ATOMIC_SEQ_CST);
+  ret->next = qsbr_retired;
+  qsbr_retired = ret;
+  qsbr_reclaim();
+  pthread_mutex_unlock(&qsbr_lock);
+}
+
+static block_table_t *block_table_new(u64 size) {
+  block_table_t *t = calloc(1, sizeof(block_table_t) + size * sizeof(block_t *));
+  if (!t) {
+    fatal("out of memory");
+  }
+  t->mask = size - 1;
+  return t;
+}
+
+static inline u64 block_hash(u64 pc) {
+  return (pc >> 1) * 0x9e3779b97f4a7c15ULL >> 20;
+}
+
+block_cache_t *block_cache_new(void) {
+  block_cache_t *c = calloc(1, sizeof(block_cache_t));
+  if (!c) {
+    fatal("out of memory");
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  c->table = block_table_new(BLOCK_TABLE_MIN);
+  return c;
+}
+
+// only once nothing can be running from it.
+void block_cache_free(block_cache_t *c) {
+  if (!c) {
+    return;
+  }
+  block_table_t *t = c->table;
+  for (u64 i = 0; i <= t->mask; i++) {
+    free(t->slots[i]);
+  }
+  free(t);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+block_t *block_cache_lookup(block_cache_t *c, u64 pc) {
+  block_table_t *t = __atomic_load_n(&c->table, __ATOMIC_ACQUIRE);
+  for (u64 i = block_hash(pc) & t->mask;; i = (i + 1) & t->mask) {
+    block_t *b = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+    if (!b || b->pc == pc) {
+      return b;
+    }
+  }
+}
+
+static block_t **block_slot(block_table_t *t, u64 pc) {
+  u64 i = block_hash(pc) & t->mask;
+  while (t->slots[i] && t->slots[i]->pc != pc) {
+    i = (i + 1) & t->mask;
+  }
+  return &t->slots[i];
+}
+
+static void block_cache_grow(block_cache_t *c) {
+  block_table_t *old = c->table;
+  block_table_t *t = block_table_new((old->mask + 1) * 2);
+  for (u64 i = 0; i <= old->mask; i++) {
+    if (old->slots[i]) {
+      *block_slot(t, old->slots[i]->pc) = old->slots[i];
+    }
+  }
+  t->used = old->used;
+  __atomic_store_n(&c->table, t, __ATOMIC_RELEASE);
+  qsbr_retire(old);
+}
+
+// returns the cached block for b->pc: b itself, or, if another thread got
+// there first, theirs (and b is freed).
+block_t *block_cache_insert(block_cache_t *c, block_t *b) {
+  pthread_mutex_lock(&c->lock);
+  if ((c->table->used + 1) * 2 > c->table->mask + 1) {
+    block_cache_grow(c);
+  }
+
+  block_t **slot = block_slot(c->table, b->pc);
+  if (*slot) {
+    free(b);
+    b = *slot;
+  } else {
+    __atomic_store_n(slot, b, __ATOMIC_RELEASE);
+    c->table->used++;
+    c->num_blocks++;
+    c->bytes += sizeof(block_t) + b->num_insts * sizeof(inst_t);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return b;
+}
+
+// decodes from code, the host copy of len bytes of guest code at pc.
+// Returns NULL if not even one instruction fits.
+block_t *block_decode(u8 *code, u64 pc, u64 len) {
+  inst_t insts[BLOCK_MAX_INSTS];
+  u32 n = 0;
+  u64 off = 0;
+  while (n < BLOCK_MAX_INSTS && off + 2 <= len) {
+    u32 data = *(u16 *)(code + off);
+    if ((data & 0x3) == 0x3) {
+      if (off + 4 > len) {
+        break;
+      }
+      data = *(u32 *)(code + off);
+    }
+    inst_decode(&insts[n], data);
+    off += insts[n].rvc ? 2 : 4;
+    if (insts[n++].cont) {
+      break;
+    }
+  }
+  if (n == 0) {
+    return NULL;
+  }
+
+  block_t *b = malloc(sizeof(block_t) + n * sizeof(inst_t));
+  if (!b) {
+    fatal("out of memory");
+  }
+  b->pc = pc;
+  b->num_insts = n;
+  memcpy(b->insts, insts, n * sizeof(inst_t));
+  return b;
+}
@@ -96,6 +96,17 @@ static inline inst_t inst_fprtype_read(u32 data) {
       .rs2 = RS2(data),
       .rs3 = RS3(data),
       .rd = RD(data),
+      .rm = FUNCT3(data),
+  };
+}
+
+static inline inst_t inst_vtype_read(u32 data) {
+  return (inst_t){
+      .imm = (i32)(data << 12) >> 27,
+      .rs1 = RS1(data),
+      .rs2 = RS2(data),
+      .rd = RD(data),
+      .vm = (data >> 25) & 0x1,
   };
 }
 
@@ -348,7 +359,388 @@ static inline inst_t inst_ciwtype_read(u16 data) {
   };
 }
 
-void inst_decode(inst_t *inst, u32 data) {
+/**
+ * vector
+ */
+// vector loads and stores live in LOAD-FP/STORE-FP under widths the
+// scalar ones don't use: 0, 5, 6, 7 for 8, 16, 32, 64-bit elements. No
+// segment or fault-only-first accesses and no 128-bit elements; nf only
+// counts registers for the whole-register forms, whose imm it becomes.
+static void decode_vmem(inst_t *inst, u32 data, bool store) {
+  u32 width = FUNCT3(data);
+  u32 eew = width == 0x0 ? 0 : width - 4;
+  u32 mop = (data >> 26) & 0x3;
+  u32 nf = data >> 29;
+
+  if ((data >> 28) & 0x1) {
+    unreachable();
+  }
+  *inst = inst_vtype_read(data);
+  if (nf && !(mop == 0x0 && RS2(data) == 0x8)) {
+    unreachable();
+  }
+  switch (mop) {
+    case 0x0: {
+      u32 lumop = RS2(data);
+
+      switch (lumop) {
+        case 0x0: /* VLE<EEW>.V, VSE<EEW>.V */
+          inst->type = (store ? inst_vse8_v : inst_vle8_v) + eew;
+          return;
+        case 0x8: /* VL<NF>RE<EEW>.V, VS<NF>R.V */
+          // 1, 2, 4 or 8 registers, from a multiple of that.
+          if ((nf & (nf + 1)) || !inst->vm || (store && width != 0x0) ||
+              inst->rd % (nf + 1)) {
+            unreachable();
+          }
+          inst->type = store ? inst_vsr_v : inst_vlr_v;
+          inst->imm = nf + 1;
+          return;
+        case 0xb: /* VLM.V, VSM.V */
+          if (width != 0x0) {
+            unreachable();
+          }
+          inst->type = store ? inst_vsm_v : inst_vlm_v;
+          return;
+        default:
+          unreachable();
+      }
+    }
+      unreachable();
+    case 0x2: /* VLSE<EEW>.V, VSSE<EEW>.V */
+      inst->type = (store ? inst_vsse8_v : inst_vlse8_v) + eew;
+      return;
+    default:
+      unreachable();
+  }
+}
+
+static void decode_opv(inst_t *inst, u32 data) {
+  u32 funct3 = FUNCT3(data);
+  u32 funct6 = data >> 26;
+
+  *inst = inst_vtype_read(data);
+  switch (funct3) {
+    case 0x0: /* OPIVV */
+    case 0x3: /* OPIVI */
+    case 0x4: /* OPIVX */
+      inst->vform = funct3 == 0x0 ? form_vv : funct3 == 0x3 ? form_vi : form_vx;
+      switch (funct6) {
+        case 0x00: /* VADD */
+          inst->type = inst_vadd;
+          return;
+        case 0x02: /* VSUB */
+          inst->type = inst_vsub;
+          return;
+        case 0x03: /* VRSUB */
+          inst->type = inst_vrsub;
+          return;
+        case 0x04: /* VMINU */
+          inst->type = inst_vminu;
+          return;
+        case 0x05: /* VMIN */
+          inst->type = inst_vmin;
+          return;
+        case 0x06: /* VMAXU */
+          inst->type = inst_vmaxu;
+          return;
+        case 0x07: /* VMAX */
+          inst->type = inst_vmax;
+          return;
+        case 0x09: /* VAND */
+          inst->type = inst_vand;
+          return;
+        case 0x0a: /* VOR */
+          inst->type = inst_vor;
+          return;
+        case 0x0b: /* VXOR */
+          inst->type = inst_vxor;
+          return;
+        case 0x17: /* VMERGE, VMV.V */
+          inst->type = inst_vmerge;
+          return;
+        case 0x18: /* VMSEQ */
+          inst->type = inst_vmseq;
+          return;
+        case 0x19: /* VMSNE */
+          inst->type = inst_vmsne;
+          return;
+        case 0x1a: /* VMSLTU */
+          inst->type = inst_vmsltu;
+          return;
+        case 0x1b: /* VMSLT */
+          inst->type = inst_vmslt;
+          return;
+        case 0x1c: /* VMSLEU */
+          inst->type = inst_vmsleu;
+          return;
+        case 0x1d: /* VMSLE */
+          inst->type = inst_vmsle;
+          return;
+        case 0x1e: /* VMSGTU */
+          inst->type = inst_vmsgtu;
+          return;
+        case 0x1f: /* VMSGT */
+          inst->type = inst_vmsgt;
+          return;
+        case 0x25: /* VSLL */
+        case 0x28: /* VSRL */
+        case 0x29: /* VSRA */
+          inst->type = funct6 == 0x25   ? inst_vsll
+                       : funct6 == 0x28 ? inst_vsrl
+                                        : inst_vsra;
+          // shift amounts are unsigned: uimm5, not simm5.
+          if (funct3 == 0x3) {
+            inst->imm = RS1(data);
+          }
+          return;
+        case 0x27: /* VMV<NR>R.V */
+          // simm5 is the register count less one: 1, 2, 4 or 8.
+          if (funct3 != 0x3 || !inst->vm || (inst->imm & (inst->imm + 1)) ||
+              inst->imm < 0 || inst->imm > 7 || inst->rd % (inst->imm + 1) ||
+              inst->rs2 % (inst->imm + 1)) {
+            unreachable();
+          }
+          inst->type = inst_vmvr_v;
+          inst->imm++;
+          return;
+        default:
+          unreachable();
+      }
+    case 0x2: /* OPMVV */
+    case 0x6: /* OPMVX */
+      inst->vform = funct3 == 0x2 ? form_vv : form_vx;
+      switch (funct6) {
+        case 0x00: /* VREDSUM */
+          inst->type = inst_vredsum;
+          return;
+        case 0x01: /* VREDAND */
+          inst->type = inst_vredand;
+          return;
+        case 0x02: /* VREDOR */
+          inst->type = inst_vredor;
+          return;
+        case 0x03: /* VREDXOR */
+          inst->type = inst_vredxor;
+          return;
+        case 0x04: /* VREDMINU */
+          inst->type = inst_vredminu;
+          return;
+        case 0x05: /* VREDMIN */
+          inst->type = inst_vredmin;
+          return;
+        case 0x06: /* VREDMAXU */
+          inst->type = inst_vredmaxu;
+          return;
+        case 0x07: /* VREDMAX */
+          inst->type = inst_vredmax;
+          return;
+        case 0x10: {
+          if (funct3 == 0x6) { /* VMV.S.X */
+            inst->type = inst_vmv_s_x;
+            return;
+          }
+          u32 vs1 = RS1(data);
+
+          switch (vs1) {
+            case 0x00: /* VMV.X.S */
+              inst->type = inst_vmv_x_s;
+              return;
+            case 0x10: /* VCPOP.M */
+              inst->type = inst_vcpop_m;
+              return;
+            case 0x11: /* VFIRST.M */
+              inst->type = inst_vfirst_m;
+              return;
+            default:
+              unreachable();
+          }
+        }
+          unreachable();
+        case 0x14: {
+          if (funct3 != 0x2) {
+            unreachable();
+          }
+          u32 vs1 = RS1(data);
+
+          switch (vs1) {
+            case 0x11: /* VID.V */
+              inst->type = inst_vid_v;
+              return;
+            default:
+              unreachable();
+          }
+        }
+          unreachable();
+        case 0x18: /* VMANDN.MM */
+          inst->type = inst_vmandn;
+          return;
+        case 0x19: /* VMAND.MM */
+          inst->type = inst_vmand;
+          return;
+        case 0x1a: /* VMOR.MM */
+          inst->type = inst_vmor;
+          return;
+        case 0x1b: /* VMXOR.MM */
+          inst->type = inst_vmxor;
+          return;
+        case 0x1c: /* VMORN.MM */
+          inst->type = inst_vmorn;
+          return;
+        case 0x1d: /* VMNAND.MM */
+          inst->type = inst_vmnand;
+          return;
+        case 0x1e: /* VMNOR.MM */
+          inst->type = inst_vmnor;
+          return;
+        case 0x1f: /* VMXNOR.MM */
+          inst->type = inst_vmxnor;
+          return;
+        case 0x20: /* VDIVU */
+          inst->type = inst_vdivu;
+          return;
+        case 0x21: /* VDIV */
+          inst->type = inst_vdiv;
+          return;
+        case 0x22: /* VREMU */
+          inst->type = inst_vremu;
+          return;
+        case 0x23: /* VREM */
+          inst->type = inst_vrem;
+          return;
+        case 0x25: /* VMUL */
+          inst->type = inst_vmul;
+          return;
+        case 0x29: /* VMADD */
+          inst->type = inst_vmadd;
+          return;
+        case 0x2b: /* VNMSUB */
+          inst->type = inst_vnmsub;
+          return;
+        case 0x2d: /* VMACC */
+          inst->type = inst_vmacc;
+          return;
+        case 0x2f: /* VNMSAC */
+          inst->type = inst_vnmsac;
+          return;
+        default:
+          unreachable();
+      }
+    case 0x1: /* OPFVV */
+    case 0x5: /* OPFVF */
+      inst->vform = funct3 == 0x1 ? form_vv : form_vf;
+      switch (funct6) {
+        case 0x00: /* VFADD */
+          inst->type = inst_vfadd;
+          return;
+        case 0x01: /* VFREDUSUM */
+          inst->type = inst_vfredusum;
+          return;
+        case 0x02: /* VFSUB */
+          inst->type = inst_vfsub;
+          return;
+        case 0x03: /* VFREDOSUM */
+          inst->type = inst_vfredosum;
+          return;
+        case 0x04: /* VFMIN */
+          inst->type = inst_vfmin;
+          return;
+        case 0x05: /* VFREDMIN */
+          inst->type = inst_vfredmin;
+          return;
+        case 0x06: /* VFMAX */
+          inst->type = inst_vfmax;
+          return;
+        case 0x07: /* VFREDMAX */
+          inst->type = inst_vfredmax;
+          return;
+        case 0x10: /* VFMV.F.S, VFMV.S.F */
+          inst->type = funct3 == 0x1 ? inst_vfmv_f_s : inst_vfmv_s_f;
+          return;
+        case 0x17: /* VFMERGE, VFMV.V.F */
+          inst->type = inst_vfmerge;
+          return;
+        case 0x18: /* VMFEQ */
+          inst->type = inst_vmfeq;
+          return;
+        case 0x19: /* VMFLE */
+          inst->type = inst_vmfle;
+          return;
+        case 0x1b: /* VMFLT */
+          inst->type = inst_vmflt;
+          return;
+        case 0x1c: /* VMFNE */
+          inst->type = inst_vmfne;
+          return;
+        case 0x1d: /* VMFGT */
+          inst->type = inst_vmfgt;
+          return;
+        case 0x1f: /* VMFGE */
+          inst->type = inst_vmfge;
+          return;
+        case 0x20: /* VFDIV */
+          inst->type = inst_vfdiv;
+          return;
+        case 0x21: /* VFRDIV */
+          inst->type = inst_vfrdiv;
+          return;
+        case 0x24: /* VFMUL */
+          inst->type = inst_vfmul;
+          return;
+        case 0x27: /* VFRSUB */
+          inst->type = inst_vfrsub;
+          return;
+        case 0x28: /* VFMADD */
+          inst->type = inst_vfmadd;
+          return;
+        case 0x29: /* VFNMADD */
+          inst->type = inst_vfnmadd;
+          return;
+        case 0x2a: /* VFMSUB */
+          inst->type = inst_vfmsub;
+          return;
+        case 0x2b: /* VFNMSUB */
+          inst->type = inst_vfnmsub;
+          return;
+        case 0x2c: /* VFMACC */
+          inst->type = inst_vfmacc;
+          return;
+        case 0x2d: /* VFNMACC */
+          inst->type = inst_vfnmacc;
+          return;
+        case 0x2e: /* VFMSAC */
+          inst->type = inst_vfmsac;
+          return;
+        case 0x2f: /* VFNMSAC */
+          inst->type = inst_vfnmsac;
+          return;
+        default:
+          unreachable();
+      }
+    case 0x7: {
+      // vtype goes in imm.
+      if (!(data >> 31)) { /* VSETVLI */
+        inst->imm = (data >> 20) & 0x7ff;
+        inst->type = inst_vsetvli;
+        return;
+      }
+      if ((data >> 30) == 0x3) { /* VSETIVLI */
+        inst->imm = (data >> 20) & 0x3ff;
+        inst->type = inst_vsetivli;
+        return;
+      }
+      if (FUNCT7(data) == 0x40) { /* VSETVL */
+        inst->type = inst_vsetvl;
+        return;
+      }
+      unreachable();
+    }
+    default:
+      unreachable();
+  }
+}
+
+static void decode(inst_t *inst, u32 data) {
   u32 quadrant = QUADRANT(data);
   switch (quadrant) {
     case 0x0: {
@@ -516,6 +908,7 @@ void inst_decode(inst_t *inst, u32 data) {
           *inst = inst_cbtype_read(data);
           inst->rs2 = zero;
           inst->type = copcode == 0x6 ? inst_beq : inst_bne;
+          inst->cont = true;
           return;
         default:
           fatal("unrecognized copcode");
@@ -652,6 +1045,12 @@ void inst_decode(inst_t *inst, u32 data) {
             case 0x3: /* FLD */
               inst->type = inst_fld;
               return;
+            case 0x0: /* VLE8.V, VLSE8.V, VLM.V */
+            case 0x5:
+            case 0x6:
+            case 0x7:
+              decode_vmem(inst, data, false);
+              return;
             default:
               unreachable();
           }
@@ -798,6 +1197,61 @@ void inst_decode(inst_t *inst, u32 data) {
             case 0x3: /* FSD */
               inst->type = inst_fsd;
               return;
+            case 0x0: /* VSE8.V, VSSE8.V, VSM.V */
+            case 0x5:
+            case 0x6:
+            case 0x7:
+              decode_vmem(inst, data, true);
+              return;
+            default:
+              unreachable();
+          }
+        }
+          unreachable();
+        case 0xb: {
+          *inst = inst_rtype_read(data);
+
+          u32 funct3 = FUNCT3(data);
+          u32 funct5 = FUNCT7(data) >> 2;
+          bool word = funct3 == 0x2;
+          if (funct3 != 0x2 && funct3 != 0x3) {
+            unreachable();
+          }
+
+          switch (funct5) {
+            case 0x2: /* LR.W, LR.D */
+              inst->type = word ? inst_lr_w : inst_lr_d;
+              return;
+            case 0x3: /* SC.W, SC.D */
+              inst->type = word ? inst_sc_w : inst_sc_d;
+              return;
+            case 0x1: /* AMOSWAP.W, AMOSWAP.D */
+              inst->type = word ? inst_amoswap_w : inst_amoswap_d;
+              return;
+            case 0x0: /* AMOADD.W, AMOADD.D */
+              inst->type = word ? inst_amoadd_w : inst_amoadd_d;
+              return;
+            case 0x4: /* AMOXOR.W, AMOXOR.D */
+              inst->type = word ? inst_amoxor_w : inst_amoxor_d;
+              return;
+            case 0xc: /* AMOAND.W, AMOAND.D */
+              inst->type = word ? inst_amoand_w : inst_amoand_d;
+              return;
+            case 0x8: /* AMOOR.W, AMOOR.D */
+              inst->type = word ? inst_amoor_w : inst_amoor_d;
+              return;
+            case 0x10: /* AMOMIN.W, AMOMIN.D */
+              inst->type = word ? inst_amomin_w : inst_amomin_d;
+              return;
+            case 0x14: /* AMOMAX.W, AMOMAX.D */
+              inst->type = word ? inst_amomax_w : inst_amomax_d;
+              return;
+            case 0x18: /* AMOMINU.W, AMOMINU.D */
+              inst->type = word ? inst_amominu_w : inst_amominu_d;
+              return;
+            case 0x1c: /* AMOMAXU.W, AMOMAXU.D */
+              inst->type = word ? inst_amomaxu_w : inst_amomaxu_d;
+              return;
             default:
               unreachable();
           }
@@ -1024,7 +1478,7 @@ void inst_decode(inst_t *inst, u32 data) {
         case 0x14: {
           u32 funct7 = FUNCT7(data);
 
-          *inst = inst_rtype_read(data);
+          *inst = inst_fprtype_read(data);
           switch (funct7) {
             case 0x0: /* FADD.S */
               inst->type = inst_fadd_s;
@@ -1297,8 +1751,13 @@ void inst_decode(inst_t *inst, u32 data) {
           }
         }
           unreachable();
+        case 0x15: /* OP-V */
+          decode_opv(inst, data);
+          return;
         case 0x18: {
           *inst = inst_btype_read(data);
+          // taken or not, a branch ends the block.
+          inst->cont = true;
 
           u32 funct3 = FUNCT3(data);
           switch (funct3) {
@@ -1376,4 +1835,33 @@ void inst_decode(inst_t *inst, u32 data) {
     default:
       unreachable();
   }
-}
\ No newline at end of file
+}
+
+// the variant of a rounding op for a static rm; anything else, including
+// ops that round but get rm straight from the instruction (conversions to
+// integer) or cannot round at all, stays as it is.
+static enum inst_type_t static_rm(enum inst_type_t type) {
+#define RM(t)    \
+  case inst_##t: \
+    return inst_##t##_rm;
+
+  switch (type) {
+    RM(fmadd_s) RM(fmsub_s) RM(fnmsub_s) RM(fnmadd_s)
+    RM(fadd_s) RM(fsub_s) RM(fmul_s) RM(fdiv_s) RM(fsqrt_s)
+    RM(fcvt_s_w) RM(fcvt_s_wu) RM(fcvt_s_l) RM(fcvt_s_lu)
+    RM(fmadd_d) RM(fmsub_d) RM(fnmsub_d) RM(fnmadd_d)
+    RM(fadd_d) RM(fsub_d) RM(fmul_d) RM(fdiv_d) RM(fsqrt_d)
+    RM(fcvt_s_d) RM(fcvt_d_l) RM(fcvt_d_lu)
+    default:
+      return type;
+  }
+
+#undef RM
+}
+
+void inst_decode(inst_t *inst, u32 data) {
+  decode(inst, data);
+  if (inst->rm != dyn) {
+    inst->type = static_rm(inst->type);
+  }
+}
@@ -0,0 +1,304 @@
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "rvemu.h"
+
+/*
+    Incremental dirty page tracking over guest memory.
+
+    Preferred backend is userfaultfd in async write-protect mode: the kernel
+    resolves write faults itself and PAGEMAP_SCAN reports the written pages,
+    so tracking costs one fault per first write to a page and nothing else.
+    Kernels without it fall back to soft-dirty bits, and if neither works
+    every page is reported dirty, which is slow but never wrong.
+*/
+
+// these are newer than the uapi headers we build against.
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC (1 << 15)
+#endif
+
+#ifndef PAGEMAP_SCAN
+struct page_region {
+  u64 start;
+  u64 end;
+  u64 categories;
+};
+
+struct pm_scan_arg {
+  u64 size;
+  u64 flags;
+  u64 start;
+  u64 end;
+  u64 walk_end;
+  u64 vec;
+  u64 vec_len;
+  u64 max_pages;
+  u64 category_inverted;
+  u64 category_mask;
+  u64 category_anyof_mask;
+  u64 return_mask;
+};
+
+#define PAGEMAP_SCAN    _IOWR('f', 16, struct pm_scan_arg)
+#define PAGE_IS_WRITTEN (1 << 1)
+#endif
+
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define SCAN_VEC_LEN  64
+
+static bool uffd_open(mmu_t *mmu) {
+  int fd =
+      syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct uffdio_api api = {
+      .api = UFFD_API,
+      .features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED,
+  };
+  if (ioctl(fd, UFFDIO_API, &api) == -1 ||
+      !(api.features & UFFD_FEATURE_WP_ASYNC)) {
+    close(fd);
+    return false;
+  }
+
+  mmu->dirty_fd = fd;
+  return true;
+}
+
+static void uffd_protect(mmu_t *mmu, u64 addr, u64 len) {
+  struct uffdio_writeprotect wp = {
+      .range = {TO_HOST(mmu->mem_base, addr), len},
+      .mode = UFFDIO_WRITEPROTECT_MODE_WP,
+  };
+  if (ioctl(mmu->dirty_fd, UFFDIO_WRITEPROTECT, &wp) == -1) {
+    fatal(strerror(errno));
+  }
+}
+
+static bool soft_dirty_clear(void) {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = write(fd, "4", 1) == 1;
+  close(fd);
+  return ok;
+}
+
+static bool soft_dirty_probe(mmu_t *mmu) {
+  // the bit reads as zero on kernels built without soft-dirty support, so
+  // make sure a fresh write actually shows up before relying on it.
+  int page_size = getpagesize();
+  u8 *page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    return false;
+  }
+
+  u64 entry = 0;
+  bool ok = soft_dirty_clear();
+  page[0] = 1;
+  ok = ok && pread(mmu->pagemap_fd, &entry, sizeof(entry),
+                   (u64)page / page_size * sizeof(entry)) == sizeof(entry);
+  munmap(page, page_size);
+  return ok && (entry & PM_SOFT_DIRTY);
+}
+
+enum dirty_mode_t mmu_dirty_start(mmu_t *mmu) {
+  if (mmu->dirty_mode != dirty_none) {
+    return mmu->dirty_mode;
+  }
+
+  mmu->dirty_fd = -1;
+  mmu->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+  if (mmu->pagemap_fd != -1 && uffd_open(mmu)) {
+    mmu->dirty_mode = dirty_uffd;
+  } else if (mmu->pagemap_fd != -1 && soft_dirty_probe(mmu)) {
+    mmu->dirty_mode = dirty_soft;
+  } else {
+    mmu->dirty_mode = dirty_all;
+  }
+
+  for (int i = 0; i < mmu->num_regions; i++) {
+    mmu_region_t *r = &mmu->regions[i];
+    if (!r->shared) {
+      mmu_dirty_register(mmu, r->addr, r->len, r->prot);
+    }
+  }
+  u64 heap_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  if (heap_top > mmu->base) {
+    mmu_dirty_register(mmu, mmu->base, heap_top - mmu->base,
+                       PROT_READ | PROT_WRITE);
+  }
+
+  mmu_dirty_reset(mmu);
+  return mmu->dirty_mode;
+}
+
+void mmu_dirty_stop(mmu_t *mmu) {
+  if (mmu->dirty_mode == dirty_none) {
+    return;
+  }
+
+  // closing the userfaultfd drops every registration along with it.
+  if (mmu->dirty_fd != -1) {
+    close(mmu->dirty_fd);
+  }
+  if (mmu->pagemap_fd != -1) {
+    close(mmu->pagemap_fd);
+  }
+  mmu->dirty_fd = mmu->pagemap_fd = -1;
+  mmu->dirty_mode = dirty_none;
+}
+
+void mmu_dirty_register(mmu_t *mmu, u64 addr, u64 len, int prot) {
+  if (mmu->dirty_mode != dirty_uffd || !(prot & PROT_WRITE)) {
+    return;
+  }
+
+  struct uffdio_register reg = {
+      .range = {TO_HOST(mmu->mem_base, addr), len},
+      .mode = UFFDIO_REGISTER_MODE_WP,
+  };
+  if (ioctl(mmu->dirty_fd, UFFDIO_REGISTER, &reg) == -1) {
+    fatal(strerror(errno));
+  }
+
+  // a region mapped after the last reset starts out entirely dirty, which
+  // is what a checkpoint wants, so it is only protected on the next reset.
+}
+
+static void scan_uffd(mmu_t *mmu, u64 addr, u64 len, dirty_range_fn_t *fn,
+                      void *arg) {
+  struct page_region vec[SCAN_VEC_LEN];
+  u64 start = TO_HOST(mmu->mem_base, addr);
+  u64 end = start + len;
+
+  while (start < end) {
+    struct pm_scan_arg scan = {
+        .size = sizeof(scan),
+        .start = start,
+        .end = end,
+        .vec = (u64)vec,
+        .vec_len = SCAN_VEC_LEN,
+        .category_mask = PAGE_IS_WRITTEN,
+        .return_mask = PAGE_IS_WRITTEN,
+    };
+    long n = ioctl(mmu->pagemap_fd, PAGEMAP_SCAN, &scan);
+    if (n == -1) {
+      fatal(strerror(errno));
+    }
+
+    for (long i = 0; i < n; i++) {
+      fn(TO_GUEST(mmu->mem_base, vec[i].start), vec[i].end - vec[i].start,
+         arg);
+    }
+    start = scan.walk_end;
+  }
+}
+
+static void scan_soft_dirty(mmu_t *mmu, u64 addr, u64 len,
+                            dirty_range_fn_t *fn, void *arg) {
+  int page_size = getpagesize();
+  u64 entries[SCAN_VEC_LEN];
+  u64 page = TO_HOST(mmu->mem_base, addr) / page_size;
+  u64 npages = len / page_size;
+  u64 run_start = 0, run_len = 0;
+
+  for (u64 i = 0; i < npages; i += SCAN_VEC_LEN) {
+    u64 n = MIN(npages - i, SCAN_VEC_LEN);
+    ssize_t got = pread(mmu->pagemap_fd, entries, n * sizeof(u64),
+                        (page + i) * sizeof(u64));
+    if (got != (ssize_t)(n * sizeof(u64))) {
+      fatal("failed to read pagemap");
+    }
+
+    for (u64 j = 0; j < n; j++) {
+      u64 guest = addr + (i + j) * page_size;
+      if (entries[j] & PM_SOFT_DIRTY) {
+        if (run_len == 0) {
+          run_start = guest;
+        }
+        run_len += page_size;
+      } else if (run_len > 0) {
+        fn(run_start, run_len, arg);
+        run_len = 0;
+      }
+    }
+  }
+
+  if (run_len > 0) {
+    fn(run_start, run_len, arg);
+  }
+}
+
+static void scan_range(mmu_t *mmu, u64 addr, u64 len, dirty_range_fn_t *fn,
+                       void *arg) {
+  switch (mmu->dirty_mode) {
+    case dirty_uffd:
+      scan_uffd(mmu, addr, len, fn, arg);
+      return;
+    case dirty_soft:
+      scan_soft_dirty(mmu, addr, len, fn, arg);
+      return;
+    case dirty_all:
+      fn(addr, len, arg);
+      return;
+    default:
+      unreachable();
+  }
+}
+
+// report every page written since the last reset, as guest address ranges.
+void mmu_dirty_foreach(mmu_t *mmu, dirty_range_fn_t *fn, void *arg) {
+  assert(mmu->dirty_mode != dirty_none);
+
+  for (int i = 0; i < mmu->num_regions; i++) {
+    mmu_region_t *r = &mmu->regions[i];
+    if ((r->prot & PROT_WRITE) && !r->shared) {
+      scan_range(mmu, r->addr, r->len, fn, arg);
+    }
+  }
+
+  u64 heap_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  if (heap_top > mmu->base) {
+    scan_range(mmu, mmu->base, heap_top - mmu->base, fn, arg);
+  }
+}
+
+void mmu_dirty_reset(mmu_t *mmu) {
+  switch (mmu->dirty_mode) {
+    case dirty_uffd: {
+      for (int i = 0; i < mmu->num_regions; i++) {
+        mmu_region_t *r = &mmu->regions[i];
+        if ((r->prot & PROT_WRITE) && !r->shared) {
+          uffd_protect(mmu, r->addr, r->len);
+        }
+      }
+      u64 heap_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+      if (heap_top > mmu->base) {
+        uffd_protect(mmu, mmu->base, heap_top - mmu->base);
+      }
+      return;
+    }
+    case dirty_soft:
+      // clear_refs is process wide, so this also resets any other machine
+      // sharing the process; the uffd backend has no such caveat.
+      if (!soft_dirty_clear()) {
+        fatal("failed to clear soft-dirty bits");
+      }
+      return;
+    case dirty_all:
+      return;
+    default:
+      unreachable();
+  }
+}
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include "rvemu.h"
+
+/*
+    Guest file descriptor table.
+
+    Guest fds are indices into a per-machine table of host fds, so one
+    process can run guests whose fd 0, 1 and 2 are different files, and a
+    guest can never name a host descriptor it was not given. Syscall
+    handlers translate on the way in and hand the host fd to the kernel
+    unchanged, so passthrough calls (sendfile, splice and friends) work on
+    the real descriptors. A slot can instead hold a file served by the
+    VFS, which has no host fd at all; those calls copy through a buffer
+    when one end is such a file, and mmap takes a private copy of it.
+
+    The host's own stdio is borrowed, never owned: dropping a guest fd
+    that points at host fd 0, 1 or 2 does not close it.
+
+    The table is shared by all threads of a guest, so every operation
+    holds its lock; growing it moves the entries.
+
+    It also holds the guest's working directory, as a host dirfd that
+    relative paths resolve against, so that chdir does not move every
+    other guest in the process. A later chdir dup3()s onto the same
+    number, so a lookup racing with it sees one directory or the other.
+*/
+
+fd_table_t *fd_new(void) {
+  fd_table_t *t = calloc(1, sizeof(fd_table_t));
+  if (!t) {
+    fatal("out of memory");
+  }
+  pthread_mutex_init(&t->lock, NULL);
+  t->num = 3;
+  t->ent = malloc(t->num * sizeof(fd_entry_t));
+  if (!t->ent) {
+    fatal("out of memory");
+  }
+  for (int i = 0; i < t->num; i++) {
+    t->ent[i] = (fd_entry_t){i, NULL};
+  }
+  t->cwd = AT_FDCWD;
+  return t;
+}
+
+static int fd_release(fd_entry_t *e) {
+  int host = e->host;
+  vfs_file_t *file = e->file;
+  *e = (fd_entry_t){-1, NULL};
+
+  if (file) {
+    vfs_file_put(file);
+  } else if (host > 2 && close(host) == -1) {
+    return -errno;
+  }
+  return 0;
+}
+
+static bool fd_is_free(fd_table_t *t, int guest) {
+  return t->ent[guest].host == -1 && !t->ent[guest].file;
+}
+
+void fd_free(fd_table_t *t) {
+  if (!t) {
+    return;
+  }
+  for (int i = 0; i < t->num; i++) {
+    fd_release(&t->ent[i]);
+  }
+  if (t->cwd != AT_FDCWD) {
+    close(t->cwd);
+  }
+  pthread_mutex_destroy(&t->lock);
+  free(t->ent);
+  free(t);
+}
+
+int fd_host(fd_table_t *t, u64 guest) {
+  pthread_mutex_lock(&t->lock);
+  int host = guest < (u64)t->num ? t->ent[guest].host : -1;
+  pthread_mutex_unlock(&t->lock);
+  return host;
+}
+
+// a reference the caller puts: another thread may close the fd meanwhile.
+vfs_file_t *fd_vfs(fd_table_t *t, u64 guest) {
+  pthread_mutex_lock(&t->lock);
+  vfs_file_t *file = guest < (u64)t->num ? t->ent[guest].file : NULL;
+  if (file) {
+    vfs_file_get(file);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return file;
+}
+
+bool fd_is_vfs(fd_table_t *t, u64 guest) {
+  pthread_mutex_lock(&t->lock);
+  bool vfs = guest < (u64)t->num && t->ent[guest].file;
+  pthread_mutex_unlock(&t->lock);
+  return vfs;
+}
+
+static void fd_grow(fd_table_t *t, int num) {
+  if (num <= t->num) {
+    return;
+  }
+  t->ent = realloc(t->ent, num * sizeof(fd_entry_t));
+  if (!t->ent) {
+    fatal("out of memory");
+  }
+  for (int i = t->num; i < num; i++) {
+    t->ent[i] = (fd_entry_t){-1, NULL};
+  }
+  t->num = num;
+}
+
+// installs e as guest fd, replacing (and releasing) what was there.
+void fd_install(fd_table_t *t, int guest, fd_entry_t e) {
+  pthread_mutex_lock(&t->lock);
+  fd_grow(t, guest + 1);
+  fd_release(&t->ent[guest]);
+  t->ent[guest] = e;
+  pthread_mutex_unlock(&t->lock);
+}
+
+// installs e as the lowest free guest fd >= min, as the kernel would.
+int fd_alloc(fd_table_t *t, fd_entry_t e, int min) {
+  pthread_mutex_lock(&t->lock);
+  int guest = min;
+  while (guest < t->num && !fd_is_free(t, guest)) {
+    guest++;
+  }
+  if (guest >= t->num) {
+    fd_grow(t, MAX(guest + 1, t->num * 2));
+  }
+  t->ent[guest] = e;
+  pthread_mutex_unlock(&t->lock);
+  return guest;
+}
+
+int fd_close(fd_table_t *t, u64 guest) {
+  pthread_mutex_lock(&t->lock);
+  int ret = guest < (u64)t->num && !fd_is_free(t, guest)
+                ? fd_release(&t->ent[guest])
+                : -EBADF;
+  pthread_mutex_unlock(&t->lock);
+  return ret;
+}
+
+int fd_cwd(fd_table_t *t) {
+  return __atomic_load_n(&t->cwd, __ATOMIC_ACQUIRE);
+}
+
+// takes ownership of host, a dirfd for the new working directory.
+void fd_chdir(fd_table_t *t, int host) {
+  pthread_mutex_lock(&t->lock);
+  if (t->cwd == AT_FDCWD) {
+    __atomic_store_n(&t->cwd, host, __ATOMIC_RELEASE);
+  } else {
+    dup3(host, t->cwd, O_CLOEXEC);
+    close(host);
+  }
+  pthread_mutex_unlock(&t->lock);
+}
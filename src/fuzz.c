@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include "rvemu.h"
+
+/*
+    AFL fork server.
+
+    Loading the ELF and running the guest up to where it starts on its
+    input is the same for every test case, so it is done once: the parent
+    stops there and then forks a child per test case on the fuzzer's
+    request. The child carries on from the fork point with the guest's
+    memory, decoded blocks and all, already in place. This is AFL's
+    forkserver protocol on fds 198 (control) and 199 (status); not being
+    under AFL shows as the hello on 199 failing, and the guest then just
+    runs once.
+
+    If the fuzzer offers shared-memory test cases (__AFL_SHM_FUZZ_ID, the
+    AFL++ option), each child's guest stdin is the test case, read from
+    that memory rather than a file. If it offers a coverage map
+    (__AFL_SHM_ID), machine_step counts block-to-block edges into it.
+*/
+
+#define FORKSRV_FD         198
+#define FS_OPT_ENABLED     0x80000001
+#define FS_OPT_SHDMEM_FUZZ 0x01000000
+#define AFL_MAP_SIZE       (1 << 16)
+#define AFL_MAX_INPUT      (1 << 20)
+
+static void *shm_attach(char *env) {
+  char *id = getenv(env);
+  if (!id) {
+    return NULL;
+  }
+  void *p = shmat(atoi(id), NULL, 0);
+  return p == (void *)-1 ? NULL : p;
+}
+
+static void attach_coverage(machine_t *m) {
+  u8 *map = shm_attach("__AFL_SHM_ID");
+  if (!map) {
+    return;
+  }
+  char *size = getenv("AFL_MAP_SIZE");
+  u64 len = size ? strtoull(size, NULL, 0) : AFL_MAP_SIZE;
+  // edges are hashed into a power of two.
+  u64 mask = 1;
+  while (mask * 2 <= len) {
+    mask *= 2;
+  }
+  m->cov_map = map;
+  m->cov_mask = mask - 1;
+}
+
+// guest stdin becomes an in-memory file holding this test case.
+static void install_input(machine_t *m, u8 *shm) {
+  u32 len = MIN(*(u32 *)shm, (u32)AFL_MAX_INPUT);
+  int fd = memfd_create("afl-input", MFD_CLOEXEC);
+  if (fd == -1 || write(fd, shm + sizeof(u32), len) != len ||
+      lseek(fd, 0, SEEK_SET) != 0) {
+    fatal(strerror(errno));
+  }
+  fd_install(m->fds, 0, (fd_entry_t){fd, NULL});
+}
+
+// returns true in each forked child, which goes on to run the guest; the
+// server itself never returns once a fuzzer is talking to it, and returns
+// false straight away if none is.
+bool fuzz_fork_server(machine_t *m) {
+  attach_coverage(m);
+  u8 *input = shm_attach("__AFL_SHM_FUZZ_ID");
+
+  u32 status = input ? FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ : 0;
+  if (write(FORKSRV_FD + 1, &status, sizeof(status)) != sizeof(status)) {
+    return false;
+  }
+  if (input) {
+    // the fuzzer confirms the options it takes.
+    u32 reply;
+    if (read(FORKSRV_FD, &reply, sizeof(reply)) != sizeof(reply)) {
+      exit(1);
+    }
+    if (!(reply & FS_OPT_SHDMEM_FUZZ)) {
+      input = NULL;
+    }
+  }
+
+  // children must not write out what the parent buffered before the fork.
+  output_flush(m);
+
+  while (true) {
+    u32 was_killed;
+    if (read(FORKSRV_FD, &was_killed, sizeof(was_killed)) !=
+        sizeof(was_killed)) {
+      exit(0);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+      fatal(strerror(errno));
+    }
+    if (pid == 0) {
+      close(FORKSRV_FD);
+      close(FORKSRV_FD + 1);
+      if (input) {
+        install_input(m, input);
+      }
+      return true;
+    }
+
+    int wstatus;
+    if (write(FORKSRV_FD + 1, &pid, sizeof(pid)) != sizeof(pid) ||
+        waitpid(pid, &wstatus, 0) == -1 ||
+        write(FORKSRV_FD + 1, &wstatus, sizeof(wstatus)) !=
+            sizeof(wstatus)) {
+      exit(1);
+    }
+  }
+}
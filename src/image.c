@@ -0,0 +1,165 @@
+#include <pthread.h>
+
+#include "rvemu.h"
+
+/*
+    Process-wide registry of loaded guest binaries.
+
+    Guests started from the same file share one image_t, and with it the
+    blocks decoded from the file's read-only segments: those are decoded
+    once, from a mapping the image keeps of its own, instead of once per
+    guest. Each guest maps the segments privately, so the text pages it
+    never writes are the page cache's whichever way it is run.
+*/
+
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+static image_t *images = NULL;
+
+image_t *image_get(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    fatal(strerror(errno));
+  }
+
+  pthread_mutex_lock(&images_lock);
+
+  image_t *image = images;
+  for (; image; image = image->next) {
+    if (image->dev == st.st_dev && image->ino == st.st_ino &&
+        image->size == (u64)st.st_size &&
+        image->mtime.tv_sec == st.st_mtim.tv_sec &&
+        image->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+      break;
+    }
+  }
+
+  if (!image) {
+    image = calloc(1, sizeof(image_t));
+    if (!image) {
+      fatal("out of memory");
+    }
+    image->dev = st.st_dev;
+    image->ino = st.st_ino;
+    image->size = st.st_size;
+    image->mtime = st.st_mtim;
+    image->blocks = block_cache_new();
+    image->next = images;
+    images = image;
+  }
+
+  image->refs++;
+  pthread_mutex_unlock(&images_lock);
+  return image;
+}
+
+// another reference to an image already held.
+image_t *image_ref(image_t *image) {
+  pthread_mutex_lock(&images_lock);
+  image->refs++;
+  pthread_mutex_unlock(&images_lock);
+  return image;
+}
+
+void image_put(image_t *image) {
+  pthread_mutex_lock(&images_lock);
+
+  if (--image->refs == 0) {
+    image_t **p = &images;
+    while (*p != image) {
+      p = &(*p)->next;
+    }
+    *p = image->next;
+    for (int i = 0; i < image->num_text; i++) {
+      munmap((void *)image->text[i].host, image->text[i].len);
+    }
+    block_cache_free(image->blocks);
+    free(image);
+  }
+
+  pthread_mutex_unlock(&images_lock);
+}
+
+// record a read-only segment. Every guest maps the same ones, so only the
+// first to load the image keeps a reference mapping of it; that mapping
+// stays valid for as long as the image does, whichever guests come and go.
+void image_add_text(image_t *image, int fd, u64 addr, u64 len, u64 offset) {
+  pthread_mutex_lock(&images_lock);
+
+  bool seen = false;
+  for (int i = 0; i < image->num_text; i++) {
+    if (image->text[i].addr == addr) {
+      seen = true;
+    }
+  }
+
+  if (!seen && image->num_text < IMAGE_MAX_TEXT) {
+    void *host = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+    if (host == MAP_FAILED) {
+      fatal(strerror(errno));
+    }
+    image->text[image->num_text] = (image_text_t){addr, len, (u64)host};
+    image->num_text++;
+    image->text_bytes += ROUNDUP(len, getpagesize());
+  }
+
+  pthread_mutex_unlock(&images_lock);
+}
+
+// the cached block at pc, decoding it on first use, or NULL if pc is not
+// in the image text. Text sits below the heap, where a guest cannot map,
+// and a guest that makes it writable stops asking (see mmu_protect), so a
+// block decoded once stays right for every guest that uses it.
+block_t *image_block(image_t *image, u64 pc) {
+  block_t *b = block_cache_lookup(image->blocks, pc);
+  if (b) {
+    return b;
+  }
+
+  for (int i = 0; i < image->num_text; i++) {
+    image_text_t *t = &image->text[i];
+    if (pc >= t->addr && pc < t->addr + t->len) {
+      u64 off = pc - t->addr;
+      b = block_decode((u8 *)t->host + off, pc, t->len - off);
+      return b ? block_cache_insert(image->blocks, b) : NULL;
+    }
+  }
+  return NULL;
+}
+
+// resident text is page cache, shared by every guest that has not written
+// to it whether they run in one process or one each; what running them in
+// one process saves is decoding the blocks once for all of them.
+// private_bytes is the average a guest held on its own, text it wrote to
+// included, which costs the same either way.
+void image_report(FILE *out, image_t *image, int guests, u64 private_bytes) {
+  int page_size = getpagesize();
+  u64 resident = 0;
+
+  pthread_mutex_lock(&images_lock);
+  for (int i = 0; i < image->num_text; i++) {
+    image_text_t *t = &image->text[i];
+    u64 npages = ROUNDUP(t->len, page_size) / page_size;
+    u8 *vec = malloc(npages);
+    if (!vec) {
+      fatal("out of memory");
+    }
+    if (mincore((void *)t->host, t->len, vec) == 0) {
+      for (u64 j = 0; j < npages; j++) {
+        resident += (vec[j] & 1) * page_size;
+      }
+    }
+    free(vec);
+  }
+  pthread_mutex_unlock(&images_lock);
+
+  pthread_mutex_lock(&image->blocks->lock);
+  u64 blocks = image->blocks->bytes;
+  pthread_mutex_unlock(&image->blocks->lock);
+
+  fprintf(out,
+          "image %lx:%lu: %d guests, %lu KiB text, %lu KiB resident, "
+          "%lu KiB private per guest, %lu KiB decoded blocks, %lu KiB saved\n",
+          (u64)image->dev, (u64)image->ino, guests, image->text_bytes / 1024,
+          resident / 1024, private_bytes / 1024, blocks / 1024,
+          blocks * (guests - 1) / 1024);
+}
@@ -2,14 +2,10 @@
 
 typedef void(func_t)(state_t *, inst_t *);
 
-static void func_empty(state_t *state, inst_t *inst) {
-  state->exit_reason = ecall;
-}
-
 // LOAD INSTRUCTION I-TYPE
 #define FUNC(typ)                                        \
   u64 addr = state->gp_regs[inst->rs1] + (i64)inst->imm; \
-  state->gp_regs[inst->rd] = *(typ *)TO_HOST(addr);
+  state->gp_regs[inst->rd] = *(typ *)TO_HOST(state->mem_base, addr);
 
 // load byte
 static void func_lb(state_t *state, inst_t *inst) { FUNC(i8); }
@@ -35,12 +31,11 @@ static void func_lwu(state_t *state, inst_t *inst) { FUNC(u32); }
 #undef FUNC
 
 // FENCE INSTRUCTION I-TYPE
-static void func_fence(state_t *state, inst_t *inst) {
-  func_empty(state, inst);
-}
-static void func_fence_i(state_t *state, inst_t *inst) {
-  func_empty(state, inst);
-}
+// no-ops that leave exit_reason to the rest of the block. Guest threads
+// are host threads, whose atomics already order memory; fence.i does not
+// flush decoded blocks, as guests that rewrite their code are unsupported.
+static void func_fence(state_t *state, inst_t *inst) {}
+static void func_fence_i(state_t *state, inst_t *inst) {}
 
 // ADD INSTRUCTION I-TYPE
 
@@ -118,8 +113,8 @@ static void func_auipc(state_t *state, inst_t *inst) {
 
 #define FUNC(typ)                      \
   u64 rs1 = state->gp_regs[inst->rs1]; \
-  u64 rs2 = state->gp_regs[inst->rs1]; \
-  *(typ *)TO_HOST(rs1 + inst->imm) = (typ)rs2;
+  u64 rs2 = state->gp_regs[inst->rs2]; \
+  *(typ *)TO_HOST(state->mem_base, rs1 + inst->imm) = (typ)rs2;
 
 // store byte
 static void func_sb(state_t *state, inst_t *inst) { FUNC(u8); }
@@ -139,7 +134,7 @@ static void func_sd(state_t *state, inst_t *inst) { FUNC(u64); }
 
 #define FUNC(expr)                     \
   u64 rs1 = state->gp_regs[inst->rs1]; \
-  u64 rs2 = state->gp_regs[inst->rs1]; \
+  u64 rs2 = state->gp_regs[inst->rs2]; \
   state->gp_regs[inst->rd] = (expr);
 
 // add
@@ -191,7 +186,7 @@ static void func_mulhu(state_t *state, inst_t *inst) { FUNC(mulhu(rs1, rs2)); }
 // divide
 static void func_div(state_t *state, inst_t *inst) {
   u64 rs1 = state->gp_regs[inst->rs1];
-  u64 rs2 = state->gp_regs[inst->rs1];
+  u64 rs2 = state->gp_regs[inst->rs2];
   u64 rd = 0;
 
   if (rs2 == 0) {
@@ -208,7 +203,7 @@ static void func_div(state_t *state, inst_t *inst) {
 // divide unsigned
 static void func_divu(state_t *state, inst_t *inst) {
   u64 rs1 = state->gp_regs[inst->rs1];
-  u64 rs2 = state->gp_regs[inst->rs1];
+  u64 rs2 = state->gp_regs[inst->rs2];
   u64 rd = 0;
 
   if (rs2 == 0) {
@@ -223,7 +218,7 @@ static void func_divu(state_t *state, inst_t *inst) {
 // remainder
 static void func_rem(state_t *state, inst_t *inst) {
   u64 rs1 = state->gp_regs[inst->rs1];
-  u64 rs2 = state->gp_regs[inst->rs1];
+  u64 rs2 = state->gp_regs[inst->rs2];
   u64 rd = 0;
 
   if (rs2 == 0) {
@@ -240,7 +235,7 @@ static void func_rem(state_t *state, inst_t *inst) {
 // remainder unsigned
 static void func_remu(state_t *state, inst_t *inst) {
   u64 rs1 = state->gp_regs[inst->rs1];
-  u64 rs2 = state->gp_regs[inst->rs1];
+  u64 rs2 = state->gp_regs[inst->rs2];
   u64 rd = 0;
 
   if (rs2 == 0) {
@@ -321,12 +316,11 @@ static void func_sraw(state_t *state, inst_t *inst) {
 
 #define FUNC(expr)                               \
   u64 rs1 = state->gp_regs[inst->rs1];           \
-  u64 rs2 = state->gp_regs[inst->rs1];           \
+  u64 rs2 = state->gp_regs[inst->rs2];           \
   u64 target_addr = state->pc + (i64)inst->imm;  \
   if (expr) {                                    \
     state->reenter_pc = state->pc = target_addr; \
     state->exit_reason = direct_branch;          \
-    inst->cont = true;                           \
   }
 
 // branch if equal
@@ -380,24 +374,156 @@ static void func_ecall(state_t *state, inst_t *inst) {
   state->reenter_pc = state->pc + 4;
 }
 
+// FLOATING-POINT ENVIRONMENT
+// the guest's fflags are accrued lazily in the host's own exception flags:
+// they are cleared when a run of blocks starts, FP instructions run with
+// nothing extra to do, and what they raised is only harvested into
+// state->fflags when the run ends or the guest reads the flags. Likewise
+// the host rounding mode is left alone unless frm asks for a different
+// one than this host thread already has, and whatever the thread had is
+// put back when the run ends.
+#define FFLAG_NX 0x01
+#define FFLAG_UF 0x02
+#define FFLAG_OF 0x04
+#define FFLAG_DZ 0x08
+#define FFLAG_NV 0x10
+
+// rmm has no host counterpart; ties go to even instead.
+static const int host_modes[] = {
+    [rne] = FE_TONEAREST, [rtz] = FE_TOWARDZERO, [rdn] = FE_DOWNWARD,
+    [rup] = FE_UPWARD,    [rmm] = FE_TONEAREST,
+};
+
+static __thread int host_mode = FE_TONEAREST;
+// the mode the host thread had before the run, for fp_leave.
+static __thread int saved_mode = FE_TONEAREST;
+
+static void fp_set_round(u32 frm) {
+  int mode = frm < ARRAY_SIZE(host_modes) ? host_modes[frm] : FE_TONEAREST;
+  if (mode != host_mode) {
+    fesetround(mode);
+    host_mode = mode;
+  }
+}
+
+static void fp_harvest(state_t *state) {
+  int e = fetestexcept(FE_ALL_EXCEPT);
+  state->fflags |= (e & FE_INEXACT ? FFLAG_NX : 0) |
+                   (e & FE_UNDERFLOW ? FFLAG_UF : 0) |
+                   (e & FE_OVERFLOW ? FFLAG_OF : 0) |
+                   (e & FE_DIVBYZERO ? FFLAG_DZ : 0) |
+                   (e & FE_INVALID ? FFLAG_NV : 0);
+}
+
+// called with the host thread about to run this guest's blocks.
+void fp_enter(state_t *state) {
+  feclearexcept(FE_ALL_EXCEPT);
+  saved_mode = host_mode = fegetround();
+  fp_set_round(state->frm);
+}
+
+// and once it stops, before the thread does anything else.
+void fp_leave(state_t *state) {
+  fp_harvest(state);
+  if (host_mode != saved_mode) {
+    fesetround(saved_mode);
+    host_mode = saved_mode;
+  }
+}
+
+static u64 csr_read(state_t *state, i16 csr) {
+  switch (csr) {
+    case fflags:
+      fp_harvest(state);
+      return state->fflags;
+    case frm:
+      return state->frm;
+    case fcsr:
+      fp_harvest(state);
+      return state->frm << 5 | state->fflags;
+    case vstart:
+      return state->vstart;
+    case vxsat:
+      return state->vxsat;
+    case vxrm:
+      return state->vxrm;
+    case vcsr:
+      return state->vxrm << 1 | state->vxsat;
+    case vl:
+      return state->vl;
+    case vtype:
+      return state->vtype;
+    case vlenb:
+      return state->vlenb;
+    default:
+      fatal("unsupported csr");
+  }
+}
+
+static void csr_write(state_t *state, i16 csr, u64 val) {
+  switch (csr) {
+    case fcsr:
+      state->frm = (val >> 5) & 0x7;
+      fp_set_round(state->frm);
+      // fall through
+    case fflags:
+      state->fflags = val & 0x1f;
+      feclearexcept(FE_ALL_EXCEPT);
+      break;
+    case frm:
+      state->frm = val & 0x7;
+      fp_set_round(state->frm);
+      break;
+    case vstart:
+      state->vstart = val;
+      break;
+    case vcsr:
+      state->vxrm = (val >> 1) & 0x3;
+      state->vxsat = val & 0x1;
+      break;
+    case vxsat:
+      state->vxsat = val & 0x1;
+      break;
+    case vxrm:
+      state->vxrm = val & 0x3;
+      break;
+    case vl:
+    case vtype:
+    case vlenb:
+      fatal("write to read-only csr");
+    default:
+      fatal("unsupported csr");
+  }
+}
+
 // CONTROL INSTURCTION
-#define FUNC()                  \
-  switch (inst->csr) {          \
-    case fflags:                \
-    case frm:                   \
-    case fcsr:                  \
-      break;                    \
-    default:                    \
-      fatal("unsupported csr"); \
-  }                             \
-  state->gp_regs[inst->rd] = 0;
-
-static void func_csrrw(state_t *state, inst_t *inst) { FUNC(); }
-static void func_csrrs(state_t *state, inst_t *inst) { FUNC(); }
-static void func_csrrc(state_t *state, inst_t *inst) { FUNC(); }
-static void func_csrrwi(state_t *state, inst_t *inst) { FUNC(); }
-static void func_csrrsi(state_t *state, inst_t *inst) { FUNC(); }
-static void func_csrrci(state_t *state, inst_t *inst) { FUNC(); }
+// the set/clear forms only write when rs1 (or the immediate) is non-zero.
+#define FUNC(src, write, val)                \
+  u64 v = (src);                             \
+  u64 old = csr_read(state, inst->csr);      \
+  if (write) {                               \
+    csr_write(state, inst->csr, val);        \
+  }                                          \
+  state->gp_regs[inst->rd] = old;
+
+static void func_csrrw(state_t *state, inst_t *inst) {
+  FUNC(state->gp_regs[inst->rs1], true, v);
+}
+static void func_csrrs(state_t *state, inst_t *inst) {
+  FUNC(state->gp_regs[inst->rs1], inst->rs1 != 0, old | v);
+}
+static void func_csrrc(state_t *state, inst_t *inst) {
+  FUNC(state->gp_regs[inst->rs1], inst->rs1 != 0, old & ~v);
+}
+static void func_csrrwi(state_t *state, inst_t *inst) {
+  FUNC(inst->rs1, true, v);
+}
+static void func_csrrsi(state_t *state, inst_t *inst) {
+  FUNC(inst->rs1, v != 0, old | v);
+}
+static void func_csrrci(state_t *state, inst_t *inst) {
+  FUNC(inst->rs1, v != 0, old & ~v);
+}
 
 #undef FUNC
 
@@ -406,19 +532,20 @@ static void func_csrrci(state_t *state, inst_t *inst) { FUNC(); }
 // floating-point load word
 static void func_flw(state_t *state, inst_t *inst) {
   u64 addr = state->gp_regs[inst->rs1] + (i64)inst->imm;
-  state->fp_regs[inst->rd].v = *(u32 *)TO_HOST(addr) | ((u64)-1 << 32);
+  state->fp_regs[inst->rd].v =
+      *(u32 *)TO_HOST(state->mem_base, addr) | ((u64)-1 << 32);
 }
 
 // floating-point load doubleword
 static void func_fld(state_t *state, inst_t *inst) {
   u64 addr = state->gp_regs[inst->rs1] + (i64)inst->imm;
-  state->fp_regs[inst->rd].v = *(u64 *)TO_HOST(addr);
+  state->fp_regs[inst->rd].v = *(u64 *)TO_HOST(state->mem_base, addr);
 }
 
-#define FUNC(typ)                      \
-  u64 rs1 = state->gp_regs[inst->rs1]; \
-  u64 rs2 = state->gp_regs[inst->rs2]; \
-  *(typ *)TO_HOST(rs1 + (i64)inst->imm) = (typ)rs2;
+#define FUNC(typ)                        \
+  u64 rs1 = state->gp_regs[inst->rs1];   \
+  u64 rs2 = state->fp_regs[inst->rs2].v; \
+  *(typ *)TO_HOST(state->mem_base, rs1 + (i64)inst->imm) = (typ)rs2;
 
 // floating-point store word
 static void func_fsw(state_t *state, inst_t *inst) { FUNC(u32); }
@@ -436,22 +563,22 @@ static void func_fsd(state_t *state, inst_t *inst) { FUNC(u64); }
 
 // floating-point fused multiply-add, single precision
 static void func_fmadd_s(state_t *state, inst_t *inst) {
-  FUNC(rs1 * rs2 + rs3);
+  FUNC(fmaf(rs1, rs2, rs3));
 }
 
 // floating-point fused multiply-subtract, single precision
 static void func_fmsub_s(state_t *state, inst_t *inst) {
-  FUNC(rs1 * rs2 - rs3);
+  FUNC(fmaf(rs1, rs2, -rs3));
 }
 
 // floating-point fused negative multiply-subtract, single precision
 static void func_fnmsub_s(state_t *state, inst_t *inst) {
-  FUNC(-(rs1 * rs2) + rs3);
+  FUNC(fmaf(-rs1, rs2, rs3));
 }
 
 // floating-point fused negative multiply-add, single precision
 static void func_fnmadd_s(state_t *state, inst_t *inst) {
-  FUNC(-(rs1 * rs2) - rs3);
+  FUNC(fmaf(-rs1, rs2, -rs3));
 }
 
 #undef FUNC
@@ -463,16 +590,16 @@ static void func_fnmadd_s(state_t *state, inst_t *inst) {
   state->fp_regs[inst->rd].d = (expr);
 
 static void func_fmadd_d(state_t *state, inst_t *inst) {
-  FUNC(rs1 * rs2 + rs3);
+  FUNC(fma(rs1, rs2, rs3));
 }
 static void func_fmsub_d(state_t *state, inst_t *inst) {
-  FUNC(rs1 * rs2 - rs3);
+  FUNC(fma(rs1, rs2, -rs3));
 }
 static void func_fnmsub_d(state_t *state, inst_t *inst) {
-  FUNC(-(rs1 * rs2) + rs3);
+  FUNC(fma(-rs1, rs2, rs3));
 }
 static void func_fnmadd_d(state_t *state, inst_t *inst) {
-  FUNC(-(rs1 * rs2) - rs3);
+  FUNC(fma(-rs1, rs2, -rs3));
 }
 
 #undef FUNC
@@ -520,9 +647,9 @@ static void func_fdiv_d(state_t *state, inst_t *inst) { FUNC(rs1 / rs2); }
 
 static void func_fsqrt_d(state_t *state, inst_t *inst) { FUNC(sqrt(rs1)); }
 
-static void func_fmin_d(state_t *state, inst_t *inst) { FUNC(fminf(rs1, rs2)); }
+static void func_fmin_d(state_t *state, inst_t *inst) { FUNC(fmin(rs1, rs2)); }
 
-static void func_fmax_d(state_t *state, inst_t *inst) { FUNC(fmaxf(rs1, rs2)); }
+static void func_fmax_d(state_t *state, inst_t *inst) { FUNC(fmax(rs1, rs2)); }
 
 #undef FUNC
 
@@ -551,21 +678,26 @@ static void func_fsgnjx_d(state_t *state, inst_t *inst) { FUNC(false, true); }
 
 #undef FUNC
 
+// conversions to integer take rm straight from the instruction (rtz is
+// what every C cast compiles to), so they never switch the host mode.
 static void func_fcvt_w_s(state_t *state, inst_t *inst) {
-  state->gp_regs[inst->rd] = (i64)(i32)llrintf(state->fp_regs[inst->rs1].f);
+  state->gp_regs[inst->rd] =
+      (i64)(i32)fcvt_signed(state->fp_regs[inst->rs1].f, inst->rm, 32);
 }
 
 static void func_fcvt_wu_s(state_t *state, inst_t *inst) {
   state->gp_regs[inst->rd] =
-      (i64)(i32)(u32)llrintf(state->fp_regs[inst->rs1].f);
+      (i64)(i32)(u32)fcvt_unsigned(state->fp_regs[inst->rs1].f, inst->rm, 32);
 }
 
 static void func_fcvt_w_d(state_t *state, inst_t *inst) {
-  state->gp_regs[inst->rd] = (i64)(i32)llrint(state->fp_regs[inst->rs1].d);
+  state->gp_regs[inst->rd] =
+      (i64)(i32)fcvt_signed(state->fp_regs[inst->rs1].d, inst->rm, 32);
 }
 
 static void func_fcvt_wu_d(state_t *state, inst_t *inst) {
-  state->gp_regs[inst->rd] = (i64)(i32)(u32)llrint(state->fp_regs[inst->rs1].d);
+  state->gp_regs[inst->rd] =
+      (i64)(i32)(u32)fcvt_unsigned(state->fp_regs[inst->rs1].d, inst->rm, 32);
 }
 
 static void func_fcvt_s_w(state_t *state, inst_t *inst) {
@@ -634,19 +766,23 @@ static void func_fclass_d(state_t *state, inst_t *inst) {
 }
 
 static void func_fcvt_l_s(state_t *state, inst_t *inst) {
-  state->gp_regs[inst->rd] = (i64)llrintf(state->fp_regs[inst->rs1].f);
+  state->gp_regs[inst->rd] =
+      fcvt_signed(state->fp_regs[inst->rs1].f, inst->rm, 64);
 }
 
 static void func_fcvt_lu_s(state_t *state, inst_t *inst) {
-  state->gp_regs[inst->rd] = (u64)llrintf(state->fp_regs[inst->rs1].f);
+  state->gp_regs[inst->rd] =
+      fcvt_unsigned(state->fp_regs[inst->rs1].f, inst->rm, 64);
 }
 
 static void func_fcvt_l_d(state_t *state, inst_t *inst) {
-  state->gp_regs[inst->rd] = (i64)llrint(state->fp_regs[inst->rs1].d);
+  state->gp_regs[inst->rd] =
+      fcvt_signed(state->fp_regs[inst->rs1].d, inst->rm, 64);
 }
 
 static void func_fcvt_lu_d(state_t *state, inst_t *inst) {
-  state->gp_regs[inst->rd] = (u64)llrint(state->fp_regs[inst->rs1].d);
+  state->gp_regs[inst->rd] =
+      fcvt_unsigned(state->fp_regs[inst->rs1].d, inst->rm, 64);
 }
 
 static void func_fcvt_s_l(state_t *state, inst_t *inst) {
@@ -673,6 +809,767 @@ static void func_fcvt_d_s(state_t *state, inst_t *inst) {
   state->fp_regs[inst->rd].d = (f64)state->fp_regs[inst->rs1].f;
 }
 
+// STATIC ROUNDING
+// the instruction's own rm holds for just this op; switching costs nothing
+// when it is the mode frm already has the host in.
+#define FUNC(name)                                             \
+  static void func_##name##_rm(state_t *state, inst_t *inst) { \
+    fp_set_round(inst->rm);                                    \
+    func_##name(state, inst);                                  \
+    fp_set_round(state->frm);                                  \
+  }
+
+FUNC(fmadd_s)
+FUNC(fmsub_s)
+FUNC(fnmsub_s)
+FUNC(fnmadd_s)
+FUNC(fadd_s)
+FUNC(fsub_s)
+FUNC(fmul_s)
+FUNC(fdiv_s)
+FUNC(fsqrt_s)
+FUNC(fcvt_s_w)
+FUNC(fcvt_s_wu)
+FUNC(fcvt_s_l)
+FUNC(fcvt_s_lu)
+FUNC(fmadd_d)
+FUNC(fmsub_d)
+FUNC(fnmsub_d)
+FUNC(fnmadd_d)
+FUNC(fadd_d)
+FUNC(fsub_d)
+FUNC(fmul_d)
+FUNC(fdiv_d)
+FUNC(fsqrt_d)
+FUNC(fcvt_s_d)
+FUNC(fcvt_d_l)
+FUNC(fcvt_d_lu)
+
+#undef FUNC
+
+// VECTOR INSTRUCTIONS
+// element loops over the register file, vl elements of the current SEW.
+// Tails and masked-off elements are left undisturbed (which the agnostic
+// policies allow too), and vstart is always 0 since nothing traps midway.
+// An unmasked loop is a plain array loop the compiler turns into host SIMD.
+#define VREG(v) (state->vregs + (v) * state->vlenb)
+
+static inline u32 vsew(state_t *state) {
+  if (state->vtype >> 63) {
+    fatal("vector instruction with vill set");
+  }
+  return 8 << ((state->vtype >> 3) & 0x7);
+}
+
+static inline bool vmask(state_t *state, u64 i) {
+  return state->vregs[i / 8] >> (i % 8) & 1;
+}
+
+static inline void vmask_put(u8 *vd, u64 i, bool bit) {
+  vd[i / 8] = (vd[i / 8] & ~(1 << (i % 8))) | (bit << (i % 8));
+}
+
+// the scalar operand of a .vx or .vi form.
+static inline u64 vscalar(state_t *state, inst_t *inst) {
+  return inst->vform == form_vi ? (u64)(i64)inst->imm
+                                : state->gp_regs[inst->rs1];
+}
+
+// VLMAX for vtype, or 0 if the vtype is not one we support.
+static u64 vlmax(state_t *state, u64 vtype) {
+  u32 vsew = (vtype >> 3) & 0x7;
+  u32 vlmul = vtype & 0x7;
+  if ((vtype >> 8) || vsew > 3 || vlmul == 4) {
+    return 0;
+  }
+  u64 sew = 8 << vsew;
+  u64 n = state->vlenb * 8 / sew;
+  // fractional LMUL needs SEW <= LMUL * ELEN, ELEN being 64.
+  return vlmul < 4 ? n << vlmul : sew << (8 - vlmul) <= 64 ? n >> (8 - vlmul)
+                                                           : 0;
+}
+
+static u64 vset(state_t *state, u64 avl, u64 vtype) {
+  u64 max = vlmax(state, vtype);
+  if (!max) {
+    state->vtype = 1ULL << 63;
+    state->vl = 0;
+  } else {
+    state->vtype = vtype;
+    state->vl = MIN(avl, max);
+  }
+  state->vstart = 0;
+  return state->vl;
+}
+
+// rs1 = x0 asks for VLMAX, unless rd is x0 too, which keeps vl.
+static u64 vavl(state_t *state, inst_t *inst) {
+  return inst->rs1 ? state->gp_regs[inst->rs1]
+                   : inst->rd ? UINT64_MAX : state->vl;
+}
+
+static void func_vsetvli(state_t *state, inst_t *inst) {
+  state->gp_regs[inst->rd] = vset(state, vavl(state, inst), (u64)inst->imm);
+}
+
+static void func_vsetivli(state_t *state, inst_t *inst) {
+  state->gp_regs[inst->rd] = vset(state, inst->rs1, (u64)inst->imm);
+}
+
+static void func_vsetvl(state_t *state, inst_t *inst) {
+  state->gp_regs[inst->rd] =
+      vset(state, vavl(state, inst), state->gp_regs[inst->rs2]);
+}
+
+#define VFOR(body)                 \
+  if (inst->vm) {                  \
+    for (u64 i = 0; i < vl; i++) { \
+      body;                        \
+    }                              \
+  } else {                         \
+    for (u64 i = 0; i < vl; i++) { \
+      if (vmask(state, i)) {       \
+        body;                      \
+      }                            \
+    }                              \
+  }
+
+// loads and stores may not span more than eight registers (EMUL <= 8).
+#define VMEM(typ)                                                 \
+  vsew(state);                                                    \
+  u64 vl = state->vl;                                             \
+  if (vl * sizeof(typ) > 8 * state->vlenb) {                      \
+    fatal("vector access wider than eight registers");            \
+  }                                                               \
+  typ *vd = (typ *)VREG(inst->rd);                                \
+  u64 addr = state->gp_regs[inst->rs1];                           \
+  __attribute__((unused)) i64 stride = state->gp_regs[inst->rs2]; \
+  __attribute__((unused)) typ *mem = (typ *)TO_HOST(state->mem_base, addr);
+
+#define FUNC(typ)                      \
+  VMEM(typ);                           \
+  if (inst->vm) {                      \
+    memcpy(vd, mem, vl * sizeof(typ)); \
+  } else {                             \
+    VFOR(vd[i] = mem[i]);              \
+  }
+
+static void func_vle8_v(state_t *state, inst_t *inst) { FUNC(u8); }
+static void func_vle16_v(state_t *state, inst_t *inst) { FUNC(u16); }
+static void func_vle32_v(state_t *state, inst_t *inst) { FUNC(u32); }
+static void func_vle64_v(state_t *state, inst_t *inst) { FUNC(u64); }
+
+#undef FUNC
+
+#define FUNC(typ)                      \
+  VMEM(typ);                           \
+  if (inst->vm) {                      \
+    memcpy(mem, vd, vl * sizeof(typ)); \
+  } else {                             \
+    VFOR(mem[i] = vd[i]);              \
+  }
+
+static void func_vse8_v(state_t *state, inst_t *inst) { FUNC(u8); }
+static void func_vse16_v(state_t *state, inst_t *inst) { FUNC(u16); }
+static void func_vse32_v(state_t *state, inst_t *inst) { FUNC(u32); }
+static void func_vse64_v(state_t *state, inst_t *inst) { FUNC(u64); }
+
+#undef FUNC
+
+#define FUNC(typ) \
+  VMEM(typ);      \
+  VFOR(vd[i] = *(typ *)TO_HOST(state->mem_base, addr + i * stride));
+
+static void func_vlse8_v(state_t *state, inst_t *inst) { FUNC(u8); }
+static void func_vlse16_v(state_t *state, inst_t *inst) { FUNC(u16); }
+static void func_vlse32_v(state_t *state, inst_t *inst) { FUNC(u32); }
+static void func_vlse64_v(state_t *state, inst_t *inst) { FUNC(u64); }
+
+#undef FUNC
+
+#define FUNC(typ) \
+  VMEM(typ);      \
+  VFOR(*(typ *)TO_HOST(state->mem_base, addr + i * stride) = vd[i]);
+
+static void func_vsse8_v(state_t *state, inst_t *inst) { FUNC(u8); }
+static void func_vsse16_v(state_t *state, inst_t *inst) { FUNC(u16); }
+static void func_vsse32_v(state_t *state, inst_t *inst) { FUNC(u32); }
+static void func_vsse64_v(state_t *state, inst_t *inst) { FUNC(u64); }
+
+#undef FUNC
+
+// mask loads and stores move ceil(vl / 8) bytes.
+static void func_vlm_v(state_t *state, inst_t *inst) {
+  memcpy(VREG(inst->rd),
+         (u8 *)TO_HOST(state->mem_base, state->gp_regs[inst->rs1]),
+         (state->vl + 7) / 8);
+}
+
+static void func_vsm_v(state_t *state, inst_t *inst) {
+  memcpy((u8 *)TO_HOST(state->mem_base, state->gp_regs[inst->rs1]),
+         VREG(inst->rd), (state->vl + 7) / 8);
+}
+
+// whole-register loads, stores and moves: imm registers, whatever vl and
+// vtype are.
+static void func_vlr_v(state_t *state, inst_t *inst) {
+  memcpy(VREG(inst->rd),
+         (u8 *)TO_HOST(state->mem_base, state->gp_regs[inst->rs1]),
+         inst->imm * state->vlenb);
+}
+
+static void func_vsr_v(state_t *state, inst_t *inst) {
+  memcpy((u8 *)TO_HOST(state->mem_base, state->gp_regs[inst->rs1]),
+         VREG(inst->rd), inst->imm * state->vlenb);
+}
+
+static void func_vmvr_v(state_t *state, inst_t *inst) {
+  memmove(VREG(inst->rd), VREG(inst->rs2), inst->imm * state->vlenb);
+}
+
+// instantiates M for the current SEW, with ut and st its unsigned and
+// signed element types.
+#define VINT(M, ...)                          \
+  __attribute__((unused)) u64 vl = state->vl; \
+  switch (vsew(state)) {                      \
+    case 8: {                                 \
+      typedef __attribute__((unused)) u8 ut;  \
+      typedef __attribute__((unused)) i8 st;  \
+      M(__VA_ARGS__);                         \
+      break;                                  \
+    }                                         \
+    case 16: {                                \
+      typedef __attribute__((unused)) u16 ut; \
+      typedef __attribute__((unused)) i16 st; \
+      M(__VA_ARGS__);                         \
+      break;                                  \
+    }                                         \
+    case 32: {                                \
+      typedef __attribute__((unused)) u32 ut; \
+      typedef __attribute__((unused)) i32 st; \
+      M(__VA_ARGS__);                         \
+      break;                                  \
+    }                                         \
+    default: {                                \
+      typedef __attribute__((unused)) u64 ut; \
+      typedef __attribute__((unused)) i64 st; \
+      M(__VA_ARGS__);                         \
+      break;                                  \
+    }                                         \
+  }
+
+// vd[i] = expr of a (vs2[i]), b (the other operand) and d (vd[i]).
+#define VBINARY(expr)                                             \
+  {                                                               \
+    ut *vd = (ut *)VREG(inst->rd);                                \
+    ut *vs2 = (ut *)VREG(inst->rs2);                              \
+    if (inst->vform == form_vv) {                                 \
+      ut *vs1 = (ut *)VREG(inst->rs1);                            \
+      VFOR(ut a = vs2[i]; ut b = vs1[i];                          \
+           __attribute__((unused)) ut d = vd[i]; vd[i] = (expr)); \
+    } else {                                                      \
+      ut b = (ut)vscalar(state, inst);                            \
+      VFOR(ut a = vs2[i]; __attribute__((unused)) ut d = vd[i];   \
+           vd[i] = (expr));                                       \
+    }                                                             \
+  }
+
+#define FUNC(expr) VINT(VBINARY, expr)
+
+#define SHAMT(b) ((b) & (sizeof(b) * 8 - 1))
+
+static void func_vadd(state_t *state, inst_t *inst) { FUNC(a + b); }
+static void func_vsub(state_t *state, inst_t *inst) { FUNC(a - b); }
+static void func_vrsub(state_t *state, inst_t *inst) { FUNC(b - a); }
+static void func_vminu(state_t *state, inst_t *inst) { FUNC(a < b ? a : b); }
+static void func_vmin(state_t *state, inst_t *inst) {
+  FUNC((st)a < (st)b ? a : b);
+}
+static void func_vmaxu(state_t *state, inst_t *inst) { FUNC(a > b ? a : b); }
+static void func_vmax(state_t *state, inst_t *inst) {
+  FUNC((st)a > (st)b ? a : b);
+}
+static void func_vand(state_t *state, inst_t *inst) { FUNC(a & b); }
+static void func_vor(state_t *state, inst_t *inst) { FUNC(a | b); }
+static void func_vxor(state_t *state, inst_t *inst) { FUNC(a ^ b); }
+static void func_vsll(state_t *state, inst_t *inst) { FUNC(a << SHAMT(b)); }
+static void func_vsrl(state_t *state, inst_t *inst) { FUNC(a >> SHAMT(b)); }
+static void func_vsra(state_t *state, inst_t *inst) {
+  FUNC((st)a >> SHAMT(b));
+}
+
+// products in u64, which wraps, rather than int, which would overflow.
+static void func_vmul(state_t *state, inst_t *inst) { FUNC((u64)a * b); }
+static void func_vdivu(state_t *state, inst_t *inst) {
+  FUNC(b == 0 ? (ut)-1 : a / b);
+}
+static void func_vdiv(state_t *state, inst_t *inst) {
+  FUNC(b == 0 ? (ut)-1 : (st)b == -1 ? 0 - a : (st)a / (st)b);
+}
+static void func_vremu(state_t *state, inst_t *inst) {
+  FUNC(b == 0 ? a : a % b);
+}
+static void func_vrem(state_t *state, inst_t *inst) {
+  FUNC(b == 0 ? a : (st)b == -1 ? 0 : (st)a % (st)b);
+}
+static void func_vmacc(state_t *state, inst_t *inst) {
+  FUNC((u64)b * a + d);
+}
+static void func_vnmsac(state_t *state, inst_t *inst) {
+  FUNC(d - (u64)b * a);
+}
+static void func_vmadd(state_t *state, inst_t *inst) {
+  FUNC((u64)b * d + a);
+}
+static void func_vnmsub(state_t *state, inst_t *inst) {
+  FUNC(a - (u64)b * d);
+}
+
+#undef SHAMT
+#undef FUNC
+
+// vmv.v.* is vmerge unmasked: every element takes the second operand.
+#define VMERGE(_)                                       \
+  {                                                     \
+    ut *vd = (ut *)VREG(inst->rd);                      \
+    ut *vs2 = (ut *)VREG(inst->rs2);                    \
+    ut *vs1 = (ut *)VREG(inst->rs1);                    \
+    ut x = (ut)vscalar(state, inst);                    \
+    for (u64 i = 0; i < vl; i++) {                      \
+      ut b = inst->vform == form_vv ? vs1[i] : x;       \
+      vd[i] = inst->vm || vmask(state, i) ? b : vs2[i]; \
+    }                                                   \
+  }
+
+static void func_vmerge(state_t *state, inst_t *inst) { VINT(VMERGE, 0); }
+
+#undef VMERGE
+
+// bit i of mask vd = expr of a (vs2[i]) and b.
+#define VCOMPARE(expr)                                              \
+  {                                                                 \
+    u8 *vd = VREG(inst->rd);                                        \
+    ut *vs2 = (ut *)VREG(inst->rs2);                                \
+    if (inst->vform == form_vv) {                                   \
+      ut *vs1 = (ut *)VREG(inst->rs1);                              \
+      VFOR(ut a = vs2[i]; ut b = vs1[i]; vmask_put(vd, i, (expr))); \
+    } else {                                                        \
+      ut b = (ut)vscalar(state, inst);                              \
+      VFOR(ut a = vs2[i]; vmask_put(vd, i, (expr)));                \
+    }                                                               \
+  }
+
+#define FUNC(expr) VINT(VCOMPARE, expr)
+
+static void func_vmseq(state_t *state, inst_t *inst) { FUNC(a == b); }
+static void func_vmsne(state_t *state, inst_t *inst) { FUNC(a != b); }
+static void func_vmsltu(state_t *state, inst_t *inst) { FUNC(a < b); }
+static void func_vmslt(state_t *state, inst_t *inst) { FUNC((st)a < (st)b); }
+static void func_vmsleu(state_t *state, inst_t *inst) { FUNC(a <= b); }
+static void func_vmsle(state_t *state, inst_t *inst) { FUNC((st)a <= (st)b); }
+static void func_vmsgtu(state_t *state, inst_t *inst) { FUNC(a > b); }
+static void func_vmsgt(state_t *state, inst_t *inst) { FUNC((st)a > (st)b); }
+
+#undef FUNC
+
+// vd[0] = vs1[0] folded with the active elements of vs2: a is the running
+// value, b the next element.
+#define VREDUCE(expr)                  \
+  if (vl) {                            \
+    ut *vs2 = (ut *)VREG(inst->rs2);   \
+    ut a = ((ut *)VREG(inst->rs1))[0]; \
+    VFOR(ut b = vs2[i]; a = (expr));   \
+    ((ut *)VREG(inst->rd))[0] = a;     \
+  }
+
+#define FUNC(expr) VINT(VREDUCE, expr)
+
+static void func_vredsum(state_t *state, inst_t *inst) { FUNC(a + b); }
+static void func_vredand(state_t *state, inst_t *inst) { FUNC(a & b); }
+static void func_vredor(state_t *state, inst_t *inst) { FUNC(a | b); }
+static void func_vredxor(state_t *state, inst_t *inst) { FUNC(a ^ b); }
+static void func_vredminu(state_t *state, inst_t *inst) {
+  FUNC(a < b ? a : b);
+}
+static void func_vredmin(state_t *state, inst_t *inst) {
+  FUNC((st)a < (st)b ? a : b);
+}
+static void func_vredmaxu(state_t *state, inst_t *inst) {
+  FUNC(a > b ? a : b);
+}
+static void func_vredmax(state_t *state, inst_t *inst) {
+  FUNC((st)a > (st)b ? a : b);
+}
+
+#undef FUNC
+
+#define VMV_X_S(_) \
+  state->gp_regs[inst->rd] = (i64)(st)((ut *)VREG(inst->rs2))[0];
+
+static void func_vmv_x_s(state_t *state, inst_t *inst) { VINT(VMV_X_S, 0); }
+
+#undef VMV_X_S
+
+#define VMV_S_X(_)                                             \
+  if (vl) {                                                    \
+    ((ut *)VREG(inst->rd))[0] = (ut)state->gp_regs[inst->rs1]; \
+  }
+
+static void func_vmv_s_x(state_t *state, inst_t *inst) { VINT(VMV_S_X, 0); }
+
+#undef VMV_S_X
+
+#define VID(_)                     \
+  {                                \
+    ut *vd = (ut *)VREG(inst->rd); \
+    VFOR(vd[i] = (ut)i);           \
+  }
+
+static void func_vid_v(state_t *state, inst_t *inst) { VINT(VID, 0); }
+
+#undef VID
+
+static void func_vcpop_m(state_t *state, inst_t *inst) {
+  u8 *vs2 = VREG(inst->rs2);
+  u64 vl = state->vl, n = 0;
+  VFOR(n += vs2[i / 8] >> (i % 8) & 1);
+  state->gp_regs[inst->rd] = n;
+}
+
+static void func_vfirst_m(state_t *state, inst_t *inst) {
+  u8 *vs2 = VREG(inst->rs2);
+  u64 vl = state->vl;
+  i64 first = -1;
+  VFOR(if (first < 0 && (vs2[i / 8] >> (i % 8) & 1)) first = i);
+  state->gp_regs[inst->rd] = first;
+}
+
+// mask logical ops, a word at a time; bits past vl are left alone.
+#define FUNC(expr)                             \
+  u64 *vd = (u64 *)VREG(inst->rd);             \
+  u64 *vs2 = (u64 *)VREG(inst->rs2);           \
+  u64 *vs1 = (u64 *)VREG(inst->rs1);           \
+  for (u64 w = 0; w * 64 < state->vl; w++) {   \
+    u64 a = vs2[w], b = vs1[w];                \
+    u64 left = state->vl - w * 64;             \
+    u64 keep = left >= 64 ? 0 : ~0ULL << left; \
+    vd[w] = (vd[w] & keep) | ((expr) & ~keep); \
+  }
+
+static void func_vmandn(state_t *state, inst_t *inst) { FUNC(a & ~b); }
+static void func_vmand(state_t *state, inst_t *inst) { FUNC(a & b); }
+static void func_vmor(state_t *state, inst_t *inst) { FUNC(a | b); }
+static void func_vmxor(state_t *state, inst_t *inst) { FUNC(a ^ b); }
+static void func_vmorn(state_t *state, inst_t *inst) { FUNC(a | ~b); }
+static void func_vmnand(state_t *state, inst_t *inst) { FUNC(~(a & b)); }
+static void func_vmnor(state_t *state, inst_t *inst) { FUNC(~(a | b)); }
+static void func_vmxnor(state_t *state, inst_t *inst) { FUNC(~(a ^ b)); }
+
+#undef FUNC
+
+// floating point: SEW 32 or 64, ft being the element type and fused its
+// fused multiply-add.
+#define VFP(M, ...)                                               \
+  __attribute__((unused)) u64 vl = state->vl;                     \
+  switch (vsew(state)) {                                          \
+    case 32: {                                                    \
+      typedef f32 ft;                                             \
+      __attribute__((unused)) f32 (*fused)(f32, f32, f32) = fmaf; \
+      M(__VA_ARGS__);                                             \
+      break;                                                      \
+    }                                                             \
+    case 64: {                                                    \
+      typedef f64 ft;                                             \
+      __attribute__((unused)) f64 (*fused)(f64, f64, f64) = fma;  \
+      M(__VA_ARGS__);                                             \
+      break;                                                      \
+    }                                                             \
+    default:                                                      \
+      fatal("unsupported vector fp sew");                         \
+  }
+
+#define VFSCALAR()                                   \
+  (sizeof(ft) == 4 ? (ft)state->fp_regs[inst->rs1].f \
+                   : (ft)state->fp_regs[inst->rs1].d)
+
+#define VFBINARY(expr)                                            \
+  {                                                               \
+    ft *vd = (ft *)VREG(inst->rd);                                \
+    ft *vs2 = (ft *)VREG(inst->rs2);                              \
+    if (inst->vform == form_vv) {                                 \
+      ft *vs1 = (ft *)VREG(inst->rs1);                            \
+      VFOR(ft a = vs2[i]; ft b = vs1[i];                          \
+           __attribute__((unused)) ft d = vd[i]; vd[i] = (expr)); \
+    } else {                                                      \
+      ft b = VFSCALAR();                                          \
+      VFOR(ft a = vs2[i]; __attribute__((unused)) ft d = vd[i];   \
+           vd[i] = (expr));                                       \
+    }                                                             \
+  }
+
+#define FUNC(expr) VFP(VFBINARY, expr)
+
+static void func_vfadd(state_t *state, inst_t *inst) { FUNC(a + b); }
+static void func_vfsub(state_t *state, inst_t *inst) { FUNC(a - b); }
+static void func_vfrsub(state_t *state, inst_t *inst) { FUNC(b - a); }
+static void func_vfmin(state_t *state, inst_t *inst) { FUNC(fmin(a, b)); }
+static void func_vfmax(state_t *state, inst_t *inst) { FUNC(fmax(a, b)); }
+static void func_vfmul(state_t *state, inst_t *inst) { FUNC(a * b); }
+static void func_vfdiv(state_t *state, inst_t *inst) { FUNC(a / b); }
+static void func_vfrdiv(state_t *state, inst_t *inst) { FUNC(b / a); }
+static void func_vfmacc(state_t *state, inst_t *inst) {
+  FUNC(fused(b, a, d));
+}
+static void func_vfnmacc(state_t *state, inst_t *inst) {
+  FUNC(fused(-b, a, -d));
+}
+static void func_vfmsac(state_t *state, inst_t *inst) {
+  FUNC(fused(b, a, -d));
+}
+static void func_vfnmsac(state_t *state, inst_t *inst) {
+  FUNC(fused(-b, a, d));
+}
+static void func_vfmadd(state_t *state, inst_t *inst) {
+  FUNC(fused(b, d, a));
+}
+static void func_vfnmadd(state_t *state, inst_t *inst) {
+  FUNC(fused(-b, d, -a));
+}
+static void func_vfmsub(state_t *state, inst_t *inst) {
+  FUNC(fused(b, d, -a));
+}
+static void func_vfnmsub(state_t *state, inst_t *inst) {
+  FUNC(fused(-b, d, a));
+}
+
+#undef FUNC
+
+#define VFMERGE(_)                                      \
+  {                                                     \
+    ft *vd = (ft *)VREG(inst->rd);                      \
+    ft *vs2 = (ft *)VREG(inst->rs2);                    \
+    ft b = VFSCALAR();                                  \
+    for (u64 i = 0; i < vl; i++) {                      \
+      vd[i] = inst->vm || vmask(state, i) ? b : vs2[i]; \
+    }                                                   \
+  }
+
+static void func_vfmerge(state_t *state, inst_t *inst) { VFP(VFMERGE, 0); }
+
+#undef VFMERGE
+
+static void func_vfmv_f_s(state_t *state, inst_t *inst) {
+  if (vsew(state) == 32) {
+    state->fp_regs[inst->rd].v = *(u32 *)VREG(inst->rs2) | ((u64)-1 << 32);
+  } else {
+    state->fp_regs[inst->rd].v = *(u64 *)VREG(inst->rs2);
+  }
+}
+
+#define VFMV_S_F(_)                         \
+  if (vl) {                                 \
+    ((ft *)VREG(inst->rd))[0] = VFSCALAR(); \
+  }
+
+static void func_vfmv_s_f(state_t *state, inst_t *inst) { VFP(VFMV_S_F, 0); }
+
+#undef VFMV_S_F
+
+#define VFCOMPARE(expr)                                             \
+  {                                                                 \
+    u8 *vd = VREG(inst->rd);                                        \
+    ft *vs2 = (ft *)VREG(inst->rs2);                                \
+    if (inst->vform == form_vv) {                                   \
+      ft *vs1 = (ft *)VREG(inst->rs1);                              \
+      VFOR(ft a = vs2[i]; ft b = vs1[i]; vmask_put(vd, i, (expr))); \
+    } else {                                                        \
+      ft b = VFSCALAR();                                            \
+      VFOR(ft a = vs2[i]; vmask_put(vd, i, (expr)));                \
+    }                                                               \
+  }
+
+#define FUNC(expr) VFP(VFCOMPARE, expr)
+
+static void func_vmfeq(state_t *state, inst_t *inst) { FUNC(a == b); }
+static void func_vmfle(state_t *state, inst_t *inst) { FUNC(a <= b); }
+static void func_vmflt(state_t *state, inst_t *inst) { FUNC(a < b); }
+static void func_vmfne(state_t *state, inst_t *inst) { FUNC(a != b); }
+static void func_vmfgt(state_t *state, inst_t *inst) { FUNC(a > b); }
+static void func_vmfge(state_t *state, inst_t *inst) { FUNC(a >= b); }
+
+#undef FUNC
+
+// both sums go in element order, which the unordered one may too.
+#define VFREDUCE(expr)                 \
+  if (vl) {                            \
+    ft *vs2 = (ft *)VREG(inst->rs2);   \
+    ft a = ((ft *)VREG(inst->rs1))[0]; \
+    VFOR(ft b = vs2[i]; a = (expr));   \
+    ((ft *)VREG(inst->rd))[0] = a;     \
+  }
+
+#define FUNC(expr) VFP(VFREDUCE, expr)
+
+static void func_vfredusum(state_t *state, inst_t *inst) { FUNC(a + b); }
+static void func_vfredosum(state_t *state, inst_t *inst) { FUNC(a + b); }
+static void func_vfredmin(state_t *state, inst_t *inst) { FUNC(fmin(a, b)); }
+static void func_vfredmax(state_t *state, inst_t *inst) { FUNC(fmax(a, b)); }
+
+#undef FUNC
+#undef VFREDUCE
+#undef VFCOMPARE
+#undef VFBINARY
+#undef VFSCALAR
+#undef VFP
+#undef VREDUCE
+#undef VCOMPARE
+#undef VBINARY
+#undef VINT
+#undef VMEM
+#undef VFOR
+
+// ATOMIC INSTRUCTIONS
+// every AMO is a single host atomic on the guest address; aq/rl are covered
+// by making them all sequentially consistent.
+#define FUNC(typ, op)                                                      \
+  typ *addr = (typ *)TO_HOST(state->mem_base, state->gp_regs[inst->rs1]); \
+  typ val = (typ)state->gp_regs[inst->rs2];                               \
+  state->gp_regs[inst->rd] = (i64)op(addr, val, __ATOMIC_SEQ_CST);
+
+static void func_amoswap_w(state_t *state, inst_t *inst) {
+  FUNC(i32, __atomic_exchange_n);
+}
+
+static void func_amoadd_w(state_t *state, inst_t *inst) {
+  FUNC(i32, __atomic_fetch_add);
+}
+
+static void func_amoxor_w(state_t *state, inst_t *inst) {
+  FUNC(i32, __atomic_fetch_xor);
+}
+
+static void func_amoand_w(state_t *state, inst_t *inst) {
+  FUNC(i32, __atomic_fetch_and);
+}
+
+static void func_amoor_w(state_t *state, inst_t *inst) {
+  FUNC(i32, __atomic_fetch_or);
+}
+
+static void func_amoswap_d(state_t *state, inst_t *inst) {
+  FUNC(i64, __atomic_exchange_n);
+}
+
+static void func_amoadd_d(state_t *state, inst_t *inst) {
+  FUNC(i64, __atomic_fetch_add);
+}
+
+static void func_amoxor_d(state_t *state, inst_t *inst) {
+  FUNC(i64, __atomic_fetch_xor);
+}
+
+static void func_amoand_d(state_t *state, inst_t *inst) {
+  FUNC(i64, __atomic_fetch_and);
+}
+
+static void func_amoor_d(state_t *state, inst_t *inst) {
+  FUNC(i64, __atomic_fetch_or);
+}
+
+#undef FUNC
+
+// min/max have no host instruction; a CAS loop is still lock-free. ext is
+// the signed type of the same width, for sign-extending the result.
+#define FUNC(typ, ext, pick_old)                                           \
+  typ *addr = (typ *)TO_HOST(state->mem_base, state->gp_regs[inst->rs1]); \
+  typ val = (typ)state->gp_regs[inst->rs2];                               \
+  typ old = __atomic_load_n(addr, __ATOMIC_RELAXED);                      \
+  while (!__atomic_compare_exchange_n(addr, &old, (pick_old) ? old : val, \
+                                      true, __ATOMIC_SEQ_CST,             \
+                                      __ATOMIC_RELAXED)) {                \
+  }                                                                       \
+  state->gp_regs[inst->rd] = (i64)(ext)old;
+
+static void func_amomin_w(state_t *state, inst_t *inst) {
+  FUNC(i32, i32, old < val);
+}
+
+static void func_amomax_w(state_t *state, inst_t *inst) {
+  FUNC(i32, i32, old > val);
+}
+
+static void func_amominu_w(state_t *state, inst_t *inst) {
+  FUNC(u32, i32, old < val);
+}
+
+static void func_amomaxu_w(state_t *state, inst_t *inst) {
+  FUNC(u32, i32, old > val);
+}
+
+static void func_amomin_d(state_t *state, inst_t *inst) {
+  FUNC(i64, i64, old < val);
+}
+
+static void func_amomax_d(state_t *state, inst_t *inst) {
+  FUNC(i64, i64, old > val);
+}
+
+static void func_amominu_d(state_t *state, inst_t *inst) {
+  FUNC(u64, i64, old < val);
+}
+
+static void func_amomaxu_d(state_t *state, inst_t *inst) {
+  FUNC(u64, i64, old > val);
+}
+
+#undef FUNC
+
+// LR remembers the address and the value it loaded; SC succeeds only if
+// the word still holds that value, checked and stored in one CAS. Nothing
+// is shared between harts, so there is no lock to contend on. Like every
+// reservation-by-value scheme it cannot see an A-B-A change in between,
+// which the lock-free algorithms LR/SC is used for tolerate.
+#define FUNC(typ)                                                          \
+  u64 guest_addr = state->gp_regs[inst->rs1];                             \
+  typ *addr = (typ *)TO_HOST(state->mem_base, guest_addr);                \
+  typ val = __atomic_load_n(addr, __ATOMIC_SEQ_CST);                      \
+  state->reserve_addr = guest_addr;                                       \
+  state->reserve_val = (u64)val;                                          \
+  state->reserved = true;                                                 \
+  state->gp_regs[inst->rd] = (i64)val;
+
+static void func_lr_w(state_t *state, inst_t *inst) {
+  FUNC(i32);
+}
+
+static void func_lr_d(state_t *state, inst_t *inst) {
+  FUNC(i64);
+}
+
+#undef FUNC
+
+#define FUNC(typ)                                                          \
+  u64 guest_addr = state->gp_regs[inst->rs1];                             \
+  typ *addr = (typ *)TO_HOST(state->mem_base, guest_addr);                \
+  typ expected = (typ)state->reserve_val;                                 \
+  bool ok = state->reserved && state->reserve_addr == guest_addr &&       \
+            __atomic_compare_exchange_n(addr, &expected,                  \
+                                        (typ)state->gp_regs[inst->rs2],   \
+                                        false, __ATOMIC_SEQ_CST,          \
+                                        __ATOMIC_RELAXED);                \
+  state->reserved = false;                                                \
+  state->gp_regs[inst->rd] = !ok;
+
+static void func_sc_w(state_t *state, inst_t *inst) {
+  FUNC(i32);
+}
+
+static void func_sc_d(state_t *state, inst_t *inst) {
+  FUNC(i64);
+}
+
+#undef FUNC
+
 static func_t *funcs[] = {
     func_lb,        func_lh,       func_lw,        func_ld,
     func_lbu,       func_lhu,      func_lwu,       func_fence,
@@ -690,8 +1587,8 @@ static func_t *funcs[] = {
     func_remw,      func_remuw,    func_subw,      func_sraw,
     func_beq,       func_bne,      func_blt,       func_bge,
     func_bltu,      func_bgeu,     func_jalr,      func_jal,
-    func_ecall,     func_csrrw,    func_csrrs,     func_csrrc,
-    func_csrrwi,    func_csrrsi,   func_csrrci,    func_flw,
+    func_ecall,     func_csrrc,    func_csrrci,    func_csrrs,
+    func_csrrsi,    func_csrrw,    func_csrrwi,    func_flw,
     func_fsw,       func_fmadd_s,  func_fmsub_s,   func_fnmsub_s,
     func_fnmadd_s,  func_fadd_s,   func_fsub_s,    func_fmul_s,
     func_fdiv_s,    func_fsqrt_s,  func_fsgnj_s,   func_fsgnjn_s,
@@ -707,20 +1604,93 @@ static func_t *funcs[] = {
     func_flt_d,     func_fle_d,    func_fclass_d,  func_fcvt_w_d,
     func_fcvt_wu_d, func_fcvt_d_w, func_fcvt_d_wu, func_fcvt_l_d,
     func_fcvt_lu_d, func_fmv_x_d,  func_fcvt_d_l,  func_fcvt_d_lu,
-    func_fmv_d_x,
+    func_fmv_d_x,   func_lr_w,     func_sc_w,      func_amoswap_w,
+    func_amoadd_w,  func_amoxor_w, func_amoand_w,  func_amoor_w,
+    func_amomin_w,  func_amomax_w, func_amominu_w, func_amomaxu_w,
+    func_lr_d,      func_sc_d,     func_amoswap_d, func_amoadd_d,
+    func_amoxor_d,  func_amoand_d, func_amoor_d,   func_amomin_d,
+    func_amomax_d,  func_amominu_d, func_amomaxu_d,
+    func_vsetvli,     func_vsetivli,     func_vsetvl,
+    func_vle8_v,      func_vle16_v,      func_vle32_v,     func_vle64_v,
+    func_vse8_v,      func_vse16_v,      func_vse32_v,     func_vse64_v,
+    func_vlse8_v,     func_vlse16_v,     func_vlse32_v,    func_vlse64_v,
+    func_vsse8_v,     func_vsse16_v,     func_vsse32_v,    func_vsse64_v,
+    func_vlm_v,       func_vsm_v,
+    func_vadd,        func_vsub,         func_vrsub,       func_vminu,
+    func_vmin,        func_vmaxu,        func_vmax,        func_vand,
+    func_vor,         func_vxor,         func_vsll,        func_vsrl,
+    func_vsra,        func_vmerge,       func_vmseq,       func_vmsne,
+    func_vmsltu,      func_vmslt,        func_vmsleu,      func_vmsle,
+    func_vmsgtu,      func_vmsgt,        func_vmul,        func_vdivu,
+    func_vdiv,        func_vremu,        func_vrem,        func_vmacc,
+    func_vnmsac,      func_vmadd,        func_vnmsub,      func_vredsum,
+    func_vredand,     func_vredor,       func_vredxor,     func_vredminu,
+    func_vredmin,     func_vredmaxu,     func_vredmax,     func_vmv_x_s,
+    func_vmv_s_x,     func_vcpop_m,      func_vfirst_m,    func_vid_v,
+    func_vmandn,      func_vmand,        func_vmor,        func_vmxor,
+    func_vmorn,       func_vmnand,       func_vmnor,       func_vmxnor,
+    func_vfadd,       func_vfsub,        func_vfrsub,      func_vfmin,
+    func_vfmax,       func_vfmul,        func_vfdiv,       func_vfrdiv,
+    func_vfmacc,      func_vfnmacc,      func_vfmsac,      func_vfnmsac,
+    func_vfmadd,      func_vfnmadd,      func_vfmsub,      func_vfnmsub,
+    func_vfmerge,     func_vfmv_f_s,     func_vfmv_s_f,    func_vmfeq,
+    func_vmfle,       func_vmflt,        func_vmfne,       func_vmfgt,
+    func_vmfge,       func_vfredusum,    func_vfredosum,   func_vfredmin,
+    func_vfredmax,    func_vlr_v,        func_vsr_v,       func_vmvr_v,
+    func_fmadd_s_rm,  func_fmsub_s_rm,   func_fnmsub_s_rm,
+    func_fnmadd_s_rm, func_fadd_s_rm,    func_fsub_s_rm,
+    func_fmul_s_rm,   func_fdiv_s_rm,    func_fsqrt_s_rm,
+    func_fcvt_s_w_rm, func_fcvt_s_wu_rm, func_fcvt_s_l_rm,
+    func_fcvt_s_lu_rm, func_fmadd_d_rm,  func_fmsub_d_rm,
+    func_fnmsub_d_rm, func_fnmadd_d_rm,  func_fadd_d_rm,
+    func_fsub_d_rm,   func_fmul_d_rm,    func_fdiv_d_rm,
+    func_fsqrt_d_rm,  func_fcvt_s_d_rm,  func_fcvt_d_l_rm,
+    func_fcvt_d_lu_rm,
 };
 
+// a block that ran off its end without a jump (a branch not taken, or a
+// cached block cut at BLOCK_MAX_INSTS) carries on at the next instruction.
+static inline void exec_fallthrough(state_t *state, inst_t *last) {
+  if (state->exit_reason == none) {
+    state->reenter_pc = state->pc + (last->rvc ? 2 : 4);
+    state->exit_reason = direct_branch;
+  }
+}
+
 void exec_block_interp(state_t *state) {
-  static inst_t inst = {0};
+  inst_t inst;
+  u64 mem_base = state->mem_base;
+  u64 n = 0;
   while (true) {
-    u32 data = *(u32 *)TO_HOST(state->pc);
+    u32 data = *(u32 *)TO_HOST(mem_base, state->pc);
     inst_decode(&inst, data);
 
     funcs[inst.type](state, &inst);
     state->gp_regs[zero] = 0;
+    n++;
 
     if (inst.cont) break;
 
     state->pc += inst.rvc ? 2 : 4;
   }
-}
\ No newline at end of file
+  exec_fallthrough(state, &inst);
+  state->insts += n;
+  state->blocks++;
+}
+
+void exec_block(state_t *state, block_t *b) {
+  inst_t *inst = b->insts;
+  inst_t *last = &b->insts[b->num_insts - 1];
+  while (true) {
+    funcs[inst->type](state, inst);
+    state->gp_regs[zero] = 0;
+
+    if (inst == last) break;
+
+    state->pc += inst->rvc ? 2 : 4;
+    inst++;
+  }
+  exec_fallthrough(state, last);
+  state->insts += b->num_insts;
+  state->blocks++;
+}
@@ -1,6 +1,8 @@
+#include <fenv.h>
+
 #include "rvemu.h"
 
-inline uint64_t mulhu(uint64_t a, uint64_t b) {
+static inline uint64_t mulhu(uint64_t a, uint64_t b) {
     uint64_t t;
     uint32_t y1, y2, y3;
     uint64_t a0 = (uint32_t)a, a1 = a >> 32;
@@ -16,13 +18,13 @@ inline uint64_t mulhu(uint64_t a, uint64_t b) {
     return ((uint64_t)y3 << 32) | y2;
 }
 
-inline int64_t mulh(int64_t a, int64_t b) {
+static inline int64_t mulh(int64_t a, int64_t b) {
     int negate = (a < 0) != (b < 0);
     uint64_t res = mulhu(a < 0 ? -a : a, b < 0 ? -b : b);
     return negate ? ~res + (a * b == 0) : res;
 }
 
-inline int64_t mulhsu(int64_t a, uint64_t b) {
+static inline int64_t mulhsu(int64_t a, uint64_t b) {
     int negate = a < 0;
     uint64_t res = mulhu(a < 0 ? -a : a, b);
     return negate ? ~res + (a * b == 0) : res;
@@ -31,12 +33,12 @@ inline int64_t mulhsu(int64_t a, uint64_t b) {
 #define F32_SIGN ((uint32_t)1 << 31)
 #define F64_SIGN ((uint64_t)1 << 63)
 
-inline u32 fsgnj32(u32 a, u32 b, bool n, bool x) {
+static inline u32 fsgnj32(u32 a, u32 b, bool n, bool x) {
     u32 v = x ? a : n ? F32_SIGN : 0;
     return (a & ~F32_SIGN) | ((v ^ b) & F32_SIGN);
 }
 
-inline u64 fsgnj64(u64 a, u64 b, bool n, bool x) {
+static inline u64 fsgnj64(u64 a, u64 b, bool n, bool x) {
     u64 v = x ? a : n ? F64_SIGN : 0;
     return (a & ~F64_SIGN) | ((v ^ b) & F64_SIGN);
 }
@@ -48,7 +50,7 @@ union u32_f32 { u32 ui; f32 f; };
 #define isNaNF32UI(a) (((~(a) & 0x7F800000) == 0) && ((a) & 0x007FFFFF))
 #define isSigNaNF32UI(uiA) ((((uiA) & 0x7FC00000) == 0x7F800000) && ((uiA) & 0x003FFFFF))
 
-inline u16 f32_classify(f32 a) {
+static inline u16 f32_classify(f32 a) {
     union u32_f32 uA;
     u32 uiA;
 
@@ -82,7 +84,7 @@ union u64_f64 { u64 ui; f64 f; };
 #define isNaNF64UI(a) (((~(a) & UINT64_C(0x7FF0000000000000)) == 0) && ((a) & UINT64_C(0x000FFFFFFFFFFFFF)))
 #define isSigNaNF64UI(uiA) ((((uiA) & UINT64_C(0x7FF8000000000000)) == UINT64_C(0x7FF0000000000000)) && ((uiA) & UINT64_C(0x0007FFFFFFFFFFFF)))
 
-inline u16 f64_classify(f64 a) {
+static inline u16 f64_classify(f64 a) {
     union u64_f64 uA;
     u64 uiA;
 
@@ -107,4 +109,62 @@ inline u16 f64_classify(f64 a) {
         (!sign && subnormalOrZero && fracZero)   << 4 |
         (isNaN &&  isSNaN)                       << 8 |
         (isNaN && !isSNaN)                       << 9;
-}
\ No newline at end of file
+}
+
+// rounds to an integral value as rm says, dyn being the host's current
+// mode (frm's). rne is spelt out, exactly, since the host may be in
+// another mode.
+static inline f64 fround(f64 x, int rm) {
+    switch (rm) {
+    case rne: return x - remainder(x, 1.0);
+    case rtz: return trunc(x);
+    case rdn: return floor(x);
+    case rup: return ceil(x);
+    case rmm: return round(x);
+    default:  return nearbyint(x);
+    }
+}
+
+// fcvt to a signed integer of the given width: out of range saturates,
+// NaN to the maximum, and raises invalid; a value that had to be rounded
+// raises inexact. NaN and infinities never reach fround, whose rne would
+// raise invalid on its own and give NaN for an infinity.
+static inline i64 fcvt_signed(f64 x, int rm, int bits) {
+    f64 lim = (f64)((u64)1 << (bits - 1));
+    i64 max = (i64)((u64)-1 >> (65 - bits));
+    if (isnan(x) || isinf(x)) {
+        feraiseexcept(FE_INVALID);
+        return isnan(x) || x > 0 ? max : -max - 1;
+    }
+    f64 r = fround(x, rm);
+    if (r >= lim) {
+        feraiseexcept(FE_INVALID);
+        return max;
+    }
+    if (r < -lim) {
+        feraiseexcept(FE_INVALID);
+        return -max - 1;
+    }
+    if (r != x) feraiseexcept(FE_INEXACT);
+    return (i64)r;
+}
+
+static inline u64 fcvt_unsigned(f64 x, int rm, int bits) {
+    f64 lim = bits == 64 ? 0x1p64 : (f64)((u64)1 << bits);
+    u64 max = (u64)-1 >> (64 - bits);
+    if (isnan(x) || isinf(x)) {
+        feraiseexcept(FE_INVALID);
+        return isnan(x) || x > 0 ? max : 0;
+    }
+    f64 r = fround(x, rm);
+    if (r >= lim) {
+        feraiseexcept(FE_INVALID);
+        return max;
+    }
+    if (r < 0) {
+        feraiseexcept(FE_INVALID);
+        return 0;
+    }
+    if (r != x) feraiseexcept(FE_INEXACT);
+    return (u64)r;
+}
@@ -4,10 +4,89 @@
 
 #include "rvemu.h"
 
-enum exit_reason_t machine_step(machine_t *m) {
+// decoded blocks are shared through the image, so only code in its text
+// is cached, and only while the guest has not made that text writable;
+// anything else is decoded as it runs.
+static block_t *machine_block(machine_t *m, u64 pc) {
+  image_t *image = m->mmu->image;
+  if (!image || m->mmu->own_text) {
+    return NULL;
+  }
+
+  qsbr_quiescent();
+  lookaside_t *l = &m->lookaside[(pc >> 1) & (LOOKASIDE_SIZE - 1)];
+  if (l->pc == pc && l->block) {
+    return l->block;
+  }
+  block_t *b = image_block(image, pc);
+  if (b) {
+    *l = (lookaside_t){pc, b};
+  }
+  return b;
+}
+
+// AFL-style: one counter per (previous block, this block) pair.
+static inline void cover_edge(machine_t *m, u64 pc) {
+  u64 cur = ((pc >> 1) ^ (pc >> 13)) & m->cov_mask;
+  m->cov_map[cur ^ m->cov_prev]++;
+  m->cov_prev = cur >> 1;
+}
+
+// runs until the guest halts, reaches stop_pc, or, with a non-zero budget,
+// has retired at least that many more instructions. The budget is only
+// looked at between blocks, so it can overrun by up to one block; the
+// machine is then between blocks and machine_step simply picks it up.
+// With async_io, a syscall that started an io_uring transfer returns
+// io_wait instead of blocking, and the guest only goes on, with the
+// syscall's result, once a later machine_step finds the transfer done.
+enum exit_reason_t machine_step(machine_t *m, u64 budget) {
+  if (uring_pending(m->uring)) {
+    i64 res;
+    if (!uring_poll(m->uring, &res)) {
+      return io_wait;
+    }
+    m->state.gp_regs[a0] = res;
+  }
+
+  m->host = pthread_self();
+  u64 deadline = budget ? m->state.insts + budget : UINT64_MAX;
+  fp_enter(&m->state);
   while (true) {
+    // another thread called exit_group.
+    if (m->threads && thread_exiting(m)) {
+      m->state.exit_reason = halt;
+      fp_leave(&m->state);
+      qsbr_offline();
+      return halt;
+    }
+
+    // stop_pc is one-shot and only checked at block boundaries.
+    if (m->state.pc == m->stop_pc) {
+      m->stop_pc = 0;
+      m->state.exit_reason = breakpoint;
+      fp_leave(&m->state);
+      qsbr_offline();
+      return breakpoint;
+    }
+
+    if (m->state.insts >= deadline) {
+      m->state.exit_reason = budget_exhausted;
+      fp_leave(&m->state);
+      qsbr_offline();
+      return budget_exhausted;
+    }
+
+    if (m->cov_map) {
+      cover_edge(m, m->state.pc);
+    }
+
     m->state.exit_reason = none;
-    exec_block_interp(&m->state);
+    block_t *b = machine_block(m, m->state.pc);
+    if (b) {
+      exec_block(&m->state, b);
+    } else {
+      exec_block_interp(&m->state);
+    }
     assert(m->state.exit_reason != none);
 
     if (m->state.exit_reason == indirect_branch ||
@@ -16,22 +95,189 @@ enum exit_reason_t machine_step(machine_t *m) {
       continue;
     }
 
-    break;
+    assert(m->state.exit_reason == ecall);
+    m->state.pc = m->state.reenter_pc;
+    // a log or trace has to see every syscall.
+    if (!m->replay && !m->trace && do_syscall_fast(m)) {
+      continue;
+    }
+    // a syscall can block for as long as it likes; hold no table meanwhile.
+    fp_leave(&m->state);
+    qsbr_offline();
+    if (m->state.gp_regs[a7] == HYPERCALL_REGION) {
+      region_hypercall(m);
+    } else if (m->replay) {
+      replay_syscall(m);
+    } else {
+      do_syscall(m);
+    }
+
+    if (m->state.exit_reason == halt) {
+      return halt;
+    }
+    if (uring_pending(m->uring)) {
+      m->state.exit_reason = io_wait;
+      return io_wait;
+    }
+    fp_enter(&m->state);
   }
+}
 
-  m->state.pc = m->state.reenter_pc;
-  assert(m->state.exit_reason == ecall);
-  return ecall;
-};
+// the parts of a machine its guest threads share: address space and fds.
+// Returns 0, or an errno with nothing allocated.
+int machine_init(machine_t *m) {
+  m->mmu = calloc(1, sizeof(mmu_t));
+  if (!m->mmu) {
+    fatal("out of memory");
+  }
+  int err = mmu_init(m->mmu);
+  if (err) {
+    free(m->mmu);
+    m->mmu = NULL;
+    return err;
+  }
+  m->fds = fd_new();
+  m->tid = getpid();
+  return 0;
+}
 
-void machine_load_program(machine_t *m, char *prog) {
+// returns 0, or the errno of a program that could not be opened or loaded,
+// with nothing allocated.
+int machine_load_program(machine_t *m, char *prog) {
   int fd = open(prog, O_RDONLY);
   if (fd == -1) {
-    fatal(strerror(errno));
+    return errno;
   }
 
-  mmu_load_elf(&m->mmu, fd);
+  int err = machine_init(m);
+  if (err) {
+    close(fd);
+    return err;
+  }
+  err = mmu_load_elf(m->mmu, fd);
   close(fd);
+  if (err) {
+    machine_free(m);
+    return err;
+  }
+
+  m->state.mem_base = m->mmu->mem_base;
+  m->state.pc = (u64)m->mmu->entry;
+  if (!m->state.vlenb) {
+    m->state.vlenb = DEFAULT_VLEN / 8;
+  }
+  // no vtype until the guest's first vsetvl.
+  m->state.vtype = 1ULL << 63;
+  return 0;
+}
 
-  m->state.pc = (u64)m->mmu.entry;
+#define HWCAP(ext) (1ULL << ((ext) - 'A'))
+
+static u64 push_string(machine_t *m, u64 stack, char *str) {
+  u64 len = strlen(str) + 1;
+  stack -= len;
+  mmu_write(m->mmu, stack, str, len);
+  return stack;
+}
+
+// lay out the initial stack the way the RISC-V Linux ABI expects it:
+//   sp -> argc, argv[0..argc], NULL, envp[0..envc], NULL, auxv pairs
+// with the strings and AT_RANDOM bytes above that.
+void machine_setup(machine_t *m, int argc, char *argv[], char *envp[]) {
+  u64 stack_size = m->stack_size ? m->stack_size : DEFAULT_STACK_SIZE;
+  u64 stack = mmu_map_stack(m->mmu, stack_size, m->stack_huge);
+
+  int envc = 0;
+  while (envp && envp[envc]) {
+    envc++;
+  }
+
+  u64 *guest_argv = calloc(argc + envc, sizeof(u64));
+  if (!guest_argv) {
+    fatal("out of memory");
+  }
+  u64 *guest_envp = guest_argv + argc;
+
+  for (int i = envc - 1; i >= 0; i--) {
+    stack = guest_envp[i] = push_string(m, stack, envp[i]);
+  }
+  for (int i = argc - 1; i >= 0; i--) {
+    stack = guest_argv[i] = push_string(m, stack, argv[i]);
+  }
+
+  // unseeded rand(), so every run of a program sees the same bytes.
+  u8 random[16];
+  for (u64 i = 0; i < sizeof(random); i++) {
+    random[i] = rand();
+  }
+  stack = ROUNDDOWN(stack - sizeof(random), 16);
+  mmu_write(m->mmu, stack, random, sizeof(random));
+  u64 random_addr = stack;
+
+  u64 auxv[][2] = {
+      {AT_PHDR, m->mmu->phdr},
+      {AT_PHENT, m->mmu->phent},
+      {AT_PHNUM, m->mmu->phnum},
+      {AT_PAGESZ, getpagesize()},
+      {AT_BASE, 0},
+      {AT_FLAGS, 0},
+      {AT_ENTRY, m->mmu->entry},
+      {AT_UID, getuid()},
+      {AT_EUID, geteuid()},
+      {AT_GID, getgid()},
+      {AT_EGID, getegid()},
+      {AT_HWCAP, HWCAP('I') | HWCAP('M') | HWCAP('A') | HWCAP('F') |
+                     HWCAP('D') | HWCAP('C')},
+      {AT_CLKTCK, sysconf(_SC_CLK_TCK)},
+      {AT_SECURE, 0},
+      {AT_RANDOM, random_addr},
+      {AT_EXECFN, argc > 0 ? guest_argv[0] : 0},
+      {AT_NULL, 0},
+  };
+
+  u64 words = 1 + (argc + 1) + (envc + 1) + ARRAY_SIZE(auxv) * 2;
+  stack = ROUNDDOWN(stack - words * sizeof(u64), 16);
+
+  u64 p = stack;
+  u64 guest_argc = argc;
+  u64 null = 0;
+  mmu_write(m->mmu, p, &guest_argc, sizeof(u64));
+  p += sizeof(u64);
+  mmu_write(m->mmu, p, guest_argv, argc * sizeof(u64));
+  p += argc * sizeof(u64);
+  mmu_write(m->mmu, p, &null, sizeof(u64));
+  p += sizeof(u64);
+  mmu_write(m->mmu, p, guest_envp, envc * sizeof(u64));
+  p += envc * sizeof(u64);
+  mmu_write(m->mmu, p, &null, sizeof(u64));
+  p += sizeof(u64);
+  mmu_write(m->mmu, p, auxv, sizeof(auxv));
+
+  m->state.gp_regs[sp] = stack;
+  free(guest_argv);
+}
+
+void machine_free(machine_t *m) {
+  output_free(m);
+  fd_free(m->fds);
+  m->fds = NULL;
+  vfs_close(m->vfs);
+  m->vfs = NULL;
+  uring_close(m->uring);
+  m->uring = NULL;
+  trace_close(m->trace);
+  m->trace = NULL;
+  replay_close(m->replay);
+  m->replay = NULL;
+  free(m->regions);
+  m->regions = NULL;
+  if (m->threads) {
+    free(m->threads->hosts);
+    free(m->threads->regions);
+    free(m->threads);
+    m->threads = NULL;
+  }
+  mmu_free(m->mmu);
+  free(m->mmu);
+  m->mmu = NULL;
 }
\ No newline at end of file
@@ -17,23 +17,75 @@ static int flag_to_mmap_prot(u32 flag) {
   return prot;
 }
 
-static void load_phdr(elf64_phdr_t *phdr, elf64_ehdr_t *ehdr, i64 i,
-                      FILE *file) {
-  if (fseek(file, ehdr->e_phoff + i * ehdr->e_phentsize, SEEK_SET) != 0) {
-    fatal("Failed to seek to program header");
+static bool load_phdr(elf64_phdr_t *phdr, elf64_ehdr_t *ehdr, i64 i,
+                      int fd) {
+  return pread(fd, phdr, sizeof(elf64_phdr_t),
+               ehdr->e_phoff + i * ehdr->e_phentsize) ==
+         sizeof(elf64_phdr_t);
+}
+
+static void mmu_push_region(mmu_t *mmu, u64 addr, u64 len, int prot,
+                            bool shared) {
+  if (mmu->num_regions == mmu->cap_regions) {
+    mmu->cap_regions = mmu->cap_regions ? mmu->cap_regions * 2 : 8;
+    mmu->regions =
+        realloc(mmu->regions, mmu->cap_regions * sizeof(mmu_region_t));
+    if (!mmu->regions) {
+      fatal("out of memory");
+    }
   }
 
-  if (fread((void *)phdr, 1, sizeof(elf64_phdr_t), file) !=
-      sizeof(elf64_phdr_t)) {
-    fatal("Failed to read program header, file too small");
+  mmu->regions[mmu->num_regions++] = (mmu_region_t){addr, len, prot, shared};
+}
+
+void mmu_add_region(mmu_t *mmu, u64 addr, u64 len, int prot) {
+  mmu_push_region(mmu, addr, len, prot, false);
+  if (mmu->dirty_mode != dirty_none) {
+    mmu_dirty_register(mmu, addr, len, prot);
   }
 }
 
-static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
+// drop [addr, addr + len) from the region list, trimming or splitting any
+// region that only partly overlaps it.
+static void mmu_remove_region(mmu_t *mmu, u64 addr, u64 len) {
+  u64 end = addr + len;
+  for (int i = 0; i < mmu->num_regions; i++) {
+    mmu_region_t r = mmu->regions[i];
+    u64 r_end = r.addr + r.len;
+    if (r_end <= addr || end <= r.addr) {
+      continue;
+    }
+
+    mmu->regions[i--] = mmu->regions[--mmu->num_regions];
+    if (r.addr < addr) {
+      mmu_push_region(mmu, r.addr, addr - r.addr, r.prot, r.shared);
+    }
+    if (end < r_end) {
+      mmu_push_region(mmu, end, r_end - end, r.prot, r.shared);
+    }
+  }
+}
+
+// returns a region overlapping [addr, addr + len), if there is one.
+mmu_region_t *mmu_find_region(mmu_t *mmu, u64 addr, u64 len) {
+  for (int i = 0; i < mmu->num_regions; i++) {
+    mmu_region_t *r = &mmu->regions[i];
+    if (r->addr < addr + len && addr < r->addr + r->len) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
+// returns 0 or an errno.
+static int mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
   // load guest program into host program memory, no page manager yet;
   int page_size = getpagesize();
   u64 offset = phdr->p_offset;
-  u64 vaddr = TO_HOST(phdr->p_vaddr);
+  if (phdr->p_vaddr + phdr->p_memsz > GUEST_MEMORY_SIZE) {
+    return ENOMEM;
+  }
+  u64 vaddr = TO_HOST(mmu->mem_base, phdr->p_vaddr);
   u64 aligned_addr = ROUNDDOWN(vaddr, page_size);
   u64 file_size = phdr->p_filesz + (vaddr - aligned_addr);
   u64 mem_size = phdr->p_memsz + (vaddr - aligned_addr);
@@ -44,11 +96,27 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
   //     " mem_size: 0x%lx, prot: %d\n",
   //     offset, vaddr, aligned_addr, file_size, mem_size, prot);
 
-  u64 addr =
-      (u64)mmap((void *)aligned_addr, file_size, prot, MAP_PRIVATE | MAP_FIXED,
-                fd, ROUNDDOWN(offset, page_size));
+  // private even when read-only, so a guest may mprotect its text
+  // writable as on Linux. Pages it never writes stay the page cache's.
+  u64 addr = (u64)mmap((void *)aligned_addr, file_size, prot,
+                       MAP_PRIVATE | MAP_FIXED, fd,
+                       ROUNDDOWN(offset, page_size));
+  if (addr != aligned_addr) {
+    return errno;
+  }
 
-  assert(addr == aligned_addr);
+  // the file mapping carries whatever follows the segment in the file up to
+  // the end of the page; that is .bss as far as the guest is concerned.
+  u64 file_end = vaddr + phdr->p_filesz;
+  if ((prot & PROT_WRITE) && phdr->p_memsz > phdr->p_filesz &&
+      file_end != ROUNDUP(file_end, page_size)) {
+    memset((void *)file_end, 0, ROUNDUP(file_end, page_size) - file_end);
+  }
+
+  if (!(prot & PROT_WRITE)) {
+    image_add_text(mmu->image, fd, TO_GUEST(mmu->mem_base, aligned_addr),
+                   file_size, ROUNDDOWN(offset, page_size));
+  }
 
   u64 remaining_bss =
       ROUNDUP(mem_size, page_size) - ROUNDUP(file_size, page_size);
@@ -58,39 +126,376 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
     addr = (u64)mmap((void *)(aligned_addr + ROUNDUP(file_size, page_size)),
                      remaining_bss, prot,
                      MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
-    assert(addr == aligned_addr + ROUNDUP(file_size, page_size));
+    if (addr != aligned_addr + ROUNDUP(file_size, page_size)) {
+      return errno;
+    }
   }
 
+  mmu_add_region(mmu, TO_GUEST(mmu->mem_base, aligned_addr),
+                 ROUNDUP(mem_size, page_size), prot);
+
   mmu->host_alloc =
       MAX(mmu->host_alloc, (aligned_addr + ROUNDUP(mem_size, page_size)));
-  mmu->base = mmu->alloc = TO_GUEST(mmu->host_alloc);
+  mmu->base = mmu->alloc = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  return 0;
 }
 
-void mmu_load_elf(mmu_t *mmu, int fd) {
+// returns 0, or the errno of a host that has no room left for the window.
+int mmu_init(mmu_t *mmu) {
+  // reserve the whole guest address space up front; nothing is committed
+  // until a segment is mapped over it with MAP_FIXED.
+  void *base = mmap(NULL, GUEST_MEMORY_SIZE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return errno;
+  }
+
+  mmu->mem_base = (u64)base;
+  mmu->host_alloc = mmu->mem_base;
+  mmu->alloc = mmu->base = 0;
+  mmu->image = NULL;
+  mmu->own_text = false;
+  mmu->regions = NULL;
+  mmu->num_regions = mmu->cap_regions = 0;
+  mmu->dirty_mode = dirty_none;
+  return 0;
+}
+
+void mmu_free(mmu_t *mmu) {
+  mmu_dirty_stop(mmu);
+  if (mmu->image) {
+    image_put(mmu->image);
+    mmu->image = NULL;
+  }
+  munmap((void *)mmu->mem_base, GUEST_MEMORY_SIZE);
+  free(mmu->regions);
+  mmu->regions = NULL;
+  mmu->num_regions = mmu->cap_regions = 0;
+  mmu->mem_base = mmu->host_alloc = 0;
+}
+
+// grow (or shrink, for negative sz) the guest heap. Returns false, with the
+// break where it was, if the heap cannot grow that far.
+bool mmu_alloc(mmu_t *mmu, i64 sz) {
+  int page_size = getpagesize();
+  assert(mmu->alloc >= mmu->base);
+  assert(mmu->alloc + sz >= mmu->base);
+
+  u64 host_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  if (sz > 0 && mmu->alloc + sz > host_top) {
+    u64 len = ROUNDUP(mmu->alloc + sz - host_top, page_size);
+    if (host_top + len > GUEST_MEMORY_SIZE ||
+        mmu_find_region(mmu, host_top, len) ||
+        mmap((void *)mmu->host_alloc, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+      return false;
+    }
+
+    mmu->host_alloc += len;
+    if (mmu->dirty_mode != dirty_none) {
+      mmu_dirty_register(mmu, host_top, len, PROT_READ | PROT_WRITE);
+    }
+  } else if (sz < 0 && ROUNDUP(mmu->alloc + sz, page_size) < host_top) {
+    u64 len = host_top - ROUNDUP(mmu->alloc + sz, page_size);
+    // give the pages back but keep the window reserved.
+    if (mmap((void *)(mmu->host_alloc - len), len, PROT_NONE,
+             MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+             0) == MAP_FAILED) {
+      fatal(strerror(errno));
+    }
+    mmu->host_alloc -= len;
+  }
+
+  mmu->alloc += sz;
+  return true;
+}
+
+// returns 0 or an errno: ENOEXEC for a file that is not a 64-bit RISC-V
+// ELF, ENOMEM for one that does not fit the guest window. On failure the
+// mmu holds whatever was mapped so far, for mmu_free.
+int mmu_load_elf(mmu_t *mmu, int fd) {
+  // pread on the caller's fd; a FILE from fdopen would never be closed.
   u8 buf[sizeof(elf64_ehdr_t)];
-  FILE *file = fdopen(fd, "rb");
-  if (fread(buf, 1, sizeof(elf64_ehdr_t), file) != sizeof(elf64_ehdr_t)) {
-    fatal("File too small to be an ELF file");
+  if (pread(fd, buf, sizeof(elf64_ehdr_t), 0) != sizeof(elf64_ehdr_t)) {
+    return ENOEXEC;
   }
 
   elf64_ehdr_t *ehdr = (elf64_ehdr_t *)buf;
 
   if (*(u32 *)ehdr != *(u32 *)ELFMAG) {
-    fatal("Not an ELF file");
+    return ENOEXEC;
   }
 
   if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_RISCV) {
-    fatal("Not a 64-bit ELF file");
+    return ENOEXEC;
   }
 
   mmu->entry = (u64)ehdr->e_entry;
+  mmu->image = image_get(fd);
 
   elf64_phdr_t phdr;
   for (i64 i = 0; i < ehdr->e_phnum; i++) {
-    load_phdr(&phdr, ehdr, i, file);
+    if (!load_phdr(&phdr, ehdr, i, fd)) {
+      return ENOEXEC;
+    }
 
     if (phdr.p_type == PT_LOAD) {
-      mmu_load_segment(mmu, &phdr, fd);
+      // the program headers are normally loaded with the first segment;
+      // the guest libc finds them there through AT_PHDR.
+      if (phdr.p_offset <= ehdr->e_phoff &&
+          ehdr->e_phoff < phdr.p_offset + phdr.p_filesz) {
+        mmu->phdr = phdr.p_vaddr + (ehdr->e_phoff - phdr.p_offset);
+      }
+      int err = mmu_load_segment(mmu, &phdr, fd);
+      if (err) {
+        return err;
+      }
+    }
+  }
+
+  mmu->phnum = ehdr->e_phnum;
+  mmu->phent = ehdr->e_phentsize;
+  return 0;
+}
+
+// map a stack of the given size just below the top of the guest window and
+// return its top. NORESERVE so that many idle guests do not commit memory
+// they never touch; huge asks for transparent huge pages.
+u64 mmu_map_stack(mmu_t *mmu, u64 size, bool huge) {
+  u64 align = huge ? STACK_HUGE_ALIGN : (u64)getpagesize();
+  size = ROUNDUP(size, align);
+
+  u64 top = GUEST_MEMORY_SIZE - align;
+  u64 bottom = top - size;
+  if (bottom <= TO_GUEST(mmu->mem_base, mmu->host_alloc)) {
+    fatal("stack does not fit in guest memory");
+  }
+
+  void *host = (void *)TO_HOST(mmu->mem_base, bottom);
+  if (mmap(host, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+           0) != host) {
+    fatal(strerror(errno));
+  }
+  if (huge) {
+    // best effort, THP may be disabled on the host.
+    madvise(host, size, MADV_HUGEPAGE);
+  }
+
+  mmu_add_region(mmu, bottom, size, PROT_READ | PROT_WRITE);
+  mmu->stack_bottom = bottom;
+  return top;
+}
+
+// guest mmap. Files are mapped straight over the window like the ELF
+// segments are, so the guest sees the page cache pages themselves and
+// nothing is read until it is touched. Without MAP_FIXED the mapping goes
+// in the highest free hole below the stack. Returns the guest address or a
+// negative errno.
+i64 mmu_map(mmu_t *mmu, u64 addr, u64 len, int prot, int flags, int fd,
+            u64 offset) {
+  int page_size = getpagesize();
+  if (len == 0 || len > GUEST_MEMORY_SIZE || addr % page_size ||
+      offset % page_size) {
+    return -EINVAL;
+  }
+  len = ROUNDUP(len, (u64)page_size);
+
+  u64 heap_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  if (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)) {
+    if (addr < heap_top || addr + len > GUEST_MEMORY_SIZE) {
+      return -ENOMEM;
     }
+    if ((flags & MAP_FIXED_NOREPLACE) && mmu_find_region(mmu, addr, len)) {
+      return -EEXIST;
+    }
+  } else {
+    addr = mmu->stack_bottom ? mmu->stack_bottom : GUEST_MEMORY_SIZE;
+    for (mmu_region_t *r; addr >= len &&
+                          (r = mmu_find_region(mmu, addr - len, len));) {
+      addr = r->addr;
+    }
+    if (addr < heap_top + len) {
+      return -ENOMEM;
+    }
+    addr -= len;
+  }
+
+  // a guest cannot fork, so anonymous memory it maps shared has no one to
+  // share it with: it is private memory, tracked and saved as such.
+  if (flags & MAP_ANONYMOUS) {
+    flags = (flags & ~(MAP_SHARED | MAP_SHARED_VALIDATE)) | MAP_PRIVATE;
+  }
+
+  // only the flags that mean the same on both sides get through.
+  int host_flags = flags & (MAP_SHARED | MAP_PRIVATE | MAP_SHARED_VALIDATE |
+                            MAP_ANONYMOUS | MAP_NORESERVE | MAP_POPULATE);
+  void *host = (void *)TO_HOST(mmu->mem_base, addr);
+  if (mmap(host, len, prot, host_flags | MAP_FIXED,
+           (flags & MAP_ANONYMOUS) ? -1 : fd, offset) == MAP_FAILED) {
+    return -errno;
+  }
+
+  mmu_remove_region(mmu, addr, len);
+  if (flags & MAP_SHARED) {
+    // a shared file mapping: writes land in the file, not in state of the
+    // guest's own to track.
+    mmu_push_region(mmu, addr, len, prot, true);
+  } else {
+    mmu_add_region(mmu, addr, len, prot);
+  }
+  return addr;
+}
+
+i64 mmu_unmap(mmu_t *mmu, u64 addr, u64 len) {
+  int page_size = getpagesize();
+  if (addr % page_size || len == 0 || addr > GUEST_MEMORY_SIZE ||
+      len > GUEST_MEMORY_SIZE - addr) {
+    return -EINVAL;
+  }
+  len = ROUNDUP(len, (u64)page_size);
+
+  // the heap belongs to brk.
+  if (addr < TO_GUEST(mmu->mem_base, mmu->host_alloc)) {
+    return -EINVAL;
+  }
+
+  // give the pages back but keep the window reserved.
+  void *host = (void *)TO_HOST(mmu->mem_base, addr);
+  if (mmap(host, len, PROT_NONE,
+           MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+           0) == MAP_FAILED) {
+    return -errno;
+  }
+
+  mmu_remove_region(mmu, addr, len);
+  return 0;
+}
+
+// guest mprotect. Like the kernel, the whole range has to be mapped; the
+// heap counts as mapped up to its last page, though its protection is not
+// tracked, as brk never asks for anything but read and write.
+i64 mmu_protect(mmu_t *mmu, u64 addr, u64 len, int prot) {
+  int page_size = getpagesize();
+  if (addr % page_size || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+    return -EINVAL;
+  }
+  len = ROUNDUP(len, (u64)page_size);
+  if (addr > GUEST_MEMORY_SIZE || len > GUEST_MEMORY_SIZE - addr) {
+    return -ENOMEM;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  u64 end = addr + len;
+  u64 heap_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  u64 mapped = 0;
+  if (addr < heap_top && mmu->base < end) {
+    mapped += MIN(end, heap_top) - MAX(addr, mmu->base);
+  }
+  for (int i = 0; i < mmu->num_regions; i++) {
+    mmu_region_t *r = &mmu->regions[i];
+    if (r->addr < end && addr < r->addr + r->len) {
+      mapped += MIN(end, r->addr + r->len) - MAX(addr, r->addr);
+    }
+  }
+  if (mapped < len) {
+    return -ENOMEM;
   }
+
+  if (mprotect((void *)TO_HOST(mmu->mem_base, addr), len, prot) == -1) {
+    return -errno;
+  }
+
+  // the image's blocks are decoded from its own mapping of the file, which
+  // guest writes to the text would not reach.
+  if (mmu->image && (prot & PROT_WRITE)) {
+    for (int i = 0; i < mmu->image->num_text; i++) {
+      image_text_t *t = &mmu->image->text[i];
+      if (t->addr < end && addr < t->addr + t->len) {
+        mmu->own_text = true;
+      }
+    }
+  }
+
+  // split the regions at the edges of the range, the way mmu_remove_region
+  // does, and give the middle the new protection.
+  int n = mmu->num_regions;
+  for (int i = 0; i < n; i++) {
+    mmu_region_t r = mmu->regions[i];
+    u64 r_end = r.addr + r.len;
+    if (r_end <= addr || end <= r.addr || r.prot == prot) {
+      continue;
+    }
+
+    u64 lo = MAX(addr, r.addr), hi = MIN(end, r_end);
+    mmu->regions[i] = (mmu_region_t){lo, hi - lo, prot, r.shared};
+    if (r.addr < lo) {
+      mmu_push_region(mmu, r.addr, lo - r.addr, r.prot, r.shared);
+    }
+    if (hi < r_end) {
+      mmu_push_region(mmu, hi, r_end - hi, r.prot, r.shared);
+    }
+    // a region that was never writable was never registered either.
+    if (mmu->dirty_mode != dirty_none && !r.shared && (prot & PROT_WRITE) &&
+        !(r.prot & PROT_WRITE)) {
+      mmu_dirty_register(mmu, lo, hi - lo, prot);
+    }
+  }
+  return 0;
+}
+
+#define PM_PRESENT (1ULL << 63)
+#define PM_SWAPPED (1ULL << 62)
+#define PM_SHARED  (1ULL << 61)
+
+static u64 private_bytes(int pagemap, u64 host, u64 len) {
+  int page_size = getpagesize();
+  u64 entries[64];
+  u64 page = host / page_size;
+  u64 npages = len / page_size;
+  u64 bytes = 0;
+
+  for (u64 i = 0; i < npages; i += ARRAY_SIZE(entries)) {
+    u64 n = MIN(npages - i, ARRAY_SIZE(entries));
+    if (pread(pagemap, entries, n * sizeof(u64), (page + i) * sizeof(u64)) !=
+        (ssize_t)(n * sizeof(u64))) {
+      break;
+    }
+    for (u64 j = 0; j < n; j++) {
+      if ((entries[j] & (PM_PRESENT | PM_SWAPPED)) &&
+          !(entries[j] & PM_SHARED)) {
+        bytes += page_size;
+      }
+    }
+  }
+  return bytes;
+}
+
+// memory only this guest holds: its anonymous and copied-on-write pages,
+// resident or swapped. Page cache pages, the shared text among them, are
+// not counted.
+u64 mmu_private_bytes(mmu_t *mmu) {
+  int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (pagemap == -1) {
+    return 0;
+  }
+
+  u64 bytes = 0;
+  for (int i = 0; i < mmu->num_regions; i++) {
+    mmu_region_t *r = &mmu->regions[i];
+    bytes += private_bytes(pagemap, TO_HOST(mmu->mem_base, r->addr), r->len);
+  }
+  u64 heap_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  if (heap_top > mmu->base) {
+    bytes += private_bytes(pagemap, TO_HOST(mmu->mem_base, mmu->base),
+                           heap_top - mmu->base);
+  }
+  close(pagemap);
+  return bytes;
+}
+
+void mmu_write(mmu_t *mmu, u64 addr, void *data, u64 len) {
+  memcpy((void *)TO_HOST(mmu->mem_base, addr), data, len);
 }
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "rvemu.h"
+
+/*
+    Write coalescing for guest stdout and stderr.
+
+    Small writes to fd 1 and 2 are collected per machine and handed to the
+    host in one go when the buffer fills, on a newline when the fd is a
+    terminal, before the guest reads stdin, and at exit. Both buffers share
+    one ordering rule: appending to one first drains the other, so output
+    interleaves exactly as the guest wrote it even when both fds point at
+    the same file.
+*/
+
+// fd is the guest's; the bytes go wherever its fd table points it now.
+static void output_drain(machine_t *m, output_t *out, int fd) {
+  int host = fd_host(m->fds, fd);
+  u64 off = 0;
+  while (off < out->len) {
+    ssize_t n = host == -1 ? -1 : write(host, out->buf + off, out->len - off);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      // nobody left to report this to; the guest already saw success.
+      break;
+    }
+    off += n;
+  }
+  out->len = 0;
+}
+
+void output_flush(machine_t *m) {
+  for (int fd = 1; fd <= 2; fd++) {
+    output_t *out = &m->output[fd - 1];
+    if (out->len > 0) {
+      output_drain(m, out, fd);
+    }
+  }
+}
+
+// returns true if the write was taken over by the buffer.
+bool output_write(machine_t *m, int fd, void *data, u64 len) {
+  if (m->unbuffered || (fd != 1 && fd != 2)) {
+    return false;
+  }
+
+  output_t *out = &m->output[fd - 1];
+  output_t *other = &m->output[2 - fd];
+  if (other->len > 0) {
+    output_drain(m, other, 3 - fd);
+  }
+
+  if (!out->buf) {
+    out->buf = malloc(OUTPUT_BUF_SIZE);
+    if (!out->buf) {
+      fatal("out of memory");
+    }
+    out->line = isatty(fd_host(m->fds, fd));
+  }
+
+  // too big to be worth copying; keep order and let it go straight out.
+  if (len > OUTPUT_BUF_SIZE / 2) {
+    output_drain(m, out, fd);
+    return false;
+  }
+
+  if (out->len + len > OUTPUT_BUF_SIZE) {
+    output_drain(m, out, fd);
+  }
+  memcpy(out->buf + out->len, data, len);
+  out->len += len;
+
+  if (out->line && memchr(data, '\n', len)) {
+    output_drain(m, out, fd);
+  }
+  return true;
+}
+
+void output_free(machine_t *m) {
+  output_flush(m);
+  for (int i = 0; i < 2; i++) {
+    free(m->output[i].buf);
+    m->output[i].buf = NULL;
+  }
+}
@@ -0,0 +1,129 @@
+#include "rvemu.h"
+
+/*
+    Benchmark region markers.
+
+    A guest brackets the code it wants measured with a reserved ecall
+    (a7 = HYPERCALL_REGION, a0 = start/stop/reset, a1 = region number) and
+    the emulator accumulates, per region, guest instructions retired,
+    blocks executed, host wall time and host timestamp counter cycles
+    between each start and stop. Nothing is allocated or measured until a
+    guest first uses a marker; the totals are printed at exit. Each guest
+    thread keeps counts of its own, summed as it ends (see thread.c).
+
+    From C, with a = region:
+      register long a7 asm("a7") = 0x52564d00, a0 asm("a0") = op, ...;
+      asm volatile("ecall" : "+r"(a0) : "r"(a7), "r"(a1));
+*/
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void region_stop_now(machine_t *m, region_t *r) {
+  r->insts += m->state.insts - r->start_insts;
+  r->blocks += m->state.blocks - r->start_blocks;
+  r->ns += now_ns() - r->start_ns;
+  r->cycles += trace_ticks() - r->start_cycles;
+  r->runs++;
+  r->running = false;
+}
+
+void region_hypercall(machine_t *m) {
+  u64 *args = &m->state.gp_regs[a0];
+  u64 op = args[0], id = args[1];
+  if (id >= REGION_MAX) {
+    args[0] = -EINVAL;
+    return;
+  }
+
+  if (!m->regions) {
+    m->regions = calloc(REGION_MAX, sizeof(region_t));
+    if (!m->regions) {
+      fatal("out of memory");
+    }
+  }
+
+  region_t *r = &m->regions[id];
+  switch (op) {
+    case region_start:
+      if (!r->running) {
+        r->running = true;
+        r->start_insts = m->state.insts;
+        r->start_blocks = m->state.blocks;
+        r->start_ns = now_ns();
+        r->start_cycles = trace_ticks();
+      }
+      break;
+    case region_stop:
+      if (r->running) {
+        region_stop_now(m, r);
+      }
+      break;
+    case region_reset:
+      *r = (region_t){0};
+      break;
+    default:
+      args[0] = -EINVAL;
+      return;
+  }
+  args[0] = 0;
+}
+
+// adds thread m's counts into *into, allocated on first use; a region
+// still open there ends now. The caller holds the group lock.
+void region_merge(machine_t *m, region_t **into) {
+  if (!m->regions) {
+    return;
+  }
+  if (!*into) {
+    *into = calloc(REGION_MAX, sizeof(region_t));
+    if (!*into) {
+      fatal("out of memory");
+    }
+  }
+
+  for (int i = 0; i < REGION_MAX; i++) {
+    region_t *r = &m->regions[i], *to = &(*into)[i];
+    if (r->running) {
+      region_stop_now(m, r);
+    }
+    to->insts += r->insts;
+    to->blocks += r->blocks;
+    to->ns += r->ns;
+    to->cycles += r->cycles;
+    to->runs += r->runs;
+  }
+}
+
+void region_report(machine_t *m, FILE *out) {
+  region_t *regions = m->regions;
+  // the other threads are gone by now, their counts in the group's.
+  if (m->threads) {
+    thread_lock(m);
+    region_merge(m, &m->threads->regions);
+    regions = m->threads->regions;
+    thread_unlock(m);
+  }
+  if (!regions) {
+    return;
+  }
+
+  fprintf(out, "%6s %6s %14s %12s %14s %14s %8s\n", "region", "runs",
+          "insts", "blocks", "wall ns", "cycles", "MIPS");
+  for (int i = 0; i < REGION_MAX; i++) {
+    region_t *r = &regions[i];
+    // a region still open at exit ends there.
+    if (r->running) {
+      region_stop_now(m, r);
+    }
+    if (r->runs == 0) {
+      continue;
+    }
+    fprintf(out, "%6d %6lu %14lu %12lu %14lu %14lu %8.1f\n", i, r->runs,
+            r->insts, r->blocks, r->ns, r->cycles,
+            r->ns ? r->insts * 1e3 / r->ns : 0.0);
+  }
+}
@@ -0,0 +1,264 @@
+#include <sys/utsname.h>
+
+#include "rvemu.h"
+#include "syscall.h"
+
+/*
+    Syscall record and replay.
+
+    Recording runs every ecall as usual and then logs its number, its
+    result and each range of guest memory the kernel wrote into. Replaying
+    runs the same guest against that log without asking the host anything:
+    the result goes into a0 and the logged bytes go back into guest memory.
+    Only calls that shape the guest address space (brk, mmap, munmap,
+    mprotect) and exit are carried out again, since their effect is on the machine
+    itself. Given the same binary and arguments, a replayed run executes
+    exactly the instruction stream of the recorded one.
+*/
+
+#define REPLAY_MAGIC   "RVREPLY"
+#define REPLAY_VERSION 1
+
+typedef struct {
+  u64 nr;
+  u64 ret;
+  u64 num_writes;
+} replay_rec_t;
+
+typedef struct {
+  u64 addr;
+  u64 len;
+} replay_write_t;
+
+typedef struct {
+  u64 addr;
+  u64 len;
+} range_t;
+
+#define REPLAY_MAX_WRITES 64
+
+typedef struct {
+  range_t ranges[REPLAY_MAX_WRITES];
+  u64 num;
+} ranges_t;
+
+static void add_range(ranges_t *r, u64 addr, u64 len) {
+  if (len == 0) {
+    return;
+  }
+  if (r->num == REPLAY_MAX_WRITES) {
+    fatal("too many guest writes in one syscall to record");
+  }
+  r->ranges[r->num++] = (range_t){addr, len};
+}
+
+// the guest memory a successful call wrote to, given its original args.
+static void syscall_writes(machine_t *m, u64 nr, u64 *args, i64 ret,
+                           ranges_t *r) {
+  if (ret < 0) {
+    return;
+  }
+
+  switch (nr) {
+    case SYS_read:
+    case SYS_pread64:
+    case SYS_getdents64:
+    case SYS_getrandom:
+      add_range(r, args[nr == SYS_getrandom ? 0 : 1], ret);
+      break;
+    case SYS_readlinkat:
+      add_range(r, args[2], ret);
+      break;
+    case SYS_getcwd:
+      add_range(r, args[0], ret);
+      break;
+    case SYS_readv: {
+      u64 *iov = (u64 *)TO_HOST(m->mmu->mem_base, args[1]);
+      for (u64 i = 0; i < args[2] && ret > 0; i++) {
+        u64 len = MIN(iov[i * 2 + 1], (u64)ret);
+        add_range(r, iov[i * 2], len);
+        ret -= len;
+      }
+      break;
+    }
+    case SYS_fstat:
+      add_range(r, args[1], sizeof(guest_stat_t));
+      break;
+    case SYS_newfstatat:
+      add_range(r, args[2], sizeof(guest_stat_t));
+      break;
+    case SYS_ioctl:
+      if (args[1] == GUEST_TCGETS) {
+        add_range(r, args[2], 60);
+      } else if (args[1] == GUEST_TIOCGWINSZ) {
+        add_range(r, args[2], 8);
+      }
+      break;
+    case SYS_uname:
+      add_range(r, args[0], sizeof(struct utsname));
+      break;
+    case SYS_clock_gettime:
+      add_range(r, args[1], 16);
+      break;
+    case SYS_clock_getres:
+      add_range(r, args[1], args[1] ? 16 : 0);
+      break;
+    case SYS_gettimeofday:
+      add_range(r, args[0], args[0] ? 16 : 0);
+      add_range(r, args[1], args[1] ? 8 : 0);
+      break;
+    case SYS_prlimit64:
+      add_range(r, args[3], args[3] ? 16 : 0);
+      break;
+    // the offsets these were given are moved on past what they copied.
+    case SYS_sendfile:
+      add_range(r, args[2], args[2] ? sizeof(u64) : 0);
+      break;
+    case SYS_splice:
+    case SYS_copy_file_range:
+      add_range(r, args[1], args[1] ? sizeof(u64) : 0);
+      add_range(r, args[3], args[3] ? sizeof(u64) : 0);
+      break;
+    case SYS_mmap:
+      // a file mapping's contents are as much an input as a read is.
+      if (!(args[3] & MAP_ANONYMOUS)) {
+        struct stat st;
+        guest_stat_t gs;
+        vfs_file_t *f = fd_vfs(m->fds, args[4]);
+        u64 size;
+        if (f) {
+          vfs_fstat(f, &gs);
+          vfs_file_put(f);
+          size = gs.st_size;
+        } else if (fstat(fd_host(m->fds, args[4]), &st) == 0) {
+          size = st.st_size;
+        } else {
+          break;
+        }
+        if (size > args[5]) {
+          add_range(r, ret, MIN(args[1], size - args[5]));
+        }
+      }
+      break;
+  }
+}
+
+static bool replay_reruns(u64 nr) {
+  return nr == SYS_brk || nr == SYS_munmap || nr == SYS_mprotect ||
+         nr == SYS_exit || nr == SYS_exit_group;
+}
+
+replay_t *replay_open(char *path, bool record) {
+  replay_t *r = calloc(1, sizeof(replay_t));
+  if (!r) {
+    fatal("out of memory");
+  }
+  r->record = record;
+  r->file = fopen(path, record ? "wb" : "rb");
+  if (!r->file) {
+    fatal(strerror(errno));
+  }
+
+  char magic[8] = REPLAY_MAGIC;
+  u32 version = REPLAY_VERSION;
+  if (record) {
+    fwrite(magic, sizeof(magic), 1, r->file);
+    fwrite(&version, sizeof(version), 1, r->file);
+  } else {
+    char file_magic[8];
+    if (fread(file_magic, sizeof(file_magic), 1, r->file) != 1 ||
+        memcmp(file_magic, magic, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, r->file) != 1 ||
+        version != REPLAY_VERSION) {
+      fatal("not a replay log");
+    }
+  }
+  return r;
+}
+
+void replay_close(replay_t *r) {
+  if (!r) {
+    return;
+  }
+  if (fclose(r->file) != 0 && r->record) {
+    fatal(strerror(errno));
+  }
+  free(r);
+}
+
+static void replay_read(replay_t *r, void *data, u64 len) {
+  if (fread(data, 1, len, r->file) != len) {
+    fatal("replay log ended before the guest did");
+  }
+}
+
+static void record_syscall(machine_t *m) {
+  u64 nr = m->state.gp_regs[a7];
+  u64 args[6];
+  memcpy(args, &m->state.gp_regs[a0], sizeof(args));
+
+  do_syscall(m);
+
+  ranges_t ranges = {0};
+  replay_rec_t rec = {nr, m->state.gp_regs[a0], 0};
+  syscall_writes(m, nr, args, rec.ret, &ranges);
+  rec.num_writes = ranges.num;
+
+  FILE *f = m->replay->file;
+  fwrite(&rec, sizeof(rec), 1, f);
+  for (u64 i = 0; i < ranges.num; i++) {
+    range_t *w = &ranges.ranges[i];
+    fwrite(&(replay_write_t){w->addr, w->len}, sizeof(replay_write_t), 1, f);
+    fwrite((void *)TO_HOST(m->mmu->mem_base, w->addr), 1, w->len, f);
+  }
+}
+
+static void replay_syscall_from_log(machine_t *m) {
+  replay_t *r = m->replay;
+  u64 nr = m->state.gp_regs[a7];
+  u64 *args = &m->state.gp_regs[a0];
+
+  replay_rec_t rec;
+  replay_read(r, &rec, sizeof(rec));
+  if (rec.nr != nr) {
+    fatalf("replay diverged: guest made syscall %lu, log has %lu", nr,
+           rec.nr);
+  }
+
+  // put mappings back where they were, writable until the logged contents
+  // are in.
+  mmu_region_t *remap = NULL;
+  if (replay_reruns(nr)) {
+    do_syscall(m);
+  } else if (nr == SYS_mmap && (i64)rec.ret >= 0) {
+    if (mmu_map(m->mmu, rec.ret, args[1], args[2] | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) < 0) {
+      fatal("replay could not recreate a guest mapping");
+    }
+    remap = mmu_find_region(m->mmu, rec.ret, 1);
+    remap->prot = args[2];
+  }
+  args[0] = rec.ret;
+
+  for (u64 i = 0; i < rec.num_writes; i++) {
+    replay_write_t w;
+    replay_read(r, &w, sizeof(w));
+    if (w.addr > GUEST_MEMORY_SIZE || w.len > GUEST_MEMORY_SIZE - w.addr) {
+      fatal("replay log writes outside guest memory");
+    }
+    replay_read(r, (void *)TO_HOST(m->mmu->mem_base, w.addr), w.len);
+  }
+
+  if (remap) {
+    mprotect((void *)TO_HOST(m->mmu->mem_base, remap->addr), remap->len,
+             remap->prot);
+  }
+}
+
+void replay_syscall(machine_t *m) {
+  if (m->replay->record) {
+    record_syscall(m);
+  } else {
+    replay_syscall_from_log(m);
+  }
+}
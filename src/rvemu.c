@@ -1,23 +1,280 @@
 #include "rvemu.h"
 
 #include <assert.h>
+#include <getopt.h>
+
+extern char **environ;
+
+static u64 parse_size(char *str) {
+  char *end;
+  u64 size = strtoull(str, &end, 0);
+  switch (*end) {
+    case 'G':
+    case 'g':
+      size <<= 10;
+      __attribute__((fallthrough));
+    case 'M':
+    case 'm':
+      size <<= 10;
+      __attribute__((fallthrough));
+    case 'K':
+    case 'k':
+      size <<= 10;
+      break;
+    case '\0':
+      break;
+    default:
+      fatalf("bad size: %s", str);
+  }
+  return size;
+}
+
+static void usage(char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options] <program> [args...]\n"
+          "       %s [options] --restore <snapshot>\n"
+          "       %s [options] --batch <jobs>\n"
+          "  --snapshot <file>     dump the machine to <file>\n"
+          "  --snapshot-at <addr>  take the snapshot when the guest reaches\n"
+          "                        <addr> instead of when it stops\n"
+          "  --restore <file>      resume a machine from a snapshot\n"
+          "  --stack-size <size>   guest stack size, with optional K/M/G\n"
+          "                        suffix (default 8M)\n"
+          "  --stack-huge          back the guest stack with huge pages\n"
+          "  --vlen <bits>         vector register width, a power of two\n"
+          "                        from 128 to 1024 (default 128)\n"
+          "  --no-buffer           pass guest stdout/stderr writes straight\n"
+          "                        through, for interactive use\n"
+          "  --io-uring            do large guest reads and writes (any,\n"
+          "                        in a sliced batch) through io_uring\n"
+          "  --trace <file>        record guest syscalls and write them to\n"
+          "                        <file> at exit or on SIGUSR1\n"
+          "  --trace-size <n>      records kept in the trace ring\n"
+          "  --record <file>       log every syscall result to <file>\n"
+          "  --replay <file>       run against a --record log instead of\n"
+          "                        the host\n"
+          "  --vfs <pack>          serve files from <pack> instead of the\n"
+          "                        host filesystem\n"
+          "  --pack <pack> <dir>   write <dir> into a new pack file and exit\n"
+          "  --batch <jobs>        run every job in the file <jobs>, one per\n"
+          "                        line as <stdin> <stdout> <program> [args]\n"
+          "  --workers <n>         batch worker threads (default: one per\n"
+          "                        cpu)\n"
+          "  --slice <n>           share the workers between all batch jobs,\n"
+          "                        <n> guest instructions at a time\n"
+          "  --fork-server         run as an AFL fork server, forking a\n"
+          "                        fresh guest per test case\n"
+          "  --fork-at <addr>      run the guest to <addr> before forking\n"
+          "                        (default: its entry point)\n",
+          argv0, argv0, argv0);
+  exit(1);
+}
 
 int main(int argc, char *argv[]) {
-  assert(argc == 2);
+  static struct option long_options[] = {
+      {"snapshot", required_argument, NULL, 's'},
+      {"snapshot-at", required_argument, NULL, 'a'},
+      {"restore", required_argument, NULL, 'r'},
+      {"stack-size", required_argument, NULL, 'S'},
+      {"stack-huge", no_argument, NULL, 'H'},
+      {"vlen", required_argument, NULL, 'V'},
+      {"no-buffer", no_argument, NULL, 'u'},
+      {"io-uring", no_argument, NULL, 'i'},
+      {"trace", required_argument, NULL, 't'},
+      {"trace-size", required_argument, NULL, 'T'},
+      {"record", required_argument, NULL, 'R'},
+      {"replay", required_argument, NULL, 'P'},
+      {"vfs", required_argument, NULL, 'v'},
+      {"pack", required_argument, NULL, 'p'},
+      {"batch", required_argument, NULL, 'b'},
+      {"workers", required_argument, NULL, 'w'},
+      {"slice", required_argument, NULL, 'l'},
+      {"fork-server", no_argument, NULL, 'f'},
+      {"fork-at", required_argument, NULL, 'F'},
+      {NULL, 0, NULL, 0},
+  };
+
+  bool io_uring = false;
+  char *trace = NULL;
+  u64 trace_size = 0;
+  char *record = NULL;
+  char *replay = NULL;
+  char *vfs = NULL;
+  char *pack = NULL;
+  char *batch = NULL;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  u64 slice = 0;
+  bool fork_server = false;
+  u64 fork_at = 0;
+  char *snapshot = NULL;
+  char *restore = NULL;
+  u64 snapshot_at = 0;
+  machine_t machine = {0};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        snapshot = optarg;
+        break;
+      case 'a':
+        snapshot_at = strtoull(optarg, NULL, 0);
+        break;
+      case 'r':
+        restore = optarg;
+        break;
+      case 'S':
+        machine.stack_size = parse_size(optarg);
+        break;
+      case 'H':
+        machine.stack_huge = true;
+        break;
+      case 'V': {
+        u64 bits = strtoull(optarg, NULL, 0);
+        if (bits < VLEN_MIN || bits > VLEN_MAX || (bits & (bits - 1))) {
+          fatalf("bad vlen: %s", optarg);
+        }
+        machine.state.vlenb = bits / 8;
+        break;
+      }
+      case 'u':
+        machine.unbuffered = true;
+        break;
+      case 'i':
+        io_uring = true;
+        break;
+      case 't':
+        trace = optarg;
+        break;
+      case 'T':
+        trace_size = parse_size(optarg);
+        break;
+      case 'R':
+        record = optarg;
+        break;
+      case 'P':
+        replay = optarg;
+        break;
+      case 'v':
+        vfs = optarg;
+        break;
+      case 'p':
+        pack = optarg;
+        break;
+      case 'b':
+        batch = optarg;
+        break;
+      case 'w':
+        workers = atoi(optarg);
+        break;
+      case 'l':
+        slice = parse_size(optarg);
+        break;
+      case 'f':
+        fork_server = true;
+        break;
+      case 'F':
+        fork_at = strtoull(optarg, NULL, 0);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (pack) {
+    if (optind != argc - 1) {
+      usage(argv[0]);
+    }
+    vfs_pack(pack, argv[optind]);
+    return 0;
+  }
+
+  // per-run options (snapshots, traces, logs) name one file each, so they
+  // do not combine with a batch.
+  if (batch) {
+    if (optind != argc || restore || snapshot || trace || record || replay) {
+      usage(argv[0]);
+    }
+    return batch_run(batch, workers, slice, &machine, vfs, io_uring);
+  }
+
+  if ((restore ? optind != argc : optind == argc) || (record && replay)) {
+    usage(argv[0]);
+  }
+
+  // every child would write the same snapshot, trace or log.
+  if (fork_server && (snapshot || trace || record || replay)) {
+    usage(argv[0]);
+  }
+
+  if (restore) {
+    machine_restore(&machine, restore);
+  } else {
+    int err = machine_load_program(&machine, argv[optind]);
+    if (err) {
+      fatalf("%s: %s", argv[optind], strerror(err));
+    }
+    machine_setup(&machine, argc - optind, argv + optind, environ);
+  }
+
+  if (io_uring && !(machine.uring = uring_open())) {
+    fprintf(stderr, "warning: io_uring unavailable, using plain syscalls\n");
+  }
 
-  machine_t machine;
-  machine_load_program(&machine, argv[1]);
+  if (vfs) {
+    machine.vfs = vfs_open(vfs);
+  }
 
-  printf("host alloc: 0x%llx\n", TO_HOST(machine.mmu.entry));
-  printf("machine address: 0x%lx\n", (u64)&machine);
+  if (record || replay) {
+    machine.replay = replay_open(record ? record : replay, record != NULL);
+  }
 
-  while (true) {
-    enum exit_reason_t reason = machine_step(&machine);
-    if (reason == ecall) {
-      printf("exit reason: %d\n", reason);
+  if (trace) {
+    machine.trace = trace_open(trace, trace_size);
+  }
+
+  if (snapshot && snapshot_at) {
+    machine.stop_pc = snapshot_at;
+  }
+
+  bool forked = false, done = false;
+  if (fork_server) {
+    machine.stop_pc = fork_at;
+    // a guest that exits before the fork point has nothing to fuzz.
+    done = fork_at && machine_step(&machine, 0) == halt;
+    if (!done) {
+      forked = fuzz_fork_server(&machine);
+    }
+  }
+
+  while (!done) {
+    enum exit_reason_t reason = machine_step(&machine, 0);
+    if (reason == breakpoint) {
+      machine_snapshot(&machine, snapshot);
+      snapshot = NULL;
+      continue;
+    }
+    if (reason == halt) {
       break;
     }
   }
 
-  return 0;
-}
\ No newline at end of file
+  // a fork server child only has its exit status to report, and the
+  // address space teardown would cost more than the run.
+  if (forked) {
+    _exit(machine.exit_code);
+  }
+
+  if (snapshot) {
+    machine_snapshot(&machine, snapshot);
+  }
+
+  if (machine.trace) {
+    trace_dump(machine.trace);
+  }
+
+  region_report(&machine, stderr);
+
+  machine_free(&machine);
+  return machine.exit_code;
+}
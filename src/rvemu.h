@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -12,6 +13,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "elfdef.h"
@@ -36,10 +39,12 @@
 
 #define ARRAY_SIZE(x)   (sizeof(x)/sizeof((x)[0]))
 
-#define GUEST_MEMORY_OFFSET 0x088800000000ULL
+// every guest gets its own window of host address space, reserved at
+// mmu_init time, so several machines can live in one process.
+#define GUEST_MEMORY_SIZE (1ULL << 36)
 
-#define TO_HOST(addr)  (addr + GUEST_MEMORY_OFFSET)
-#define TO_GUEST(addr) (addr - GUEST_MEMORY_OFFSET)
+#define TO_HOST(base, addr)  ((addr) + (base))
+#define TO_GUEST(base, addr) ((addr) - (base))
 
 /*
     State
@@ -49,20 +54,67 @@ enum exit_reason_t {
   direct_branch,
   indirect_branch,
   ecall,
+  breakpoint,
+  halt,
+  budget_exhausted,
+  io_wait,
 };
 
 enum csr_t {
   fflags = 0x001,
   frm = 0x002,
-  fcsr = 0x003
+  fcsr = 0x003,
+  vstart = 0x008,
+  vxsat = 0x009,
+  vxrm = 0x00a,
+  vcsr = 0x00f,
+  vl = 0xc20,
+  vtype = 0xc21,
+  vlenb = 0xc22,
+};
+
+#define VLEN_MIN     128
+#define VLEN_MAX     1024
+#define VLENB_MAX    (VLEN_MAX / 8)
+#define DEFAULT_VLEN 128
+
+// frm values; dyn is only meaningful in an instruction's rm field.
+enum round_mode_t {
+  rne,
+  rtz,
+  rdn,
+  rup,
+  rmm,
+  dyn = 7,
 };
 
 typedef struct {
   enum exit_reason_t exit_reason;
   u64 reenter_pc;
+  u64 mem_base;
   u64 gp_regs[32];
   fp_reg_t fp_regs[32];
   u64 pc;
+  u64 insts;
+  u64 blocks;
+  // LR/SC reservation: the address and the value LR saw there.
+  u64 reserve_addr;
+  u64 reserve_val;
+  bool reserved;
+  // accrued exception flags as last harvested; anything raised since is
+  // still in the host's own flags (see fp_enter).
+  u32 fflags;
+  u32 frm;
+  // vector unit. VLEN is fixed per machine at startup; register v starts
+  // at vregs + v * vlenb, so a register group is contiguous. The spare
+  // registers past v31 absorb a misaligned group instead of the host.
+  u64 vl;
+  u64 vtype;
+  u64 vstart;
+  u32 vlenb;
+  u32 vxrm;
+  u32 vxsat;
+  u8 vregs[(32 + 7) * VLENB_MAX] __attribute__((aligned(16)));
 } state_t;
 
 /*
@@ -99,9 +151,57 @@ enum inst_type_t {
     inst_fcvt_w_d, inst_fcvt_wu_d, inst_fcvt_d_w, inst_fcvt_d_wu,
     inst_fcvt_l_d, inst_fcvt_lu_d,
     inst_fmv_x_d, inst_fcvt_d_l, inst_fcvt_d_lu, inst_fmv_d_x,
+    inst_lr_w, inst_sc_w, inst_amoswap_w, inst_amoadd_w, inst_amoxor_w,
+    inst_amoand_w, inst_amoor_w, inst_amomin_w, inst_amomax_w,
+    inst_amominu_w, inst_amomaxu_w,
+    inst_lr_d, inst_sc_d, inst_amoswap_d, inst_amoadd_d, inst_amoxor_d,
+    inst_amoand_d, inst_amoor_d, inst_amomin_d, inst_amomax_d,
+    inst_amominu_d, inst_amomaxu_d,
+    inst_vsetvli, inst_vsetivli, inst_vsetvl,
+    inst_vle8_v, inst_vle16_v, inst_vle32_v, inst_vle64_v,
+    inst_vse8_v, inst_vse16_v, inst_vse32_v, inst_vse64_v,
+    inst_vlse8_v, inst_vlse16_v, inst_vlse32_v, inst_vlse64_v,
+    inst_vsse8_v, inst_vsse16_v, inst_vsse32_v, inst_vsse64_v,
+    inst_vlm_v, inst_vsm_v,
+    inst_vadd, inst_vsub, inst_vrsub, inst_vminu, inst_vmin, inst_vmaxu, inst_vmax,
+    inst_vand, inst_vor, inst_vxor, inst_vsll, inst_vsrl, inst_vsra, inst_vmerge,
+    inst_vmseq, inst_vmsne, inst_vmsltu, inst_vmslt, inst_vmsleu, inst_vmsle,
+    inst_vmsgtu, inst_vmsgt,
+    inst_vmul, inst_vdivu, inst_vdiv, inst_vremu, inst_vrem,
+    inst_vmacc, inst_vnmsac, inst_vmadd, inst_vnmsub,
+    inst_vredsum, inst_vredand, inst_vredor, inst_vredxor,
+    inst_vredminu, inst_vredmin, inst_vredmaxu, inst_vredmax,
+    inst_vmv_x_s, inst_vmv_s_x, inst_vcpop_m, inst_vfirst_m, inst_vid_v,
+    inst_vmandn, inst_vmand, inst_vmor, inst_vmxor,
+    inst_vmorn, inst_vmnand, inst_vmnor, inst_vmxnor,
+    inst_vfadd, inst_vfsub, inst_vfrsub, inst_vfmin, inst_vfmax,
+    inst_vfmul, inst_vfdiv, inst_vfrdiv,
+    inst_vfmacc, inst_vfnmacc, inst_vfmsac, inst_vfnmsac,
+    inst_vfmadd, inst_vfnmadd, inst_vfmsub, inst_vfnmsub,
+    inst_vfmerge, inst_vfmv_f_s, inst_vfmv_s_f,
+    inst_vmfeq, inst_vmfle, inst_vmflt, inst_vmfne, inst_vmfgt, inst_vmfge,
+    inst_vfredusum, inst_vfredosum, inst_vfredmin, inst_vfredmax,
+    inst_vlr_v, inst_vsr_v, inst_vmvr_v,
+    // the rounding ops above with a static rm field: the decoder picks
+    // these, so the plain handlers run in frm's mode and never look at rm.
+    inst_fmadd_s_rm, inst_fmsub_s_rm, inst_fnmsub_s_rm, inst_fnmadd_s_rm,
+    inst_fadd_s_rm, inst_fsub_s_rm, inst_fmul_s_rm, inst_fdiv_s_rm, inst_fsqrt_s_rm,
+    inst_fcvt_s_w_rm, inst_fcvt_s_wu_rm, inst_fcvt_s_l_rm, inst_fcvt_s_lu_rm,
+    inst_fmadd_d_rm, inst_fmsub_d_rm, inst_fnmsub_d_rm, inst_fnmadd_d_rm,
+    inst_fadd_d_rm, inst_fsub_d_rm, inst_fmul_d_rm, inst_fdiv_d_rm, inst_fsqrt_d_rm,
+    inst_fcvt_s_d_rm, inst_fcvt_d_l_rm, inst_fcvt_d_lu_rm,
     num_insts,
 };
 
+// where a vector op's second operand comes from: vs1, x[rs1], the simm5
+// in rs1's place, or f[rs1].
+enum vform_t {
+  form_vv,
+  form_vx,
+  form_vi,
+  form_vf,
+};
+
 typedef struct {
   i8 rd;
   i8 rs1;
@@ -109,33 +209,428 @@ typedef struct {
   i8 rs3;
   i32 imm;
   i16 csr;
+  u8 rm;
+  u8 vform;
+  bool vm;
   enum inst_type_t type;
   bool rvc;
   bool cont;
 } inst_t;
 
 void inst_decode(inst_t *inst, u32 data);
+
+/*
+    Block cache
+*/
+#define BLOCK_MAX_INSTS 64
+#define LOOKASIDE_SIZE  64
+
+// a straight run of decoded instructions, ending at the first control
+// transfer or after BLOCK_MAX_INSTS. Never changes once cached.
+typedef struct {
+  u64 pc;
+  u32 num_insts;
+  inst_t insts[];
+} block_t;
+
+typedef struct block_table_t block_table_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  block_table_t *table;
+  u64 num_blocks;
+  u64 bytes;
+} block_cache_t;
+
+// per guest thread, in front of the shared table.
+typedef struct {
+  u64 pc;
+  block_t *block;
+} lookaside_t;
+
+block_cache_t *block_cache_new(void);
+void block_cache_free(block_cache_t *c);
+block_t *block_cache_lookup(block_cache_t *c, u64 pc);
+block_t *block_cache_insert(block_cache_t *c, block_t *b);
+block_t *block_decode(u8 *code, u64 pc, u64 len);
+void qsbr_quiescent(void);
+void qsbr_offline(void);
+
+void fp_enter(state_t *state);
+void fp_leave(state_t *state);
 void exec_block_interp(state_t *state);
+void exec_block(state_t *state, block_t *b);
+
+/*
+    Image
+*/
+#define IMAGE_MAX_TEXT 8
+
+typedef struct {
+  u64 addr;
+  u64 len;
+  u64 host;
+} image_text_t;
+
+typedef struct image_t {
+  u64 dev;
+  u64 ino;
+  u64 size;
+  struct timespec mtime;
+  int refs;
+  int num_text;
+  u64 text_bytes;
+  image_text_t text[IMAGE_MAX_TEXT];
+  block_cache_t *blocks;
+  struct image_t *next;
+} image_t;
+
+image_t *image_get(int fd);
+image_t *image_ref(image_t *image);
+void image_put(image_t *image);
+void image_add_text(image_t *image, int fd, u64 addr, u64 len, u64 offset);
+block_t *image_block(image_t *image, u64 pc);
+void image_report(FILE *out, image_t *image, int guests, u64 private_bytes);
 
 /*
     MMU
 */
+typedef struct {
+  u64 addr;
+  u64 len;
+  int prot;
+  // a shared file mapping: its writes are the file's, not guest state, so
+  // dirty tracking leaves it alone.
+  bool shared;
+} mmu_region_t;
+
+enum dirty_mode_t {
+  dirty_none,
+  dirty_uffd,
+  dirty_soft,
+  dirty_all,
+};
+
+#define STACK_HUGE_ALIGN   (2ULL << 20)
+#define DEFAULT_STACK_SIZE (8ULL << 20)
+
 typedef struct {
   u64 entry;
+  u64 phdr;
+  u64 phnum;
+  u64 phent;
+  u64 stack_bottom;
+  image_t *image;
+  // set once the guest has made its text writable: from then on it decodes
+  // its own code rather than running the image's blocks.
+  bool own_text;
+  u64 mem_base;
   u64 host_alloc;
   u64 alloc;
   u64 base;
+  mmu_region_t *regions;
+  int num_regions;
+  int cap_regions;
+  enum dirty_mode_t dirty_mode;
+  int dirty_fd;
+  int pagemap_fd;
 } mmu_t;
 
-void mmu_load_elf(mmu_t *mmu, int fd);
+int mmu_init(mmu_t *mmu);
+void mmu_free(mmu_t *mmu);
+int mmu_load_elf(mmu_t *mmu, int fd);
+void mmu_add_region(mmu_t *mmu, u64 addr, u64 len, int prot);
+mmu_region_t *mmu_find_region(mmu_t *mmu, u64 addr, u64 len);
+bool mmu_alloc(mmu_t *mmu, i64 sz);
+u64 mmu_map_stack(mmu_t *mmu, u64 size, bool huge);
+i64 mmu_map(mmu_t *mmu, u64 addr, u64 len, int prot, int flags, int fd,
+            u64 offset);
+i64 mmu_unmap(mmu_t *mmu, u64 addr, u64 len);
+i64 mmu_protect(mmu_t *mmu, u64 addr, u64 len, int prot);
+u64 mmu_private_bytes(mmu_t *mmu);
+void mmu_write(mmu_t *mmu, u64 addr, void *data, u64 len);
+
+/*
+    Dirty page tracking
+*/
+typedef void(dirty_range_fn_t)(u64 addr, u64 len, void *arg);
+
+enum dirty_mode_t mmu_dirty_start(mmu_t *mmu);
+void mmu_dirty_stop(mmu_t *mmu);
+void mmu_dirty_register(mmu_t *mmu, u64 addr, u64 len, int prot);
+void mmu_dirty_foreach(mmu_t *mmu, dirty_range_fn_t *fn, void *arg);
+void mmu_dirty_reset(mmu_t *mmu);
+
+/*
+    io_uring
+*/
+typedef struct uring_t uring_t;
+
+uring_t *uring_open(void);
+void uring_close(uring_t *ring);
+bool uring_start(uring_t *ring, bool write, int fd, void *buf, u64 len,
+                 i64 off, bool park);
+bool uring_startv(uring_t *ring, bool write, int fd, struct iovec *iov,
+                  u64 cnt, bool park);
+bool uring_poll(uring_t *ring, i64 *res);
+void uring_wait(uring_t *ring);
+bool uring_pending(uring_t *ring);
+bool uring_rw(uring_t *ring, bool write, int fd, void *buf, u64 len, i64 off,
+              i64 *res);
+bool uring_rwv(uring_t *ring, bool write, int fd, struct iovec *iov, u64 cnt,
+               i64 *res);
+
+/*
+    Syscall trace
+*/
+#define TRACE_DEFAULT_ENTRIES (64 * 1024)
+#define TRACE_MAX_SYSCALL     511
+
+typedef struct {
+  u64 nr;
+  u64 args[6];
+  i64 ret;
+  u64 ticks;
+} trace_entry_t;
+
+typedef struct {
+  trace_entry_t *ring;
+  u64 mask;
+  u64 head;
+  char *path;
+  u64 start_ticks;
+  u64 start_ns;
+  u64 count[TRACE_MAX_SYSCALL + 1];
+  u64 total_ticks[TRACE_MAX_SYSCALL + 1];
+  // SIGUSR1 dumps, from a thread of their own.
+  int sigfd;
+  pthread_t dumper;
+  pthread_mutex_t dump_lock;
+  bool closing;
+} trace_t;
+
+static inline u64 trace_ticks(void) {
+#if defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+trace_t *trace_open(char *path, u64 entries);
+void trace_close(trace_t *t);
+void trace_record(trace_t *t, u64 nr, u64 *args, u64 arg0, u64 ticks);
+void trace_dump(trace_t *t);
+
+/*
+    Record and replay
+*/
+typedef struct {
+  FILE *file;
+  bool record;
+} replay_t;
+
+replay_t *replay_open(char *path, bool record);
+void replay_close(replay_t *r);
+
+/*
+    Benchmark regions
+*/
+// a7 value of the marker ecall: a0 is the operation, a1 the region.
+#define HYPERCALL_REGION 0x52564d00
+#define REGION_MAX       16
+
+enum region_op_t {
+  region_start,
+  region_stop,
+  region_reset,
+};
+
+typedef struct {
+  u64 insts;
+  u64 blocks;
+  u64 ns;
+  u64 cycles;
+  u64 runs;
+  u64 start_insts;
+  u64 start_blocks;
+  u64 start_ns;
+  u64 start_cycles;
+  bool running;
+} region_t;
+
+/*
+    Virtual filesystem
+*/
+typedef struct vfs_t vfs_t;
+typedef struct vfs_file_t vfs_file_t;
+struct guest_stat;
+
+vfs_t *vfs_open(char *path);
+void vfs_close(vfs_t *vfs);
+bool vfs_open_file(vfs_t *vfs, char *path, int flags, vfs_file_t **file,
+                   i64 *err);
+vfs_file_t *vfs_file_get(vfs_file_t *f);
+void vfs_file_put(vfs_file_t *f);
+int vfs_file_flags(vfs_file_t *f);
+i64 vfs_read(vfs_file_t *f, void *buf, u64 len, i64 off);
+i64 vfs_write(vfs_file_t *f, void *buf, u64 len, i64 off);
+i64 vfs_lseek(vfs_file_t *f, i64 off, int whence);
+void vfs_fstat(vfs_file_t *f, struct guest_stat *gs);
+bool vfs_stat(vfs_t *vfs, char *path, struct guest_stat *gs);
+void vfs_pack(char *out_path, char *dir);
+
+/*
+    Guest file descriptors
+*/
+#define FD_MAX 65536
+
+// a host fd, or a VFS file with host == -1.
+typedef struct {
+  int host;
+  vfs_file_t *file;
+} fd_entry_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  fd_entry_t *ent;
+  int num;
+  // host dirfd of the guest's working directory, or AT_FDCWD until it
+  // first calls chdir.
+  int cwd;
+} fd_table_t;
+
+fd_table_t *fd_new(void);
+void fd_free(fd_table_t *t);
+int fd_host(fd_table_t *t, u64 guest);
+vfs_file_t *fd_vfs(fd_table_t *t, u64 guest);
+bool fd_is_vfs(fd_table_t *t, u64 guest);
+void fd_install(fd_table_t *t, int guest, fd_entry_t e);
+int fd_alloc(fd_table_t *t, fd_entry_t e, int min);
+int fd_close(fd_table_t *t, u64 guest);
+int fd_cwd(fd_table_t *t);
+void fd_chdir(fd_table_t *t, int host);
+
+/*
+    Output
+*/
+#define OUTPUT_BUF_SIZE (64 * 1024)
+
+typedef struct {
+  u8 *buf;
+  u64 len;
+  bool line;
+} output_t;
+
+/*
+    Guest threads
+*/
+// shared by every thread of a guest process once it has cloned.
+typedef struct {
+  pthread_mutex_t lock;
+  // signalled whenever a thread leaves.
+  pthread_cond_t left;
+  int live;
+  u64 next_tid;
+  // tid of the thread that started the guest, whose machine owns the rest.
+  u64 leader;
+  // set by exit_group; every thread halts at its next block or syscall.
+  bool exiting;
+  // the leader has seen exiting, and the others may go.
+  bool leader_halting;
+  int exit_code;
+  // each live thread's machine_t.host, to interrupt blocking syscalls.
+  pthread_t **hosts;
+  int num_hosts;
+  // benchmark region counts of the threads that have ended.
+  region_t *regions;
+} thread_group_t;
 
 /*
     Machine
 */
 typedef struct {
   state_t state;
-  mmu_t mmu;
+  mmu_t *mmu;
+  u64 stop_pc;
+  u64 stack_size;
+  bool stack_huge;
+  bool unbuffered;
+  // park on io_uring transfers instead of waiting for them (see
+  // machine_step).
+  bool async_io;
+  output_t output[2];
+  fd_table_t *fds;
+  vfs_t *vfs;
+  uring_t *uring;
+  trace_t *trace;
+  replay_t *replay;
+  region_t *regions;
+  thread_group_t *threads;
+  lookaside_t lookaside[LOOKASIDE_SIZE];
+  // AFL edge coverage map, if a fuzzer handed us one.
+  u8 *cov_map;
+  u64 cov_mask;
+  u64 cov_prev;
+  u64 tid;
+  u64 clear_tid;
+  // the host thread last seen running this machine.
+  pthread_t host;
+  int exit_code;
 } machine_t;
 
-void machine_load_program(machine_t *m, char *prog);
-enum exit_reason_t machine_step(machine_t *m);
\ No newline at end of file
+int machine_init(machine_t *m);
+int machine_load_program(machine_t *m, char *prog);
+void machine_setup(machine_t *m, int argc, char *argv[], char *envp[]);
+void machine_free(machine_t *m);
+enum exit_reason_t machine_step(machine_t *m, u64 budget);
+
+/*
+    Syscall
+*/
+void do_syscall(machine_t *m);
+bool do_syscall_fast(machine_t *m);
+void replay_syscall(machine_t *m);
+
+/*
+    Benchmark regions
+*/
+void region_hypercall(machine_t *m);
+void region_merge(machine_t *m, region_t **into);
+void region_report(machine_t *m, FILE *out);
+
+/*
+    Guest threads
+*/
+u64 thread_clone(machine_t *m, u64 *args);
+void thread_lock(machine_t *m);
+void thread_unlock(machine_t *m);
+void thread_exit_group(machine_t *m, int code);
+void thread_exit(machine_t *m, int code);
+bool thread_exiting(machine_t *m);
+
+/*
+    Output
+*/
+bool output_write(machine_t *m, int fd, void *data, u64 len);
+void output_flush(machine_t *m);
+void output_free(machine_t *m);
+
+/*
+    Fuzzing
+*/
+bool fuzz_fork_server(machine_t *m);
+
+/*
+    Batch
+*/
+int batch_run(char *path, int workers, u64 slice, machine_t *tmpl, char *vfs,
+              bool io_uring);
+
+/*
+    Snapshot
+*/
+void machine_snapshot(machine_t *m, char *path);
+void machine_restore(machine_t *m, char *path);
\ No newline at end of file
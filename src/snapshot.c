@@ -0,0 +1,203 @@
+#include "rvemu.h"
+
+/*
+    Whole-machine snapshots.
+
+    The file is a header, a section table and then the guest memory, each
+    section starting on a page boundary so restoring is just one private
+    mmap per section: nothing is read up front and pages the restored guest
+    never touches never leave the page cache. All-zero pages are left as
+    holes, which keeps snapshots of mostly empty heaps and stacks small.
+*/
+
+#define SNAPSHOT_MAGIC   "RVSNAP\0"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 state_size;
+  u32 num_sections;
+  u32 page_size;
+  u64 entry;
+  u64 alloc;
+  u64 base;
+  u64 heap_top;
+  state_t state;
+} snapshot_hdr_t;
+
+typedef struct {
+  u64 addr;
+  u64 len;
+  u64 offset;
+  i32 prot;
+  i32 heap;
+} snapshot_sec_t;
+
+static bool page_is_zero(u8 *page, int page_size) {
+  u64 *p = (u64 *)page;
+  for (u64 i = 0; i < page_size / sizeof(u64); i++) {
+    if (p[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void write_section(int fd, u8 *data, u64 len, u64 offset,
+                          int page_size) {
+  for (u64 off = 0; off < len; off += page_size) {
+    if (page_is_zero(data + off, page_size)) {
+      continue;
+    }
+    if (pwrite(fd, data + off, page_size, offset + off) != page_size) {
+      fatal(strerror(errno));
+    }
+  }
+}
+
+void machine_snapshot(machine_t *m, char *path) {
+  mmu_t *mmu = m->mmu;
+  int page_size = getpagesize();
+  u64 heap_top = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  bool has_heap = heap_top > mmu->base;
+
+  // buffered guest output lives outside guest memory; get it out now so a
+  // restored machine does not print it a second time.
+  output_flush(m);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fatal(strerror(errno));
+  }
+
+  u32 num_sections = mmu->num_regions + has_heap;
+  snapshot_sec_t *secs = calloc(num_sections, sizeof(snapshot_sec_t));
+  if (!secs) {
+    fatal("out of memory");
+  }
+
+  for (int i = 0; i < mmu->num_regions; i++) {
+    secs[i] = (snapshot_sec_t){
+        .addr = mmu->regions[i].addr,
+        .len = mmu->regions[i].len,
+        .prot = mmu->regions[i].prot,
+    };
+  }
+  if (has_heap) {
+    secs[num_sections - 1] = (snapshot_sec_t){
+        .addr = mmu->base,
+        .len = heap_top - mmu->base,
+        .prot = PROT_READ | PROT_WRITE,
+        .heap = true,
+    };
+  }
+
+  u64 offset = ROUNDUP(sizeof(snapshot_hdr_t) +
+                           num_sections * sizeof(snapshot_sec_t),
+                       (u64)page_size);
+  for (u32 i = 0; i < num_sections; i++) {
+    secs[i].offset = offset;
+    offset += ROUNDUP(secs[i].len, (u64)page_size);
+  }
+
+  snapshot_hdr_t hdr = {
+      .magic = SNAPSHOT_MAGIC,
+      .version = SNAPSHOT_VERSION,
+      .state_size = sizeof(state_t),
+      .num_sections = num_sections,
+      .page_size = page_size,
+      .entry = mmu->entry,
+      .alloc = mmu->alloc,
+      .base = mmu->base,
+      .heap_top = heap_top,
+      .state = m->state,
+  };
+
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      write(fd, secs, num_sections * sizeof(snapshot_sec_t)) !=
+          (ssize_t)(num_sections * sizeof(snapshot_sec_t))) {
+    fatal(strerror(errno));
+  }
+
+  for (u32 i = 0; i < num_sections; i++) {
+    u8 *data = (u8 *)TO_HOST(mmu->mem_base, secs[i].addr);
+    // a guard or reserved region may still hold data from before the
+    // guest took its access away, so open it up just for the copy.
+    bool hidden = !(secs[i].prot & PROT_READ);
+    if (hidden && mprotect(data, secs[i].len, secs[i].prot | PROT_READ)) {
+      fatal(strerror(errno));
+    }
+    write_section(fd, data, secs[i].len, secs[i].offset, page_size);
+    if (hidden && mprotect(data, secs[i].len, secs[i].prot)) {
+      fatal(strerror(errno));
+    }
+  }
+
+  // extend over any trailing holes so every section can be mapped.
+  if (ftruncate(fd, offset) == -1) {
+    fatal(strerror(errno));
+  }
+
+  free(secs);
+  close(fd);
+}
+
+void machine_restore(machine_t *m, char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fatal(strerror(errno));
+  }
+
+  snapshot_hdr_t hdr;
+  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0) {
+    fatal("not a snapshot file");
+  }
+  if (hdr.version != SNAPSHOT_VERSION || hdr.state_size != sizeof(state_t) ||
+      hdr.page_size != (u32)getpagesize()) {
+    fatal("snapshot was taken by an incompatible build");
+  }
+
+  u64 secs_size = hdr.num_sections * sizeof(snapshot_sec_t);
+  snapshot_sec_t *secs = malloc(secs_size);
+  if (!secs || read(fd, secs, secs_size) != (ssize_t)secs_size) {
+    fatal("truncated snapshot file");
+  }
+
+  // open files are not part of a snapshot; the guest gets fresh stdio.
+  int err = machine_init(m);
+  if (err) {
+    fatal(strerror(err));
+  }
+  mmu_t *mmu = m->mmu;
+
+  for (u32 i = 0; i < hdr.num_sections; i++) {
+    snapshot_sec_t *sec = &secs[i];
+    if (sec->addr + sec->len > GUEST_MEMORY_SIZE) {
+      fatal("snapshot section does not fit in guest memory");
+    }
+
+    // private, so the guest writing its memory never touches the file.
+    void *host = (void *)TO_HOST(mmu->mem_base, sec->addr);
+    if (mmap(host, sec->len, sec->prot, MAP_PRIVATE | MAP_FIXED, fd,
+             sec->offset) != host) {
+      fatal(strerror(errno));
+    }
+
+    if (!sec->heap) {
+      mmu_add_region(mmu, sec->addr, sec->len, sec->prot);
+    }
+  }
+
+  mmu->entry = hdr.entry;
+  mmu->alloc = hdr.alloc;
+  mmu->base = hdr.base;
+  mmu->host_alloc = TO_HOST(mmu->mem_base, hdr.heap_top);
+
+  m->state = hdr.state;
+  m->state.mem_base = mmu->mem_base;
+
+  free(secs);
+  close(fd);
+}
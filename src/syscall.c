@@ -0,0 +1,889 @@
+#define _GNU_SOURCE
+#include <asm/unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <time.h>
+
+#include "rvemu.h"
+#include "syscall.h"
+
+/*
+    Linux syscall emulation.
+
+    Handlers are looked up by a7 in a table indexed directly by the guest
+    syscall number and get a0..a5 as their arguments. Guest buffers are
+    handed to the host by address (TO_HOST), never copied, and whatever a
+    handler returns is written back to a0.
+*/
+
+#define SYSCALL_TABLE_SIZE 512
+
+typedef u64(syscall_t)(machine_t *m, u64 *args);
+
+#define RET(expr) ({ i64 r_ = (expr); r_ < 0 ? (u64)-errno : (u64)r_; })
+
+// reject buffers that would reach outside this guest's window before they
+// ever get to the host; inside the window the kernel reports EFAULT itself.
+#define GUEST_PTR(m, addr, len)                                  \
+  ({                                                             \
+    u64 a_ = (addr), l_ = (len);                                 \
+    if (a_ > GUEST_MEMORY_SIZE || l_ > GUEST_MEMORY_SIZE - a_) { \
+      return -EFAULT;                                            \
+    }                                                            \
+    (void *)TO_HOST((m)->mmu->mem_base, a_);                      \
+  })
+
+#define GUEST_STR(m, addr) GUEST_PTR(m, addr, 1)
+
+#define GUEST_PTR_OR_NULL(m, addr, len) \
+  ((addr) ? GUEST_PTR(m, addr, len) : NULL)
+
+// guest fds go through the machine's table; one that is not open there
+// fails the call the way the kernel would.
+#define HOST_FD(m, fd)                         \
+  ({                                           \
+    int h_ = fd_host((m)->fds, (fd));          \
+    if (h_ == -1) {                            \
+      return -EBADF;                           \
+    }                                          \
+    h_;                                        \
+  })
+
+// AT_FDCWD is the guest's working directory, not the host process's.
+#define HOST_DIRFD(m, fd) \
+  ((i32)(fd) == AT_FDCWD ? fd_cwd((m)->fds) : HOST_FD(m, fd))
+
+// only paths opened from the starting directory can be in the VFS pack.
+#define VFS_PATH(m, dirfd) \
+  ((m)->vfs && (i32)(dirfd) == AT_FDCWD && fd_cwd((m)->fds) == AT_FDCWD)
+
+static void stat_to_guest(guest_stat_t *gs, struct stat *st) {
+  *gs = (guest_stat_t){
+      .st_dev = st->st_dev,
+      .st_ino = st->st_ino,
+      .st_mode = st->st_mode,
+      .st_nlink = st->st_nlink,
+      .st_uid = st->st_uid,
+      .st_gid = st->st_gid,
+      .st_rdev = st->st_rdev,
+      .st_size = st->st_size,
+      .st_blksize = st->st_blksize,
+      .st_blocks = st->st_blocks,
+      .st_atime_sec = st->st_atim.tv_sec,
+      .st_atime_nsec = st->st_atim.tv_nsec,
+      .st_mtime_sec = st->st_mtim.tv_sec,
+      .st_mtime_nsec = st->st_mtim.tv_nsec,
+      .st_ctime_sec = st->st_ctim.tv_sec,
+      .st_ctime_nsec = st->st_ctim.tv_nsec,
+  };
+}
+
+static u64 sys_exit_group(machine_t *m, u64 *args) {
+  output_flush(m);
+  m->exit_code = (int)args[0];
+  m->state.exit_reason = halt;
+  if (m->threads) {
+    thread_exit_group(m, (int)args[0]);
+  }
+  return 0;
+}
+
+// ends only the calling thread, as on Linux; the guest ends with its last.
+static u64 sys_exit(machine_t *m, u64 *args) {
+  if (!m->threads) {
+    return sys_exit_group(m, args);
+  }
+  output_flush(m);
+  m->state.exit_reason = halt;
+  thread_exit(m, (int)args[0]);
+  return 0;
+}
+
+// anything the guest printed must be out before it blocks on stdin (a
+// prompt, say), and before it writes to stdio behind the buffer's back.
+static void flush_for(machine_t *m, u64 fd) {
+  if (fd <= 2) {
+    output_flush(m);
+  }
+}
+
+// off < 0 means "at the file position", as for read(2) and write(2).
+static u64 do_rw(machine_t *m, bool is_write, u64 fd, void *buf, u64 len,
+                 i64 off) {
+  i64 res;
+  if (m->async_io &&
+      uring_start(m->uring, is_write, fd, buf, len, off, true)) {
+    // machine_step parks the guest and hands it the result later.
+    return 0;
+  }
+  if (uring_rw(m->uring, is_write, fd, buf, len, off, &res)) {
+    return res;
+  }
+
+  if (off < 0) {
+    return is_write ? RET(write(fd, buf, len)) : RET(read(fd, buf, len));
+  }
+  return is_write ? RET(pwrite(fd, buf, len, off))
+                  : RET(pread(fd, buf, len, off));
+}
+
+// a VFS transfer, on a file held for its length (see fd_vfs).
+static u64 vfs_rw(vfs_file_t *f, bool is_write, void *buf, u64 len, i64 off) {
+  i64 n = is_write ? vfs_write(f, buf, len, off) : vfs_read(f, buf, len, off);
+  vfs_file_put(f);
+  return n;
+}
+
+static u64 sys_read(machine_t *m, u64 *args) {
+  void *buf = GUEST_PTR(m, args[1], args[2]);
+  vfs_file_t *f = fd_vfs(m->fds, args[0]);
+  if (f) {
+    return vfs_rw(f, false, buf, args[2], -1);
+  }
+  flush_for(m, args[0]);
+  return do_rw(m, false, HOST_FD(m, args[0]), buf, args[2], -1);
+}
+
+static u64 sys_write(machine_t *m, u64 *args) {
+  void *buf = GUEST_PTR(m, args[1], args[2]);
+  vfs_file_t *f = fd_vfs(m->fds, args[0]);
+  if (f) {
+    return vfs_rw(f, true, buf, args[2], -1);
+  }
+  int fd = HOST_FD(m, args[0]);
+  if (output_write(m, args[0], buf, args[2])) {
+    return args[2];
+  }
+  return do_rw(m, true, fd, buf, args[2], -1);
+}
+
+static u64 sys_pread64(machine_t *m, u64 *args) {
+  flush_for(m, args[0]);
+  if ((i64)args[3] < 0) {
+    return -EINVAL;
+  }
+  void *buf = GUEST_PTR(m, args[1], args[2]);
+  vfs_file_t *f = fd_vfs(m->fds, args[0]);
+  if (f) {
+    return vfs_rw(f, false, buf, args[2], args[3]);
+  }
+  return do_rw(m, false, HOST_FD(m, args[0]), buf, args[2], args[3]);
+}
+
+static u64 sys_pwrite64(machine_t *m, u64 *args) {
+  flush_for(m, args[0]);
+  if ((i64)args[3] < 0) {
+    return -EINVAL;
+  }
+  void *buf = GUEST_PTR(m, args[1], args[2]);
+  vfs_file_t *f = fd_vfs(m->fds, args[0]);
+  if (f) {
+    return vfs_rw(f, true, buf, args[2], args[3]);
+  }
+  return do_rw(m, true, HOST_FD(m, args[0]), buf, args[2], args[3]);
+}
+
+// guest iovecs have the host layout but guest addresses.
+static i64 iov_to_host(machine_t *m, struct iovec *iov, u64 addr, u64 cnt) {
+  if (cnt > UIO_MAXIOV) {
+    return -EINVAL;
+  }
+  u64 *guest_iov = GUEST_PTR(m, addr, cnt * 2 * sizeof(u64));
+  for (u64 i = 0; i < cnt; i++) {
+    iov[i].iov_base = GUEST_PTR(m, guest_iov[i * 2], guest_iov[i * 2 + 1]);
+    iov[i].iov_len = guest_iov[i * 2 + 1];
+  }
+  return 0;
+}
+
+// puts f, as vfs_rw does.
+static u64 vfs_rwv(vfs_file_t *f, bool is_write, struct iovec *iov,
+                   u64 cnt) {
+  i64 total = 0;
+  for (u64 i = 0; i < cnt; i++) {
+    i64 n = is_write ? vfs_write(f, iov[i].iov_base, iov[i].iov_len, -1)
+                     : vfs_read(f, iov[i].iov_base, iov[i].iov_len, -1);
+    if (n < 0) {
+      total = total ? total : n;
+      break;
+    }
+    total += n;
+    if ((u64)n < iov[i].iov_len) {
+      break;
+    }
+  }
+  vfs_file_put(f);
+  return total;
+}
+
+static u64 do_rwv(machine_t *m, bool is_write, u64 *args) {
+  flush_for(m, args[0]);
+  struct iovec iov[UIO_MAXIOV];
+  i64 res = iov_to_host(m, iov, args[1], args[2]);
+  if (res) {
+    return res;
+  }
+
+  vfs_file_t *f = fd_vfs(m->fds, args[0]);
+  if (f) {
+    return vfs_rwv(f, is_write, iov, args[2]);
+  }
+  int fd = HOST_FD(m, args[0]);
+  if (m->async_io && uring_startv(m->uring, is_write, fd, iov, args[2], true)) {
+    return 0;
+  }
+  if (uring_rwv(m->uring, is_write, fd, iov, args[2], &res)) {
+    return res;
+  }
+  return is_write ? RET(writev(fd, iov, args[2]))
+                  : RET(readv(fd, iov, args[2]));
+}
+
+static u64 sys_readv(machine_t *m, u64 *args) {
+  return do_rwv(m, false, args);
+}
+
+static u64 sys_writev(machine_t *m, u64 *args) {
+  return do_rwv(m, true, args);
+}
+
+static u64 sys_openat(machine_t *m, u64 *args) {
+  char *path = GUEST_STR(m, args[1]);
+  vfs_file_t *f;
+  i64 err;
+  if (VFS_PATH(m, args[0]) && vfs_open_file(m->vfs, path, args[2], &f, &err)) {
+    return f ? fd_alloc(m->fds, (fd_entry_t){-1, f}, 0) : (u64)err;
+  }
+
+  int fd = openat(HOST_DIRFD(m, args[0]), path, args[2], args[3]);
+  if (fd == -1) {
+    return -errno;
+  }
+  return fd_alloc(m->fds, (fd_entry_t){fd, NULL}, 0);
+}
+
+static u64 sys_close(machine_t *m, u64 *args) {
+  flush_for(m, args[0]);
+  return fd_close(m->fds, args[0]);
+}
+
+static u64 sys_lseek(machine_t *m, u64 *args) {
+  vfs_file_t *f = fd_vfs(m->fds, args[0]);
+  if (f) {
+    i64 off = vfs_lseek(f, args[1], args[2]);
+    vfs_file_put(f);
+    return off;
+  }
+  return RET(lseek(HOST_FD(m, args[0]), args[1], args[2]));
+}
+
+static u64 sys_fstat(machine_t *m, u64 *args) {
+  struct stat st;
+  guest_stat_t *gs = GUEST_PTR(m, args[1], sizeof(guest_stat_t));
+  vfs_file_t *f = fd_vfs(m->fds, args[0]);
+  if (f) {
+    vfs_fstat(f, gs);
+    vfs_file_put(f);
+    return 0;
+  }
+  if (fstat(HOST_FD(m, args[0]), &st) == -1) {
+    return -errno;
+  }
+  stat_to_guest(gs, &st);
+  return 0;
+}
+
+static u64 sys_newfstatat(machine_t *m, u64 *args) {
+  struct stat st;
+  guest_stat_t *gs = GUEST_PTR(m, args[2], sizeof(guest_stat_t));
+  if (VFS_PATH(m, args[0]) && vfs_stat(m->vfs, GUEST_STR(m, args[1]), gs)) {
+    return 0;
+  }
+  if (fstatat(HOST_DIRFD(m, args[0]), GUEST_STR(m, args[1]), &st,
+              args[3]) == -1) {
+    return -errno;
+  }
+  stat_to_guest(gs, &st);
+  return 0;
+}
+
+// VFS files have no host fd to hand the kernel, so a bulk copy with one at
+// either end goes through a buffer instead. Offsets, where given, are used
+// and moved on in place of the file position, as the kernel does.
+static i64 copy_read(machine_t *m, u64 fd, void *buf, u64 len, i64 *off) {
+  vfs_file_t *f = fd_vfs(m->fds, fd);
+  i64 n;
+  if (f) {
+    n = vfs_rw(f, false, buf, len, off ? *off : -1);
+  } else {
+    int host = HOST_FD(m, fd);
+    n = off ? pread(host, buf, len, *off) : read(host, buf, len);
+    n = n < 0 ? -errno : n;
+  }
+  if (n > 0 && off) {
+    *off += n;
+  }
+  return n;
+}
+
+static i64 copy_write(machine_t *m, u64 fd, void *buf, u64 len, i64 *off) {
+  vfs_file_t *f = fd_vfs(m->fds, fd);
+  i64 n;
+  if (f) {
+    n = vfs_rw(f, true, buf, len, off ? *off : -1);
+  } else {
+    int host = HOST_FD(m, fd);
+    n = off ? pwrite(host, buf, len, *off) : write(host, buf, len);
+    n = n < 0 ? -errno : n;
+  }
+  if (n > 0 && off) {
+    *off += n;
+  }
+  return n;
+}
+
+static u64 vfs_copy(machine_t *m, u64 in, i64 *in_off, u64 out, i64 *out_off,
+                    u64 len) {
+  u8 buf[64 * 1024];
+  u64 done = 0;
+  while (done < len) {
+    i64 n = copy_read(m, in, buf, MIN(len - done, sizeof(buf)), in_off);
+    if (n <= 0) {
+      return done ? done : (u64)n;
+    }
+    for (i64 w = 0; w < n;) {
+      i64 put = copy_write(m, out, buf + w, n - w, out_off);
+      if (put < 0) {
+        return done ? done : (u64)put;
+      }
+      w += put;
+      done += put;
+    }
+  }
+  return done;
+}
+
+// the host fd behind a non-VFS end must be of the given type.
+static bool host_fd_is(machine_t *m, u64 fd, mode_t type) {
+  struct stat st;
+  int host = fd_host(m->fds, fd);
+  return host != -1 && fstat(host, &st) == 0 && (st.st_mode & S_IFMT) == type;
+}
+
+static bool vfs_either(machine_t *m, u64 a, u64 b) {
+  return fd_is_vfs(m->fds, a) || fd_is_vfs(m->fds, b);
+}
+
+// bulk copies between two fds stay in the host kernel; the bytes never
+// pass through guest memory. Offsets, where given, are guest loff_t.
+static u64 sys_sendfile(machine_t *m, u64 *args) {
+  flush_for(m, args[0]);
+  if (vfs_either(m, args[0], args[1])) {
+    return vfs_copy(m, args[1], GUEST_PTR_OR_NULL(m, args[2], sizeof(i64)),
+                    args[0], NULL, args[3]);
+  }
+  return RET(sendfile(HOST_FD(m, args[0]), HOST_FD(m, args[1]),
+                      GUEST_PTR_OR_NULL(m, args[2], sizeof(off_t)), args[3]));
+}
+
+static u64 sys_splice(machine_t *m, u64 *args) {
+  flush_for(m, args[2]);
+  if (vfs_either(m, args[0], args[2])) {
+    // a VFS file is no pipe, so the other end has to be one.
+    u64 pipe = fd_is_vfs(m->fds, args[0]) ? args[2] : args[0];
+    if (!host_fd_is(m, pipe, S_IFIFO)) {
+      return -EINVAL;
+    }
+    return vfs_copy(m, args[0], GUEST_PTR_OR_NULL(m, args[1], sizeof(i64)),
+                    args[2], GUEST_PTR_OR_NULL(m, args[3], sizeof(i64)),
+                    args[4]);
+  }
+  return RET(splice(HOST_FD(m, args[0]),
+                    GUEST_PTR_OR_NULL(m, args[1], sizeof(loff_t)),
+                    HOST_FD(m, args[2]),
+                    GUEST_PTR_OR_NULL(m, args[3], sizeof(loff_t)), args[4],
+                    args[5]));
+}
+
+static u64 sys_copy_file_range(machine_t *m, u64 *args) {
+  flush_for(m, args[2]);
+  if (vfs_either(m, args[0], args[2])) {
+    if (args[5] != 0 ||
+        (!fd_is_vfs(m->fds, args[0]) && !host_fd_is(m, args[0], S_IFREG)) ||
+        (!fd_is_vfs(m->fds, args[2]) && !host_fd_is(m, args[2], S_IFREG))) {
+      return -EINVAL;
+    }
+    return vfs_copy(m, args[0], GUEST_PTR_OR_NULL(m, args[1], sizeof(i64)),
+                    args[2], GUEST_PTR_OR_NULL(m, args[3], sizeof(i64)),
+                    args[4]);
+  }
+  return RET(copy_file_range(HOST_FD(m, args[0]),
+                             GUEST_PTR_OR_NULL(m, args[1], sizeof(loff_t)),
+                             HOST_FD(m, args[2]),
+                             GUEST_PTR_OR_NULL(m, args[3], sizeof(loff_t)),
+                             args[4], args[5]));
+}
+
+static u64 sys_getdents64(machine_t *m, u64 *args) {
+  // struct linux_dirent64 is the same on every architecture.
+  return RET(syscall(__NR_getdents64, HOST_FD(m, args[0]),
+                     GUEST_PTR(m, args[1], args[2]), args[2]));
+}
+
+static u64 sys_readlinkat(machine_t *m, u64 *args) {
+  return RET(readlinkat(HOST_DIRFD(m, args[0]), GUEST_STR(m, args[1]),
+                        GUEST_PTR(m, args[2], args[3]), args[3]));
+}
+
+static u64 sys_faccessat(machine_t *m, u64 *args) {
+  if (VFS_PATH(m, args[0]) && vfs_stat(m->vfs, GUEST_STR(m, args[1]), NULL)) {
+    return 0;
+  }
+  return RET(
+      faccessat(HOST_DIRFD(m, args[0]), GUEST_STR(m, args[1]), args[2], 0));
+}
+
+static u64 sys_mkdirat(machine_t *m, u64 *args) {
+  return RET(mkdirat(HOST_DIRFD(m, args[0]), GUEST_STR(m, args[1]), args[2]));
+}
+
+static u64 sys_unlinkat(machine_t *m, u64 *args) {
+  return RET(
+      unlinkat(HOST_DIRFD(m, args[0]), GUEST_STR(m, args[1]), args[2]));
+}
+
+static u64 sys_getcwd(machine_t *m, u64 *args) {
+  char *buf = GUEST_PTR(m, args[0], args[1]);
+  int cwd = fd_cwd(m->fds);
+  if (cwd == AT_FDCWD) {
+    return getcwd(buf, args[1]) ? strlen(buf) + 1 : (u64)-errno;
+  }
+
+  char link[32], path[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", cwd);
+  ssize_t len = readlink(link, path, sizeof(path));
+  if (len == -1) {
+    return -errno;
+  }
+  if ((u64)len + 1 > args[1]) {
+    return -ERANGE;
+  }
+  memcpy(buf, path, len);
+  buf[len] = '\0';
+  return len + 1;
+}
+
+static u64 sys_chdir(machine_t *m, u64 *args) {
+  char *path = GUEST_STR(m, args[0]);
+  int fd = openat(fd_cwd(m->fds), path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return -errno;
+  }
+  // O_PATH checks nothing; chdir needs search permission.
+  if (faccessat(fd, ".", X_OK, 0) == -1) {
+    close(fd);
+    return -errno;
+  }
+  fd_chdir(m->fds, fd);
+  return 0;
+}
+
+// every guest fd owns its own host fd, so duplicates are host dups too.
+// VFS files are shared between their duplicates, as open files are.
+static i64 dup_entry(machine_t *m, u64 fd, bool cloexec, fd_entry_t *e) {
+  vfs_file_t *f = fd_vfs(m->fds, fd);
+  if (f) {
+    // the duplicate keeps fd_vfs's reference.
+    *e = (fd_entry_t){-1, f};
+    return 0;
+  }
+  int host = fcntl(HOST_FD(m, fd), cloexec ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+  if (host == -1) {
+    return -errno;
+  }
+  *e = (fd_entry_t){host, NULL};
+  return 0;
+}
+
+static u64 do_dup(machine_t *m, u64 fd, u64 min, bool cloexec) {
+  if (min >= FD_MAX) {
+    return -EINVAL;
+  }
+  fd_entry_t e;
+  i64 err = dup_entry(m, fd, cloexec, &e);
+  return err ? (u64)err : fd_alloc(m->fds, e, min);
+}
+
+static u64 sys_dup(machine_t *m, u64 *args) {
+  return do_dup(m, args[0], 0, false);
+}
+
+static u64 sys_dup3(machine_t *m, u64 *args) {
+  if (args[0] == args[1] || (args[2] & ~O_CLOEXEC) || args[1] >= FD_MAX) {
+    return -EINVAL;
+  }
+  fd_entry_t e;
+  i64 err = dup_entry(m, args[0], args[2], &e);
+  if (err) {
+    return err;
+  }
+  flush_for(m, args[1]);
+  fd_install(m->fds, args[1], e);
+  return args[1];
+}
+
+static u64 sys_fcntl(machine_t *m, u64 *args) {
+  switch (args[1]) {
+    case F_DUPFD:
+    case F_DUPFD_CLOEXEC:
+      return do_dup(m, args[0], args[2], args[1] == F_DUPFD_CLOEXEC);
+    case F_GETFD:
+    case F_SETFD:
+    case F_GETFL:
+    case F_SETFL: {
+      vfs_file_t *f = fd_vfs(m->fds, args[0]);
+      if (f) {
+        int flags = vfs_file_flags(f);
+        vfs_file_put(f);
+        return args[1] == F_GETFL ? flags : 0;
+      }
+      return RET(fcntl(HOST_FD(m, args[0]), args[1], args[2]));
+    }
+    default:
+      return -EINVAL;
+  }
+}
+
+static u64 sys_ioctl(machine_t *m, u64 *args) {
+  if (fd_is_vfs(m->fds, args[0])) {
+    return -ENOTTY;
+  }
+  int fd = HOST_FD(m, args[0]);
+  // struct termios and struct winsize match between the two ABIs.
+  switch (args[1]) {
+    case GUEST_TCGETS:
+      return RET(ioctl(fd, TCGETS, GUEST_PTR(m, args[2], 60)));
+    case GUEST_TIOCGWINSZ:
+      return RET(ioctl(fd, TIOCGWINSZ, GUEST_PTR(m, args[2], 8)));
+    default:
+      return -ENOTTY;
+  }
+}
+
+static u64 brk_locked(machine_t *m, u64 addr) {
+  if (addr < m->mmu->base) {
+    return m->mmu->alloc;
+  }
+
+  // like the kernel, refuse to grow into a mapping and keep the old break.
+  u64 heap_top = TO_GUEST(m->mmu->mem_base, m->mmu->host_alloc);
+  if (addr > heap_top &&
+      (addr > GUEST_MEMORY_SIZE ||
+       mmu_find_region(m->mmu, heap_top, addr - heap_top))) {
+    return m->mmu->alloc;
+  }
+  // out of host memory is the same as running into a mapping.
+  if (!mmu_alloc(m->mmu, (i64)addr - (i64)m->mmu->alloc)) {
+    return m->mmu->alloc;
+  }
+  return addr;
+}
+
+// the address space is shared by all of a guest's threads.
+static u64 sys_brk(machine_t *m, u64 *args) {
+  thread_lock(m);
+  u64 ret = brk_locked(m, args[0]);
+  thread_unlock(m);
+  return ret;
+}
+
+// a VFS file is mapped as a private copy of its contents, which is all a
+// shared writable mapping could not be.
+static u64 vfs_mmap(machine_t *m, vfs_file_t *f, u64 *args) {
+  if (args[5] % getpagesize()) {
+    return -EINVAL;
+  }
+  if ((vfs_file_flags(f) & O_ACCMODE) == O_WRONLY) {
+    return -EACCES;
+  }
+  if ((args[3] & MAP_SHARED) && (args[2] & PROT_WRITE)) {
+    return -ENODEV;
+  }
+
+  int flags = (args[3] & ~(MAP_SHARED | MAP_SHARED_VALIDATE)) | MAP_PRIVATE |
+              MAP_ANONYMOUS;
+  thread_lock(m);
+  i64 addr = mmu_map(m->mmu, args[0], args[1], args[2] | PROT_WRITE, flags, -1,
+                     0);
+  if (addr >= 0) {
+    i64 n = vfs_read(f, (void *)TO_HOST(m->mmu->mem_base, addr), args[1],
+                     args[5]);
+    if (n < 0) {
+      mmu_unmap(m->mmu, addr, args[1]);
+      addr = n;
+    } else {
+      mmu_protect(m->mmu, addr, args[1], args[2]);
+    }
+  }
+  thread_unlock(m);
+  return addr;
+}
+
+static u64 sys_mmap(machine_t *m, u64 *args) {
+  vfs_file_t *f = (args[3] & MAP_ANONYMOUS) ? NULL : fd_vfs(m->fds, args[4]);
+  if (f) {
+    u64 ret = vfs_mmap(m, f, args);
+    vfs_file_put(f);
+    return ret;
+  }
+  int fd = (args[3] & MAP_ANONYMOUS) ? -1 : HOST_FD(m, args[4]);
+  thread_lock(m);
+  i64 ret = mmu_map(m->mmu, args[0], args[1], args[2], args[3], fd, args[5]);
+  thread_unlock(m);
+  return ret;
+}
+
+static u64 sys_munmap(machine_t *m, u64 *args) {
+  thread_lock(m);
+  i64 ret = mmu_unmap(m->mmu, args[0], args[1]);
+  thread_unlock(m);
+  return ret;
+}
+
+static u64 sys_mprotect(machine_t *m, u64 *args) {
+  thread_lock(m);
+  i64 ret = mmu_protect(m->mmu, args[0], args[1], args[2]);
+  thread_unlock(m);
+  return ret;
+}
+
+static u64 sys_uname(machine_t *m, u64 *args) {
+  struct utsname *buf = GUEST_PTR(m, args[0], sizeof(struct utsname));
+  if (uname(buf) == -1) {
+    return -errno;
+  }
+  strcpy(buf->machine, "riscv64");
+  return 0;
+}
+
+static u64 sys_getrandom(machine_t *m, u64 *args) {
+  return RET(syscall(__NR_getrandom, GUEST_PTR(m, args[0], args[1]),
+                     args[1], args[2]));
+}
+
+// struct timespec and struct timeval are two 64-bit words on both sides,
+// and libc answers these from the vDSO, so a guest asking for the time
+// never costs a host syscall.
+static u64 sys_clock_gettime(machine_t *m, u64 *args) {
+  return RET(clock_gettime(args[0],
+                           GUEST_PTR(m, args[1], sizeof(struct timespec))));
+}
+
+static u64 sys_clock_getres(machine_t *m, u64 *args) {
+  struct timespec *res =
+      args[1] ? GUEST_PTR(m, args[1], sizeof(struct timespec)) : NULL;
+  return RET(clock_getres(args[0], res));
+}
+
+static u64 sys_gettimeofday(machine_t *m, u64 *args) {
+  if (args[1]) {
+    // the kernel has no real timezone to report either.
+    struct timezone *tz = GUEST_PTR(m, args[1], sizeof(struct timezone));
+    *tz = (struct timezone){0};
+  }
+  if (args[0] == 0) {
+    return 0;
+  }
+  return RET(gettimeofday(GUEST_PTR(m, args[0], sizeof(struct timeval)),
+                          NULL));
+}
+
+static u64 sys_getpid(machine_t *m, u64 *args) {
+  return getpid();
+}
+
+static u64 sys_getppid(machine_t *m, u64 *args) {
+  return getppid();
+}
+
+static u64 sys_getuid(machine_t *m, u64 *args) {
+  return getuid();
+}
+
+static u64 sys_geteuid(machine_t *m, u64 *args) {
+  return geteuid();
+}
+
+static u64 sys_getgid(machine_t *m, u64 *args) {
+  return getgid();
+}
+
+static u64 sys_getegid(machine_t *m, u64 *args) {
+  return getegid();
+}
+
+static u64 sys_gettid(machine_t *m, u64 *args) {
+  return m->tid;
+}
+
+// single-threaded guests can safely ignore these.
+static u64 sys_success(machine_t *m, u64 *args) {
+  return 0;
+}
+
+static u64 sys_set_tid_address(machine_t *m, u64 *args) {
+  m->clear_tid = args[0];
+  return m->tid;
+}
+
+static u64 sys_clone(machine_t *m, u64 *args) {
+  return thread_clone(m, args);
+}
+
+// the futex word is guest memory, and guest memory is host memory, so the
+// host kernel can wait and wake on it directly: blocking costs what it
+// does natively and threads of one guest find each other by address. Op
+// numbers, flags and struct timespec are the same on both sides. The PI
+// ops are left out, as they store real host tids in the word.
+static u64 sys_futex(machine_t *m, u64 *args) {
+  int op = args[1] & FUTEX_CMD_MASK;
+  u32 *uaddr = GUEST_PTR(m, args[0], sizeof(u32));
+  u32 *uaddr2 = NULL;
+  void *timeout = NULL;
+
+  switch (op) {
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+      timeout = GUEST_PTR_OR_NULL(m, args[3], sizeof(struct timespec));
+      break;
+    case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET:
+      break;
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+    case FUTEX_WAKE_OP:
+      // not a pointer here: the count of waiters to requeue.
+      timeout = (void *)args[3];
+      uaddr2 = GUEST_PTR(m, args[4], sizeof(u32));
+      break;
+    default:
+      return -ENOSYS;
+  }
+  return RET(syscall(__NR_futex, uaddr, (int)args[1], (u32)args[2], timeout,
+                     uaddr2, (u32)args[5]));
+}
+
+static u64 sys_prlimit64(machine_t *m, u64 *args) {
+  // struct rlimit64 matches; only allow queries of our own limits.
+  if (args[0] != 0 || args[2] != 0) {
+    return -EPERM;
+  }
+  if (args[3] == 0) {
+    return 0;
+  }
+  return RET(syscall(__NR_prlimit64, 0, args[1], NULL,
+                     GUEST_PTR(m, args[3], 16)));
+}
+
+static syscall_t *syscall_table[SYSCALL_TABLE_SIZE] = {
+    [SYS_getcwd] = sys_getcwd,
+    [SYS_dup] = sys_dup,
+    [SYS_dup3] = sys_dup3,
+    [SYS_fcntl] = sys_fcntl,
+    [SYS_ioctl] = sys_ioctl,
+    [SYS_mkdirat] = sys_mkdirat,
+    [SYS_unlinkat] = sys_unlinkat,
+    [SYS_faccessat] = sys_faccessat,
+    [SYS_chdir] = sys_chdir,
+    [SYS_openat] = sys_openat,
+    [SYS_close] = sys_close,
+    [SYS_getdents64] = sys_getdents64,
+    [SYS_lseek] = sys_lseek,
+    [SYS_read] = sys_read,
+    [SYS_write] = sys_write,
+    [SYS_readv] = sys_readv,
+    [SYS_writev] = sys_writev,
+    [SYS_pread64] = sys_pread64,
+    [SYS_pwrite64] = sys_pwrite64,
+    [SYS_sendfile] = sys_sendfile,
+    [SYS_splice] = sys_splice,
+    [SYS_readlinkat] = sys_readlinkat,
+    [SYS_newfstatat] = sys_newfstatat,
+    [SYS_fstat] = sys_fstat,
+    [SYS_exit] = sys_exit,
+    [SYS_exit_group] = sys_exit_group,
+    [SYS_set_tid_address] = sys_set_tid_address,
+    [SYS_futex] = sys_futex,
+    [SYS_set_robust_list] = sys_success,
+    [SYS_clock_gettime] = sys_clock_gettime,
+    [SYS_clock_getres] = sys_clock_getres,
+    [SYS_rt_sigaction] = sys_success,
+    [SYS_rt_sigprocmask] = sys_success,
+    [SYS_uname] = sys_uname,
+    [SYS_gettimeofday] = sys_gettimeofday,
+    [SYS_getpid] = sys_getpid,
+    [SYS_getppid] = sys_getppid,
+    [SYS_getuid] = sys_getuid,
+    [SYS_geteuid] = sys_geteuid,
+    [SYS_getgid] = sys_getgid,
+    [SYS_getegid] = sys_getegid,
+    [SYS_gettid] = sys_gettid,
+    [SYS_brk] = sys_brk,
+    [SYS_munmap] = sys_munmap,
+    [SYS_clone] = sys_clone,
+    [SYS_mmap] = sys_mmap,
+    [SYS_mprotect] = sys_mprotect,
+    [SYS_prlimit64] = sys_prlimit64,
+    [SYS_getrandom] = sys_getrandom,
+    [SYS_copy_file_range] = sys_copy_file_range,
+};
+
+// the syscalls machine_step answers without leaving its loop: they never
+// block and touch nothing but guest memory, so there is no table to give
+// up or floating-point state to hand back. Returns false, having done
+// nothing, for any other.
+bool do_syscall_fast(machine_t *m) {
+  u64 *args = &m->state.gp_regs[a0];
+  switch (m->state.gp_regs[a7]) {
+    case SYS_clock_gettime:
+      args[0] = sys_clock_gettime(m, args);
+      return true;
+    case SYS_gettimeofday:
+      args[0] = sys_gettimeofday(m, args);
+      return true;
+    default:
+      return false;
+  }
+}
+
+void do_syscall(machine_t *m) {
+  u64 n = m->state.gp_regs[a7];
+  u64 *args = &m->state.gp_regs[a0];
+
+  trace_t *trace = m->trace;
+  u64 arg0 = args[0];
+  u64 start = trace ? trace_ticks() : 0;
+
+  syscall_t *f = n < SYSCALL_TABLE_SIZE ? syscall_table[n] : NULL;
+  if (!f) {
+    fprintf(stderr, "warning: unknown syscall %lu\n", n);
+    args[0] = -ENOSYS;
+  } else {
+    // EINTR only comes from a kick (see thread.c); unless this thread is
+    // to halt, the guest, having no handler that ran, never sees it.
+    do {
+      args[0] = arg0;
+      args[0] = f(m, args);
+    } while ((i64)args[0] == -EINTR && m->state.exit_reason != halt &&
+             !(m->threads &&
+               __atomic_load_n(&m->threads->exiting, __ATOMIC_ACQUIRE)));
+  }
+
+  if (trace) {
+    trace_record(trace, n, args, arg0, trace_ticks() - start);
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef RVEMU_SYSCALL_H
+#define RVEMU_SYSCALL_H
+
+#include "types.h"
+
+// guest (RISC-V, asm-generic) numbers; the host's differ.
+#define SYS_getcwd          17
+#define SYS_dup             23
+#define SYS_dup3            24
+#define SYS_fcntl           25
+#define SYS_ioctl           29
+#define SYS_mkdirat         34
+#define SYS_unlinkat        35
+#define SYS_faccessat       48
+#define SYS_chdir           49
+#define SYS_openat          56
+#define SYS_close           57
+#define SYS_getdents64      61
+#define SYS_lseek           62
+#define SYS_read            63
+#define SYS_write           64
+#define SYS_readv           65
+#define SYS_writev          66
+#define SYS_pread64         67
+#define SYS_pwrite64        68
+#define SYS_sendfile        71
+#define SYS_splice          76
+#define SYS_readlinkat      78
+#define SYS_newfstatat      79
+#define SYS_fstat           80
+#define SYS_exit            93
+#define SYS_exit_group      94
+#define SYS_set_tid_address 96
+#define SYS_futex           98
+#define SYS_set_robust_list 99
+#define SYS_clock_gettime   113
+#define SYS_clock_getres    114
+#define SYS_rt_sigaction    134
+#define SYS_rt_sigprocmask  135
+#define SYS_uname           160
+#define SYS_gettimeofday    169
+#define SYS_getpid          172
+#define SYS_getppid         173
+#define SYS_getuid          174
+#define SYS_geteuid         175
+#define SYS_getgid          176
+#define SYS_getegid         177
+#define SYS_gettid          178
+#define SYS_brk             214
+#define SYS_munmap          215
+#define SYS_clone           220
+#define SYS_mmap            222
+#define SYS_mprotect        226
+#define SYS_prlimit64       261
+#define SYS_getrandom       278
+#define SYS_copy_file_range 285
+
+#define GUEST_TCGETS     0x5401
+#define GUEST_TIOCGWINSZ 0x5413
+
+// asm-generic struct stat, which is what the guest expects.
+typedef struct guest_stat {
+  u64 st_dev;
+  u64 st_ino;
+  u32 st_mode;
+  u32 st_nlink;
+  u32 st_uid;
+  u32 st_gid;
+  u64 st_rdev;
+  u64 __pad1;
+  i64 st_size;
+  i32 st_blksize;
+  i32 __pad2;
+  i64 st_blocks;
+  i64 st_atime_sec;
+  u64 st_atime_nsec;
+  i64 st_mtime_sec;
+  u64 st_mtime_nsec;
+  i64 st_ctime_sec;
+  u64 st_ctime_nsec;
+  u32 __unused4;
+  u32 __unused5;
+} guest_stat_t;
+
+#endif
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+#include "rvemu.h"
+
+/*
+    Guest threads.
+
+    A guest clone() asking for a thread (shared memory, files and signal
+    handlers) becomes a detached host pthread running a machine_t of its
+    own: a copy of its parent's, with a private register file but the same
+    address space and fd table, which machines hold by pointer. Guest TLS
+    needs nothing from the host, as tp is just one of the thread's
+    registers.
+
+    Loads, stores and atomics go straight to the shared memory as on
+    hardware; only address-space changes (brk, mmap, munmap) serialise, on
+    the group lock. Once a guest has a second thread its stdout and stderr
+    are no longer coalesced, so output from different threads keeps its
+    order, and the io_uring ring and syscall trace, which have a single
+    owner, stay with the thread that started the guest.
+
+    exit_group never ends the host process, which may be running other
+    guests. It sets a flag the guest's threads check at every block and
+    after every syscall, and kicks the ones blocked in a host syscall with
+    KICK_SIGNAL so that it fails with EINTR (which do_syscall otherwise
+    retries: guests have no signal handlers to see it). The thread that
+    started the guest owns its memory, so it halts last, once the others
+    are gone. exit ends only the calling thread, as on Linux; from the
+    leader it waits for the others, and the guest ends, with the leader's
+    code, when the last of them does.
+
+    Each thread counts benchmark regions on its own, and folds its counts
+    into the group's as it ends, for region_report.
+*/
+
+#define CLONE_THREAD_FLAGS \
+  (CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD)
+
+#define KICK_SIGNAL SIGURG
+// how often a leader waiting on exit_group kicks the threads again, in
+// case one was between its check and a blocking syscall.
+#define KICK_INTERVAL_NS 10000000
+
+static void on_kick(int sig) {
+  (void)sig;
+}
+
+static void kick_init(void) {
+  struct sigaction sa = {.sa_handler = on_kick};
+  sigemptyset(&sa.sa_mask);
+  // no SA_RESTART: the point is to make blocking syscalls return.
+  sigaction(KICK_SIGNAL, &sa, NULL);
+}
+
+// called with the group lock held.
+static void host_add(thread_group_t *g, pthread_t *host) {
+  g->hosts = realloc(g->hosts, (g->num_hosts + 1) * sizeof(pthread_t *));
+  if (!g->hosts) {
+    fatal("out of memory");
+  }
+  g->hosts[g->num_hosts++] = host;
+}
+
+static void host_remove(thread_group_t *g, pthread_t *host) {
+  for (int i = 0; i < g->num_hosts; i++) {
+    if (g->hosts[i] == host) {
+      g->hosts[i] = g->hosts[--g->num_hosts];
+      return;
+    }
+  }
+}
+
+static void thread_group_init(machine_t *m) {
+  static pthread_once_t kick_once = PTHREAD_ONCE_INIT;
+  pthread_once(&kick_once, kick_init);
+
+  thread_group_t *g = calloc(1, sizeof(thread_group_t));
+  if (!g) {
+    fatal("out of memory");
+  }
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->left, NULL);
+  g->live = 1;
+  g->next_tid = m->tid + 1;
+  g->leader = m->tid;
+  host_add(g, &m->host);
+  m->threads = g;
+
+  output_flush(m);
+  m->unbuffered = true;
+}
+
+void thread_lock(machine_t *m) {
+  if (m->threads) {
+    pthread_mutex_lock(&m->threads->lock);
+  }
+}
+
+void thread_unlock(machine_t *m) {
+  if (m->threads) {
+    pthread_mutex_unlock(&m->threads->lock);
+  }
+}
+
+static u32 *guest_tid_ptr(machine_t *m, u64 addr) {
+  if (addr > GUEST_MEMORY_SIZE - sizeof(u32)) {
+    return NULL;
+  }
+  return (u32 *)TO_HOST(m->state.mem_base, addr);
+}
+
+// CLONE_CHILD_CLEARTID (or set_tid_address) is how pthread_join learns
+// the thread is gone.
+static void clear_child_tid(machine_t *t) {
+  u32 *tid = t->clear_tid ? guest_tid_ptr(t, t->clear_tid) : NULL;
+  if (tid) {
+    __atomic_store_n(tid, 0, __ATOMIC_RELEASE);
+    syscall(SYS_futex, tid, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+}
+
+static void *thread_main(void *arg) {
+  machine_t *t = arg;
+  while (machine_step(t, 0) != halt) {
+  }
+  clear_child_tid(t);
+
+  thread_lock(t);
+  region_merge(t, &t->threads->regions);
+  host_remove(t->threads, &t->host);
+  t->threads->live--;
+  pthread_cond_broadcast(&t->threads->left);
+  thread_unlock(t);
+  free(t->regions);
+  free(t);
+  return NULL;
+}
+
+// args are the guest's: flags, stack, parent tid, tls, child tid.
+u64 thread_clone(machine_t *m, u64 *args) {
+  u64 flags = args[0], stack = args[1], tls = args[3];
+  u32 *ptid = guest_tid_ptr(m, args[2]);
+  u32 *ctid = guest_tid_ptr(m, args[4]);
+
+  // no fork: there is nothing to give a second address space.
+  if ((flags & CLONE_THREAD_FLAGS) != CLONE_THREAD_FLAGS) {
+    return -ENOSYS;
+  }
+  // a log holds one stream of syscalls; threads would interleave theirs.
+  if (m->replay) {
+    return -ENOSYS;
+  }
+  if (((flags & CLONE_PARENT_SETTID) && !ptid) ||
+      ((flags & (CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID)) && !ctid)) {
+    return -EFAULT;
+  }
+
+  if (!m->threads) {
+    thread_group_init(m);
+  }
+
+  machine_t *t = malloc(sizeof(machine_t));
+  if (!t) {
+    return -ENOMEM;
+  }
+  *t = *m;
+  t->stop_pc = 0;
+  t->uring = NULL;
+  t->trace = NULL;
+  t->regions = NULL;
+  t->clear_tid = (flags & CLONE_CHILD_CLEARTID) ? args[4] : 0;
+  t->state.gp_regs[a0] = 0;
+  t->state.reserved = false;
+  if (stack) {
+    t->state.gp_regs[sp] = stack;
+  }
+  if (flags & CLONE_SETTLS) {
+    t->state.gp_regs[tp] = tls;
+  }
+
+  thread_lock(m);
+  t->tid = m->threads->next_tid++;
+  m->threads->live++;
+  // until the thread runs, a kick goes to its parent, which is harmless.
+  host_add(m->threads, &t->host);
+  thread_unlock(m);
+
+  if (flags & CLONE_PARENT_SETTID) {
+    *ptid = t->tid;
+  }
+  if (flags & CLONE_CHILD_SETTID) {
+    *ctid = t->tid;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  u64 tid = t->tid;
+  int err = pthread_create(&thread, &attr, thread_main, t);
+  pthread_attr_destroy(&attr);
+  if (err) {
+    thread_lock(m);
+    host_remove(m->threads, &t->host);
+    m->threads->live--;
+    thread_unlock(m);
+    free(t);
+    return -EAGAIN;
+  }
+  return tid;
+}
+
+// called with the group lock held once exiting is set: kicks the other
+// threads until the leader has seen it or, for the leader, until every
+// other thread has halted.
+static void wait_others(machine_t *m) {
+  thread_group_t *g = m->threads;
+  bool leader = m->tid == g->leader;
+  while (leader ? g->live > 1 : !g->leader_halting) {
+    for (int i = 0; i < g->num_hosts; i++) {
+      if (g->hosts[i] != &m->host) {
+        pthread_kill(*g->hosts[i], KICK_SIGNAL);
+      }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += KICK_INTERVAL_NS;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&g->left, &g->lock, &ts);
+  }
+}
+
+static void exit_group_locked(machine_t *m, int code) {
+  thread_group_t *g = m->threads;
+  if (!g->exiting) {
+    g->exit_code = code;
+    __atomic_store_n(&g->exiting, true, __ATOMIC_RELEASE);
+    // a leader waiting in thread_exit has to hear of it too.
+    pthread_cond_broadcast(&g->left);
+  }
+  m->exit_code = g->exit_code;
+  if (m->tid == g->leader) {
+    g->leader_halting = true;
+    pthread_cond_broadcast(&g->left);
+  }
+  wait_others(m);
+}
+
+// the guest called exit_group on thread m, which halts; the caller sets
+// m's exit_reason.
+void thread_exit_group(machine_t *m, int code) {
+  pthread_mutex_lock(&m->threads->lock);
+  exit_group_locked(m, code);
+  pthread_mutex_unlock(&m->threads->lock);
+}
+
+// the guest called exit on thread m, which halts; the caller sets m's
+// exit_reason. Any other thread just ends. The leader's machine owns the
+// guest's memory, so it waits here until the rest have ended too, or
+// until one of them calls exit_group, whose code then wins.
+void thread_exit(machine_t *m, int code) {
+  thread_group_t *g = m->threads;
+  if (m->tid != g->leader) {
+    return;
+  }
+
+  clear_child_tid(m);
+  pthread_mutex_lock(&g->lock);
+  while (g->live > 1 && !g->exiting) {
+    pthread_cond_wait(&g->left, &g->lock);
+  }
+  if (g->exiting) {
+    exit_group_locked(m, code);
+  } else {
+    m->exit_code = code;
+  }
+  pthread_mutex_unlock(&g->lock);
+}
+
+// whether thread m must halt because another one called exit_group.
+bool thread_exiting(machine_t *m) {
+  thread_group_t *g = m->threads;
+  if (!g || !__atomic_load_n(&g->exiting, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  thread_exit_group(m, 0);
+  return true;
+}
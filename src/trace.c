@@ -0,0 +1,179 @@
+#include <signal.h>
+#include <sys/signalfd.h>
+
+#include "rvemu.h"
+
+/*
+    Syscall trace ring.
+
+    Every ecall of a traced machine appends one fixed-size record to a
+    power-of-two ring owned by that machine: number, arguments, result and
+    the host time spent in the handler, measured in raw timestamp counter
+    ticks. Only the machine's own thread writes, so appending is a store
+    and a release of the head; nothing is formatted until the ring is
+    dumped, at exit or when the process gets SIGUSR1. Untraced machines pay
+    one null check per ecall.
+
+    SIGUSR1 is blocked and read from a signalfd by a thread of the trace's
+    own, so a dump happens when it is asked for, even with the guest deep
+    in a loop or blocked in a syscall. That thread reads the ring while the
+    guest appends to it: it copies the records and then drops any the
+    writer may have lapped in the meantime.
+*/
+
+#define TRACE_MAGIC   "RVTRACE"
+#define TRACE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 entry_size;
+  u64 count;
+  u64 dropped;
+} trace_hdr_t;
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *dump_main(void *arg) {
+  trace_t *t = arg;
+  struct signalfd_siginfo info;
+  while (read(t->sigfd, &info, sizeof(info)) == sizeof(info) ||
+         errno == EINTR) {
+    if (__atomic_load_n(&t->closing, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    trace_dump(t);
+  }
+  return NULL;
+}
+
+trace_t *trace_open(char *path, u64 entries) {
+  entries = entries ? entries : TRACE_DEFAULT_ENTRIES;
+  u64 size = 1;
+  while (size < entries) {
+    size <<= 1;
+  }
+
+  trace_t *t = calloc(1, sizeof(trace_t));
+  if (!t || !(t->ring = calloc(size, sizeof(trace_entry_t)))) {
+    fatal("out of memory");
+  }
+  t->mask = size - 1;
+  t->path = path;
+  t->start_ticks = trace_ticks();
+  t->start_ns = now_ns();
+  pthread_mutex_init(&t->dump_lock, NULL);
+
+  // before any guest thread exists, so that every thread inherits the mask
+  // and the signal can only ever land in the signalfd.
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  t->sigfd = signalfd(-1, &set, SFD_CLOEXEC);
+  if (t->sigfd == -1) {
+    fatal(strerror(errno));
+  }
+  if (pthread_create(&t->dumper, NULL, dump_main, t)) {
+    fatal("could not start the trace dump thread");
+  }
+  return t;
+}
+
+void trace_close(trace_t *t) {
+  if (!t) {
+    return;
+  }
+  // a signal aimed at the dump thread itself shows up in its signalfd too.
+  __atomic_store_n(&t->closing, true, __ATOMIC_RELEASE);
+  pthread_kill(t->dumper, SIGUSR1);
+  pthread_join(t->dumper, NULL);
+  close(t->sigfd);
+  pthread_mutex_destroy(&t->dump_lock);
+  free(t->ring);
+  free(t);
+}
+
+void trace_record(trace_t *t, u64 nr, u64 *args, u64 arg0, u64 ticks) {
+  u64 head = t->head;
+  trace_entry_t *e = &t->ring[head & t->mask];
+  e->nr = nr;
+  e->args[0] = arg0;
+  memcpy(&e->args[1], &args[1], 5 * sizeof(u64));
+  e->ret = args[0];
+  e->ticks = ticks;
+  __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+
+  u64 slot = MIN(nr, (u64)TRACE_MAX_SYSCALL);
+  t->count[slot]++;
+  t->total_ticks[slot] += ticks;
+}
+
+// ticks are converted to nanoseconds using the rate seen since the ring
+// was opened, which is plenty for a constant-rate counter.
+static double ns_per_tick(trace_t *t) {
+  u64 ticks = trace_ticks() - t->start_ticks;
+  u64 ns = now_ns() - t->start_ns;
+  return ticks ? (double)ns / ticks : 1.0;
+}
+
+// writes the ring, oldest record first, with latencies in nanoseconds, and
+// prints the per-syscall summary to stderr.
+void trace_dump(trace_t *t) {
+  pthread_mutex_lock(&t->dump_lock);
+  double scale = ns_per_tick(t);
+  u64 size = t->mask + 1;
+  trace_entry_t *copy = malloc(size * sizeof(trace_entry_t));
+  if (!copy) {
+    fatal("out of memory");
+  }
+
+  // records below head are complete; those the writer got round to again
+  // while they were being copied, or is writing now, are dropped.
+  u64 head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+  memcpy(copy, t->ring, size * sizeof(trace_entry_t));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  u64 now = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+  u64 first = now + 1 > size ? now + 1 - size : 0;
+  u64 count = head > first ? head - first : 0;
+
+  FILE *f = fopen(t->path, "wb");
+  if (!f) {
+    fatal(strerror(errno));
+  }
+
+  trace_hdr_t hdr = {
+      .magic = TRACE_MAGIC,
+      .version = TRACE_VERSION,
+      .entry_size = sizeof(trace_entry_t),
+      .count = count,
+      .dropped = head - count,
+  };
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  for (u64 i = head - count; i < head; i++) {
+    trace_entry_t e = copy[i & t->mask];
+    e.ticks = e.ticks * scale;
+    fwrite(&e, sizeof(e), 1, f);
+  }
+  if (fclose(f) != 0) {
+    fatal(strerror(errno));
+  }
+  free(copy);
+
+  fprintf(stderr, "%8s %10s %14s %10s\n", "syscall", "calls", "total ns",
+          "avg ns");
+  for (int i = 0; i <= TRACE_MAX_SYSCALL; i++) {
+    if (t->count[i] == 0) {
+      continue;
+    }
+    u64 total = t->total_ticks[i] * scale;
+    fprintf(stderr, "%7d%s %10lu %14lu %10lu\n", i,
+            i == TRACE_MAX_SYSCALL ? "+" : " ", t->count[i], total,
+            total / t->count[i]);
+  }
+  pthread_mutex_unlock(&t->dump_lock);
+}
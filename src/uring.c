@@ -0,0 +1,360 @@
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "rvemu.h"
+
+/*
+    io_uring backend for guest file I/O.
+
+    Guest read, write, pread64, pwrite64, readv and writev can all go
+    through the ring. Large positioned transfers are split into chunks
+    that are all in flight at once, built straight on top of guest memory,
+    so the kernel works on them together instead of one after another.
+    Transfers at the file position (off -1) and vectored ones cannot be
+    split without changing what they do, and go as a single entry; the
+    iovecs are copied into the ring, as the guest's may not outlive the
+    syscall. A small transfer that the caller waits for would cost an
+    io_uring_enter where a plain syscall does the same, so unless the
+    caller parks (below) those are left to it.
+
+    A transfer is started with one enter that only submits. The owner may
+    then wait for it right away (uring_rw), or go and do other work and
+    poll the completion queue, which needs no syscall at all; the batch
+    runner parks a sliced guest that way and runs the others meanwhile.
+
+    If the ring cannot be set up, or the probe at open finds the kernel
+    lacks the opcodes, there is no ring and callers use plain syscalls; a
+    kernel that cannot read at the file position through the ring keeps
+    those transfers too. If the ring cannot be entered to start a
+    transfer, uring_start returns false and the caller falls back the same
+    way; one that cannot be entered to wait is polled instead.
+*/
+
+#define URING_ENTRIES 64
+#define URING_CHUNK   (128 * 1024)
+
+struct uring_t {
+  int fd;
+  u32 *sq_head;
+  u32 *sq_tail;
+  u32 *sq_mask;
+  u32 *sq_array;
+  struct io_uring_sqe *sqes;
+  u32 *cq_head;
+  u32 *cq_tail;
+  u32 *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  u64 sq_ring_size;
+  u64 cq_ring_size;
+  u64 sqes_size;
+  // can take off -1 for the file position.
+  bool cur_pos;
+  // the transfer in flight, if any: rounds of up to URING_ENTRIES chunks,
+  // or one entry when not chunked.
+  bool busy;
+  bool ready;
+  bool chunked;
+  u8 op;
+  int file;
+  u8 *buf;
+  u64 len;
+  u64 off;
+  u64 done;
+  u32 inflight;
+  u32 reaped;
+  i64 result;
+  i64 res[URING_ENTRIES];
+  struct iovec iov[UIO_MAXIOV];
+};
+
+// kernels from before IORING_OP_READ and IORING_OP_WRITE cannot answer the
+// probe either, so a failing probe means the same as a missing opcode.
+static bool uring_probe(int fd) {
+  u64 size = sizeof(struct io_uring_probe) +
+             256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (!probe) {
+    fatal("out of memory");
+  }
+  bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                    probe, 256) == 0 &&
+            probe->last_op >= IORING_OP_WRITE &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_READV].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+uring_t *uring_open(void) {
+  struct io_uring_params p = {0};
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (!uring_probe(fd)) {
+    close(fd);
+    return NULL;
+  }
+
+  uring_t *ring = calloc(1, sizeof(uring_t));
+  if (!ring) {
+    fatal("out of memory");
+  }
+  ring->fd = fd;
+  ring->cur_pos = p.features & IORING_FEAT_RW_CUR_POS;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+  ring->cq_ring_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_ring_size = ring->cq_ring_size =
+        MAX(ring->sq_ring_size, ring->cq_ring_size);
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = ring->sq_ring;
+  if (ring->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+
+  u8 *sq = ring->sq_ring;
+  u8 *cq = ring->cq_ring;
+  ring->sq_head = (u32 *)(sq + p.sq_off.head);
+  ring->sq_tail = (u32 *)(sq + p.sq_off.tail);
+  ring->sq_mask = (u32 *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (u32 *)(sq + p.sq_off.array);
+  ring->cq_head = (u32 *)(cq + p.cq_off.head);
+  ring->cq_tail = (u32 *)(cq + p.cq_off.tail);
+  ring->cq_mask = (u32 *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return ring;
+}
+
+void uring_close(uring_t *ring) {
+  if (!ring) {
+    return;
+  }
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+}
+
+static void uring_prep(uring_t *ring, u8 op, int fd, void *addr, u32 len,
+                       u64 off, u64 user_data) {
+  u32 tail = *ring->sq_tail;
+  u32 idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (u64)addr;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = user_data;
+
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// enter the ring to submit n entries and, with wait, to wait for at least
+// min completions. Returns how many entries went in, or -1.
+static int uring_enter(uring_t *ring, u32 n, u32 min, bool wait) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring->fd, n, min,
+                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+// submit the n entries just queued. Any the kernel did not take are taken
+// back off the queue; returns false if that was all of them.
+static bool uring_submit(uring_t *ring, u32 n) {
+  int ret = uring_enter(ring, n, 0, false);
+  u32 taken = ret < 0 ? 0 : (u32)ret;
+  if (taken < n) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail - (n - taken),
+                     __ATOMIC_RELEASE);
+  }
+  ring->inflight = taken;
+  ring->reaped = 0;
+  return taken > 0;
+}
+
+// queue the next round of chunks and submit it without waiting.
+static bool uring_round(uring_t *ring) {
+  u32 n = 0;
+  u64 queued = 0;
+  u64 pos = ring->done;
+  for (; n < URING_ENTRIES && pos + queued < ring->len; n++) {
+    u64 chunk = MIN(URING_CHUNK, ring->len - pos - queued);
+    uring_prep(ring, ring->op, ring->file, ring->buf + pos + queued, chunk,
+               ring->off + pos + queued, n);
+    queued += chunk;
+  }
+  return uring_submit(ring, n);
+}
+
+static void uring_settle(uring_t *ring, i64 result) {
+  ring->result = result;
+  ring->busy = false;
+  ring->ready = true;
+}
+
+// collect whatever has completed; when the whole round is in, either
+// settle the result or start the next round. The result is what one big
+// call would have returned: the bytes moved up to the first short chunk,
+// or the first error if nothing moved at all.
+static void uring_reap(uring_t *ring) {
+  u32 head = *ring->cq_head;
+  u32 tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++, ring->reaped++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    ring->res[cqe->user_data] = cqe->res;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+  if (ring->reaped < ring->inflight) {
+    return;
+  }
+  if (!ring->chunked) {
+    uring_settle(ring, ring->res[0]);
+    return;
+  }
+  for (u32 i = 0; i < ring->inflight; i++) {
+    u64 want = MIN(URING_CHUNK, ring->len - ring->done);
+    i64 r = ring->res[i];
+    if (r < 0) {
+      uring_settle(ring, ring->done ? (i64)ring->done : r);
+      return;
+    }
+    ring->done += r;
+    if ((u64)r < want) {
+      uring_settle(ring, ring->done);
+      return;
+    }
+  }
+  if (ring->done == ring->len || !uring_round(ring)) {
+    uring_settle(ring, ring->done);
+  }
+}
+
+// start a transfer, or return false if the caller is better off doing it
+// with a plain syscall. park says the caller goes on with other work
+// meanwhile, which makes a transfer of any size worth starting.
+bool uring_start(uring_t *ring, bool write, int fd, void *buf, u64 len,
+                 i64 off, bool park) {
+  if (!ring || (!park && len <= URING_CHUNK) || (off < 0 && !ring->cur_pos)) {
+    return false;
+  }
+  assert(!ring->busy && !ring->ready);
+
+  ring->op = write ? IORING_OP_WRITE : IORING_OP_READ;
+  ring->file = fd;
+  ring->busy = true;
+  ring->chunked = off >= 0;
+  if (!ring->chunked) {
+    // read(2) and write(2) move at most this much anyway.
+    uring_prep(ring, ring->op, fd, buf, MIN(len, 0x7ffff000), -1, 0);
+    ring->busy = uring_submit(ring, 1);
+    return ring->busy;
+  }
+
+  ring->buf = buf;
+  ring->len = len;
+  ring->off = off;
+  ring->done = 0;
+  ring->busy = uring_round(ring);
+  return ring->busy;
+}
+
+// the same for readv and writev, at the file position; iov is copied.
+bool uring_startv(uring_t *ring, bool write, int fd, struct iovec *iov,
+                  u64 cnt, bool park) {
+  u64 len = 0;
+  for (u64 i = 0; i < cnt; i++) {
+    len += iov[i].iov_len;
+  }
+  if (!ring || (!park && len <= URING_CHUNK) || !ring->cur_pos ||
+      cnt > UIO_MAXIOV) {
+    return false;
+  }
+  assert(!ring->busy && !ring->ready);
+
+  memcpy(ring->iov, iov, cnt * sizeof(struct iovec));
+  ring->op = write ? IORING_OP_WRITEV : IORING_OP_READV;
+  ring->file = fd;
+  ring->chunked = false;
+  uring_prep(ring, ring->op, fd, ring->iov, cnt, -1, 0);
+  ring->busy = uring_submit(ring, 1);
+  return ring->busy;
+}
+
+// true once a started transfer is done, with its result; never blocks.
+bool uring_poll(uring_t *ring, i64 *res) {
+  if (ring->busy) {
+    uring_reap(ring);
+  }
+  if (!ring->ready) {
+    return false;
+  }
+  ring->ready = false;
+  *res = ring->result;
+  return true;
+}
+
+// block until a started transfer is done; uring_poll then has the result.
+void uring_wait(uring_t *ring) {
+  while (ring->busy) {
+    if (uring_enter(ring, 0, ring->inflight - ring->reaped, true) < 0) {
+      sched_yield();
+    }
+    uring_reap(ring);
+  }
+}
+
+bool uring_pending(uring_t *ring) {
+  return ring && (ring->busy || ring->ready);
+}
+
+// the whole transfer, start to finish; returns false as uring_start does.
+bool uring_rw(uring_t *ring, bool write, int fd, void *buf, u64 len, i64 off,
+              i64 *res) {
+  if (!uring_start(ring, write, fd, buf, len, off, false)) {
+    return false;
+  }
+  uring_wait(ring);
+  return uring_poll(ring, res);
+}
+
+bool uring_rwv(uring_t *ring, bool write, int fd, struct iovec *iov, u64 cnt,
+               i64 *res) {
+  if (!uring_startv(ring, write, fd, iov, cnt, false)) {
+    return false;
+  }
+  uring_wait(ring);
+  return uring_poll(ring, res);
+}
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <ftw.h>
+
+#include "rvemu.h"
+#include "syscall.h"
+
+/*
+    Read-only virtual filesystem backed by a pack file.
+
+    A pack is a directory tree flattened into one file: a header, a table
+    of entries sorted by path, the path strings and then the file contents.
+    A machine maps the pack once and serves opens, reads, seeks and stats
+    of packed files from that mapping, so a guest that reads its inputs
+    out of the pack makes no host filesystem calls at all, and every run
+    sees exactly the same bytes. Guests may write to packed files; the
+    first write copies the file into memory owned by the machine, and
+    later opens in the same run see the modified copy. The pack itself is
+    never changed.
+
+    Packed paths are relative to the directory that was packed and are
+    matched against relative guest paths opened from the starting
+    directory; anything else goes to the host as usual.
+
+    Every thread of a guest shares its VFS, so file contents, sizes and
+    positions are only touched under the VFS lock.
+*/
+
+#define VFS_MAGIC   "RVPACK"
+#define VFS_VERSION 1
+#define VFS_ALIGN   64
+
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 num_files;
+} vfs_hdr_t;
+
+typedef struct {
+  u64 name_off;
+  u64 data_off;
+  u64 size;
+  u32 mode;
+  u32 pad;
+  i64 mtime_sec;
+  i64 mtime_nsec;
+} vfs_ent_t;
+
+// per-run state of one packed file: the pack's bytes until written to.
+typedef struct {
+  u8 *data;
+  u64 size;
+  u64 cap;
+  bool copied;
+} vfs_node_t;
+
+struct vfs_t {
+  pthread_mutex_t lock;
+  u8 *base;
+  u64 len;
+  vfs_ent_t *ents;
+  vfs_node_t *nodes;
+  u32 num_files;
+  u32 uid;
+  u32 gid;
+};
+
+struct vfs_file_t {
+  vfs_t *vfs;
+  u32 idx;
+  int flags;
+  int refs;
+  u64 pos;
+};
+
+vfs_t *vfs_open(char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    fatal(strerror(errno));
+  }
+
+  u8 *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fatal(strerror(errno));
+  }
+
+  vfs_hdr_t *hdr = (vfs_hdr_t *)base;
+  if ((u64)st.st_size < sizeof(vfs_hdr_t) ||
+      memcmp(hdr->magic, VFS_MAGIC, sizeof(VFS_MAGIC)) != 0 ||
+      hdr->version != VFS_VERSION ||
+      sizeof(vfs_hdr_t) + hdr->num_files * sizeof(vfs_ent_t) >
+          (u64)st.st_size) {
+    fatal("not a pack file");
+  }
+
+  vfs_t *vfs = calloc(1, sizeof(vfs_t));
+  if (!vfs) {
+    fatal("out of memory");
+  }
+  pthread_mutex_init(&vfs->lock, NULL);
+  vfs->base = base;
+  vfs->len = st.st_size;
+  vfs->num_files = hdr->num_files;
+  vfs->uid = getuid();
+  vfs->gid = getgid();
+  vfs->ents = (vfs_ent_t *)(base + sizeof(vfs_hdr_t));
+  vfs->nodes = calloc(vfs->num_files, sizeof(vfs_node_t));
+  if (!vfs->nodes) {
+    fatal("out of memory");
+  }
+
+  for (u32 i = 0; i < vfs->num_files; i++) {
+    vfs_ent_t *e = &vfs->ents[i];
+    if (e->name_off >= vfs->len || e->data_off > vfs->len ||
+        e->size > vfs->len - e->data_off ||
+        !memchr(base + e->name_off, '\0', vfs->len - e->name_off)) {
+      fatal("corrupt pack file");
+    }
+    vfs->nodes[i] = (vfs_node_t){base + e->data_off, e->size, 0, false};
+  }
+  return vfs;
+}
+
+void vfs_close(vfs_t *vfs) {
+  if (!vfs) {
+    return;
+  }
+  for (u32 i = 0; i < vfs->num_files; i++) {
+    if (vfs->nodes[i].copied) {
+      free(vfs->nodes[i].data);
+    }
+  }
+  munmap(vfs->base, vfs->len);
+  pthread_mutex_destroy(&vfs->lock);
+  free(vfs->nodes);
+  free(vfs);
+}
+
+static char *vfs_name(vfs_t *vfs, u32 idx) {
+  return (char *)vfs->base + vfs->ents[idx].name_off;
+}
+
+static i64 vfs_lookup(vfs_t *vfs, char *path) {
+  while (path[0] == '.' && path[1] == '/') {
+    path += 2;
+  }
+  if (!vfs || path[0] == '/') {
+    return -1;
+  }
+
+  i64 lo = 0, hi = (i64)vfs->num_files - 1;
+  while (lo <= hi) {
+    i64 mid = (lo + hi) / 2;
+    int cmp = strcmp(path, vfs_name(vfs, mid));
+    if (cmp == 0) {
+      return mid;
+    }
+    if (cmp < 0) {
+      hi = mid - 1;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return -1;
+}
+
+static void vfs_node_reserve(vfs_node_t *node, u64 size) {
+  if (node->copied && size <= node->cap) {
+    return;
+  }
+
+  u64 cap = MAX(size, node->cap * 2);
+  u8 *data = malloc(MAX(cap, 1ULL));
+  if (!data) {
+    fatal("out of memory");
+  }
+  memcpy(data, node->data, node->size);
+  if (node->copied) {
+    free(node->data);
+  }
+  node->data = data;
+  node->cap = cap;
+  node->copied = true;
+}
+
+// returns false if path is not in the pack and the host should handle it.
+bool vfs_open_file(vfs_t *vfs, char *path, int flags, vfs_file_t **file,
+                   i64 *err) {
+  i64 idx = vfs_lookup(vfs, path);
+  if (idx < 0) {
+    return false;
+  }
+
+  *file = NULL;
+  if ((flags & O_CREAT) && (flags & O_EXCL)) {
+    *err = -EEXIST;
+    return true;
+  }
+  if (flags & O_DIRECTORY) {
+    *err = -ENOTDIR;
+    return true;
+  }
+
+  vfs_file_t *f = calloc(1, sizeof(vfs_file_t));
+  if (!f) {
+    fatal("out of memory");
+  }
+  *f = (vfs_file_t){vfs, idx, flags, 1, 0};
+
+  if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+    pthread_mutex_lock(&vfs->lock);
+    vfs_node_reserve(&vfs->nodes[idx], 0);
+    vfs->nodes[idx].size = 0;
+    pthread_mutex_unlock(&vfs->lock);
+  }
+
+  *file = f;
+  *err = 0;
+  return true;
+}
+
+vfs_file_t *vfs_file_get(vfs_file_t *f) {
+  __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+  return f;
+}
+
+int vfs_file_flags(vfs_file_t *f) {
+  return f->flags;
+}
+
+void vfs_file_put(vfs_file_t *f) {
+  if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(f);
+  }
+}
+
+// off < 0 means at (and advancing) the file position.
+i64 vfs_read(vfs_file_t *f, void *buf, u64 len, i64 off) {
+  if ((f->flags & O_ACCMODE) == O_WRONLY) {
+    return -EBADF;
+  }
+
+  pthread_mutex_lock(&f->vfs->lock);
+  vfs_node_t *node = &f->vfs->nodes[f->idx];
+  u64 pos = off < 0 ? f->pos : (u64)off;
+  u64 n = pos < node->size ? MIN(len, node->size - pos) : 0;
+  memcpy(buf, node->data + pos, n);
+  if (off < 0) {
+    f->pos += n;
+  }
+  pthread_mutex_unlock(&f->vfs->lock);
+  return n;
+}
+
+i64 vfs_write(vfs_file_t *f, void *buf, u64 len, i64 off) {
+  if ((f->flags & O_ACCMODE) == O_RDONLY) {
+    return -EBADF;
+  }
+
+  pthread_mutex_lock(&f->vfs->lock);
+  vfs_node_t *node = &f->vfs->nodes[f->idx];
+  u64 pos = off >= 0 ? (u64)off : (f->flags & O_APPEND) ? node->size : f->pos;
+  if (pos + len > GUEST_MEMORY_SIZE) {
+    pthread_mutex_unlock(&f->vfs->lock);
+    return -EFBIG;
+  }
+
+  vfs_node_reserve(node, MAX(node->size, pos + len));
+  if (pos > node->size) {
+    memset(node->data + node->size, 0, pos - node->size);
+  }
+  memcpy(node->data + pos, buf, len);
+  node->size = MAX(node->size, pos + len);
+  if (off < 0) {
+    f->pos = pos + len;
+  }
+  pthread_mutex_unlock(&f->vfs->lock);
+  return len;
+}
+
+i64 vfs_lseek(vfs_file_t *f, i64 off, int whence) {
+  if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&f->vfs->lock);
+  i64 base = whence == SEEK_CUR   ? (i64)f->pos
+             : whence == SEEK_END ? (i64)f->vfs->nodes[f->idx].size
+                                  : 0;
+  i64 ret = base + off < 0 ? -EINVAL : (i64)(f->pos = base + off);
+  pthread_mutex_unlock(&f->vfs->lock);
+  return ret;
+}
+
+static void vfs_fill_stat(vfs_t *vfs, u32 idx, guest_stat_t *gs) {
+  vfs_ent_t *e = &vfs->ents[idx];
+  u64 size = vfs->nodes[idx].size;
+  *gs = (guest_stat_t){
+      .st_ino = idx + 1,
+      .st_mode = e->mode,
+      .st_nlink = 1,
+      .st_uid = vfs->uid,
+      .st_gid = vfs->gid,
+      .st_size = size,
+      .st_blksize = 4096,
+      .st_blocks = ROUNDUP(size, 512ULL) / 512,
+      .st_atime_sec = e->mtime_sec,
+      .st_atime_nsec = e->mtime_nsec,
+      .st_mtime_sec = e->mtime_sec,
+      .st_mtime_nsec = e->mtime_nsec,
+      .st_ctime_sec = e->mtime_sec,
+      .st_ctime_nsec = e->mtime_nsec,
+  };
+}
+
+void vfs_fstat(vfs_file_t *f, guest_stat_t *gs) {
+  pthread_mutex_lock(&f->vfs->lock);
+  vfs_fill_stat(f->vfs, f->idx, gs);
+  pthread_mutex_unlock(&f->vfs->lock);
+}
+
+// returns false if path is not in the pack.
+bool vfs_stat(vfs_t *vfs, char *path, guest_stat_t *gs) {
+  i64 idx = vfs_lookup(vfs, path);
+  if (idx < 0) {
+    return false;
+  }
+  if (gs) {
+    pthread_mutex_lock(&vfs->lock);
+    vfs_fill_stat(vfs, idx, gs);
+    pthread_mutex_unlock(&vfs->lock);
+  }
+  return true;
+}
+
+/*
+    Pack creation
+*/
+typedef struct {
+  char *path;
+  struct stat st;
+} pack_src_t;
+
+static pack_src_t *pack_srcs;
+static u32 pack_num, pack_cap;
+static u64 pack_root_len;
+
+static int pack_visit(const char *path, const struct stat *st, int type,
+                      struct FTW *ftw) {
+  if (type != FTW_F || !S_ISREG(st->st_mode)) {
+    return 0;
+  }
+  if (pack_num == pack_cap) {
+    pack_cap = pack_cap ? pack_cap * 2 : 64;
+    pack_srcs = realloc(pack_srcs, pack_cap * sizeof(pack_src_t));
+    if (!pack_srcs) {
+      fatal("out of memory");
+    }
+  }
+  pack_srcs[pack_num].path = strdup(path);
+  pack_srcs[pack_num].st = *st;
+  pack_num++;
+  return 0;
+}
+
+static int pack_cmp(const void *a, const void *b) {
+  return strcmp(((pack_src_t *)a)->path + pack_root_len,
+                ((pack_src_t *)b)->path + pack_root_len);
+}
+
+static void pack_copy(FILE *out, char *path, u64 size) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fatal(strerror(errno));
+  }
+  u8 buf[64 * 1024];
+  for (u64 done = 0; done < size;) {
+    ssize_t n = read(fd, buf, MIN(sizeof(buf), size - done));
+    if (n <= 0) {
+      fatalf("%s changed while it was being packed", path);
+    }
+    fwrite(buf, 1, n, out);
+    done += n;
+  }
+  close(fd);
+}
+
+static void pack_pad(FILE *out, u64 *off) {
+  static const u8 zeros[VFS_ALIGN];
+  u64 aligned = ROUNDUP(*off, (u64)VFS_ALIGN);
+  fwrite(zeros, 1, aligned - *off, out);
+  *off = aligned;
+}
+
+void vfs_pack(char *out_path, char *dir) {
+  pack_root_len = strlen(dir);
+  while (pack_root_len > 1 && dir[pack_root_len - 1] == '/') {
+    pack_root_len--;
+  }
+  if (nftw(dir, pack_visit, 64, FTW_PHYS) == -1) {
+    fatal(strerror(errno));
+  }
+  if (dir[pack_root_len - 1] != '/') {
+    pack_root_len++;  // and the separator after it.
+  }
+  qsort(pack_srcs, pack_num, sizeof(pack_src_t), pack_cmp);
+
+  FILE *out = fopen(out_path, "wb");
+  if (!out) {
+    fatal(strerror(errno));
+  }
+
+  vfs_ent_t *ents = calloc(pack_num + 1, sizeof(vfs_ent_t));
+  if (!ents) {
+    fatal("out of memory");
+  }
+
+  u64 off = sizeof(vfs_hdr_t) + pack_num * sizeof(vfs_ent_t);
+  for (u32 i = 0; i < pack_num; i++) {
+    ents[i].name_off = off;
+    off += strlen(pack_srcs[i].path + pack_root_len) + 1;
+  }
+  off = ROUNDUP(off, (u64)VFS_ALIGN);
+  for (u32 i = 0; i < pack_num; i++) {
+    struct stat *st = &pack_srcs[i].st;
+    ents[i].data_off = off;
+    ents[i].size = st->st_size;
+    ents[i].mode = st->st_mode;
+    ents[i].mtime_sec = st->st_mtim.tv_sec;
+    ents[i].mtime_nsec = st->st_mtim.tv_nsec;
+    off = ROUNDUP(off + st->st_size, (u64)VFS_ALIGN);
+  }
+
+  vfs_hdr_t hdr = {.magic = VFS_MAGIC,
+                   .version = VFS_VERSION,
+                   .num_files = pack_num};
+  fwrite(&hdr, sizeof(hdr), 1, out);
+  fwrite(ents, sizeof(vfs_ent_t), pack_num, out);
+  off = sizeof(vfs_hdr_t) + pack_num * sizeof(vfs_ent_t);
+  for (u32 i = 0; i < pack_num; i++) {
+    char *name = pack_srcs[i].path + pack_root_len;
+    fwrite(name, 1, strlen(name) + 1, out);
+    off += strlen(name) + 1;
+  }
+  for (u32 i = 0; i < pack_num; i++) {
+    pack_pad(out, &off);
+    pack_copy(out, pack_srcs[i].path, ents[i].size);
+    off += ents[i].size;
+  }
+
+  if (fclose(out) != 0) {
+    fatal(strerror(errno));
+  }
+  for (u32 i = 0; i < pack_num; i++) {
+    free(pack_srcs[i].path);
+  }
+  free(pack_srcs);
+  free(ents);
+  pack_srcs = NULL;
+  pack_num = pack_cap = 0;
+}
@@ -0,0 +1,145 @@
+# LR/SC and the AMOs: old values come back sign-extended for .w, memory
+# gets the new value, and an SC fails without a matching reservation or
+# after the reserved word changed. Exits 0, or the number of the failing
+# check.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  la s1, word
+  la s2, dword
+
+  # amoadd.w returns the old value.
+  li s0, 1
+  li t0, 5
+  sw t0, 0(s1)
+  li t1, 3
+  amoadd.w a0, t1, (s1)
+  li t0, 5
+  bne a0, t0, fail
+  lw t0, 0(s1)
+  li t1, 8
+  bne t0, t1, fail
+
+  # amoswap.d.
+  li s0, 2
+  li t0, 0x123456789
+  sd t0, 0(s2)
+  li t1, -2
+  amoswap.d a0, t1, (s2)
+  li t0, 0x123456789
+  bne a0, t0, fail
+  ld t0, 0(s2)
+  li t1, -2
+  bne t0, t1, fail
+
+  # a .w result is sign-extended.
+  li s0, 3
+  li t0, 0x80000000
+  sw t0, 0(s1)
+  li t1, 1
+  amoor.w a0, t1, (s1)
+  li t0, 0xffffffff80000000
+  bne a0, t0, fail
+  lw t0, 0(s1)
+  li t1, 0xffffffff80000001
+  bne t0, t1, fail
+
+  li s0, 4
+  li t1, 0xff
+  amoand.w a0, t1, (s1)
+  lw t0, 0(s1)
+  li t1, 1
+  bne t0, t1, fail
+  li t1, 3
+  amoxor.w a0, t1, (s1)
+  lw t0, 0(s1)
+  li t1, 2
+  bne t0, t1, fail
+
+  # signed and unsigned min and max.
+  li s0, 5
+  li t1, -7
+  amomax.w a0, t1, (s1)
+  lw t0, 0(s1)
+  li t1, 2
+  bne t0, t1, fail
+  li t1, -7
+  amomin.w a0, t1, (s1)
+  lw t0, 0(s1)
+  li t1, -7
+  bne t0, t1, fail
+
+  li s0, 6
+  li t0, 5
+  sd t0, 0(s2)
+  li t1, -1
+  amomaxu.d a0, t1, (s2)
+  ld t0, 0(s2)
+  li t1, -1
+  bne t0, t1, fail
+  li t1, 9
+  amominu.d a0, t1, (s2)
+  ld t0, 0(s2)
+  li t1, 9
+  bne t0, t1, fail
+
+  # a reserved SC succeeds, once.
+  li s0, 7
+  lr.d a0, (s2)
+  li t1, 9
+  bne a0, t1, fail
+  li t1, 10
+  sc.d t0, t1, (s2)
+  bnez t0, fail
+  ld t0, 0(s2)
+  li t1, 10
+  bne t0, t1, fail
+
+  li s0, 8
+  li t1, 11
+  sc.d t0, t1, (s2)
+  beqz t0, fail
+  ld t0, 0(s2)
+  li t1, 10
+  bne t0, t1, fail
+
+  # a store in between breaks the reservation.
+  li s0, 9
+  li t0, -1
+  sw t0, 0(s1)
+  lr.w a0, (s1)
+  li t1, -1
+  bne a0, t1, fail
+  li t0, 4
+  sw t0, 0(s1)
+  li t1, 5
+  sc.w t0, t1, (s1)
+  beqz t0, fail
+  lw t0, 0(s1)
+  li t1, 4
+  bne t0, t1, fail
+
+  # and so does an SC to another address.
+  li s0, 10
+  lr.w a0, (s1)
+  li t1, 6
+  addi t2, s1, 4
+  sc.w t0, t1, (t2)
+  beqz t0, fail
+  lw t0, 4(s1)
+  bnez t0, fail
+
+  li s0, 0
+fail:
+  mv a0, s0
+  li a7, 93              # exit
+  ecall
+
+  .data
+  .align 3
+word:
+  .word 0, 0
+dword:
+  .dword 0
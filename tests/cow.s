@@ -0,0 +1,71 @@
+# Run with --vfs on a pack of tests/vfs. Writing to a packed file copies
+# it: a later open in the same run sees the write, and the pack, and so the
+# next run, never do. Prints the file after the write, "XYcdef", and exits
+# 0, or exits with the number of the failing check.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  addi sp, sp, -16
+
+  li s0, 1
+  li a0, -100            # AT_FDCWD
+  la a1, path
+  li a2, 2               # O_RDWR
+  li a3, 0
+  li a7, 56              # openat
+  ecall
+  bltz a0, fail
+  mv s1, a0
+
+  li s0, 2
+  mv a0, s1
+  la a1, patch
+  li a2, 2
+  li a3, 0
+  li a7, 68              # pwrite64
+  ecall
+  li t0, 2
+  bne a0, t0, fail
+  mv a0, s1
+  li a7, 57              # close
+  ecall
+  bnez a0, fail
+
+  li s0, 3
+  li a0, -100
+  la a1, path
+  li a2, 0               # O_RDONLY
+  li a3, 0
+  li a7, 56
+  ecall
+  bltz a0, fail
+  mv s1, a0
+  mv a1, sp
+  li a2, 16
+  li a7, 63              # read
+  ecall
+  li t0, 7
+  bne a0, t0, fail
+
+  li s0, 4
+  li a0, 1
+  mv a1, sp
+  li a2, 7
+  li a7, 64              # write
+  ecall
+  li t0, 7
+  bne a0, t0, fail
+
+  li s0, 0
+fail:
+  mv a0, s0
+  li a7, 93              # exit
+  ecall
+
+  .section .rodata
+path:
+  .asciz "in.txt"
+patch:
+  .ascii "XY"
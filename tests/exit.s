@@ -0,0 +1,60 @@
+# exit from the first thread ends only that thread, as on Linux: a thread
+# it cloned goes on, sees the first thread's set_tid_address word cleared,
+# prints and exits with 3. The guest's exit code is the first thread's, 0.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  la a0, leader_tid
+  li a7, 96              # set_tid_address
+  ecall
+  la t0, leader_tid
+  sw a0, 0(t0)
+
+  li a0, 0x50f00         # CLONE_VM | CLONE_FS | CLONE_FILES | ... | THREAD
+  la a1, stack_top
+  li a2, 0
+  li a3, 0
+  li a4, 0
+  li a7, 220             # clone
+  ecall
+  beqz a0, child
+
+  li a0, 0
+  li a7, 93              # exit
+  ecall
+
+child:
+  la s1, leader_tid
+1:
+  lw a2, 0(s1)
+  beqz a2, 2f
+  mv a0, s1
+  li a1, 0               # FUTEX_WAIT
+  li a3, 0
+  li a7, 98              # futex
+  ecall
+  j 1b
+2:
+  li a0, 1
+  la a1, msg
+  li a2, 6
+  li a7, 64              # write
+  ecall
+  li a0, 3
+  li a7, 93              # exit
+  ecall
+
+  .section .rodata
+msg:
+  .ascii "child\n"
+
+  .data
+leader_tid:
+  .word 0
+
+  .bss
+  .align 4
+  .space 4096
+stack_top:
@@ -0,0 +1,31 @@
+# fence and fence.i are no-ops: one in front of a branch that is not taken,
+# or in a block cut at BLOCK_MAX_INSTS, must not end its block as if it
+# were an ecall. Exits 0, or the number of the check that made a syscall.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  # enough rounds for the blocks to be decoded and cached.
+  li s1, 3
+loop:
+  li a7, 93
+  li a0, 1
+  fence
+  bne zero, zero, 1f
+1:
+  li a0, 2
+  fence.i
+  bne zero, zero, 2f
+2:
+  li a0, 3
+  fence rw, rw
+  .rept 70
+  addi t0, t0, 1
+  .endr
+  addi s1, s1, -1
+  bnez s1, loop
+
+  li a0, 0
+  li a7, 93
+  ecall
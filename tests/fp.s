@@ -0,0 +1,144 @@
+# Floating point environment: fflags accrue and clear, frm drives dynamic
+# rounding, a static rounding mode applies to its instruction alone,
+# fmadd rounds once, and conversions of NaN and infinities to integers
+# saturate and raise only NV. Exits 0, or the number of the failing check.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  li t0, 0x3ff0000000000000     # 1.0
+  fmv.d.x f1, t0
+  li t0, 0x4008000000000000     # 3.0
+  fmv.d.x f2, t0
+  fmv.d.x f3, zero
+
+  # 1 / 0 raises DZ alone.
+  li s0, 1
+  csrw fflags, zero
+  fdiv.d f4, f1, f3
+  fmv.x.d t0, f4
+  li t1, 0x7ff0000000000000
+  bne t0, t1, fail
+  frflags t0
+  li t1, 0x08
+  bne t0, t1, fail
+
+  # flags accrue until cleared.
+  li s0, 2
+  fdiv.d f4, f1, f2
+  frflags t0
+  li t1, 0x09
+  bne t0, t1, fail
+  fsflags zero
+  frflags t0
+  bnez t0, fail
+
+  # frm rounds dynamic instructions.
+  li s0, 3
+  li t0, 3               # rup
+  fsrm t0
+  fdiv.d f4, f1, f2
+  fmv.x.d t0, f4
+  li t1, 0x3fd5555555555556
+  bne t0, t1, fail
+  frrm t0
+  li t1, 3
+  bne t0, t1, fail
+  fsrm zero
+  fdiv.d f4, f1, f2
+  fmv.x.d t0, f4
+  li t1, 0x3fd5555555555555
+  bne t0, t1, fail
+
+  # a static mode is for its instruction only.
+  li s0, 4
+  fdiv.d f4, f1, f2, rup
+  fmv.x.d t0, f4
+  li t1, 0x3fd5555555555556
+  bne t0, t1, fail
+  fdiv.d f4, f1, f2
+  fmv.x.d t0, f4
+  li t1, 0x3fd5555555555555
+  bne t0, t1, fail
+  frrm t0
+  bnez t0, fail
+
+  # fmadd rounds once: 3 * fl(1/3) - 1 is -2^-54, not 0.
+  li s0, 5
+  li t0, 0xbff0000000000000     # -1.0
+  fmv.d.x f5, t0
+  fmadd.d f6, f2, f4, f5
+  fmv.x.d t0, f6
+  li t1, 0xbc90000000000000
+  bne t0, t1, fail
+
+  # conversions: +inf, -inf and NaN saturate and raise NV.
+  li s0, 6
+  li t0, 0x7ff0000000000000
+  fmv.d.x f7, t0
+  csrw fflags, zero
+  fcvt.w.d a0, f7, rne
+  li t1, 0x7fffffff
+  bne a0, t1, fail
+  frflags t0
+  li t1, 0x10
+  bne t0, t1, fail
+
+  li s0, 7
+  li t0, 0xfff0000000000000
+  fmv.d.x f7, t0
+  csrw fflags, zero
+  fcvt.l.d a0, f7, rne
+  li t1, 0x8000000000000000
+  bne a0, t1, fail
+  fcvt.wu.d a0, f7, rne
+  bnez a0, fail
+  frflags t0
+  li t1, 0x10
+  bne t0, t1, fail
+
+  li s0, 8
+  li t0, 0x7ff8000000000000
+  fmv.d.x f7, t0
+  csrw fflags, zero
+  fcvt.lu.d a0, f7, rne
+  li t1, -1
+  bne a0, t1, fail
+  fcvt.w.d a0, f7, rtz
+  li t1, 0x7fffffff
+  bne a0, t1, fail
+  frflags t0
+  li t1, 0x10
+  bne t0, t1, fail
+
+  li s0, 9
+  li t0, 0x7fc00000
+  fmv.w.x f7, t0
+  fcvt.w.s a0, f7, rne
+  li t1, 0x7fffffff
+  bne a0, t1, fail
+
+  # a finite value rounds by the static mode and raises NX.
+  li s0, 10
+  li t0, 0x4004000000000000     # 2.5
+  fmv.d.x f7, t0
+  csrw fflags, zero
+  fcvt.w.d a0, f7, rne
+  li t1, 2
+  bne a0, t1, fail
+  fcvt.w.d a0, f7, rup
+  li t1, 3
+  bne a0, t1, fail
+  fcvt.w.d a0, f7, rtz
+  li t1, 2
+  bne a0, t1, fail
+  frflags t0
+  li t1, 0x01
+  bne t0, t1, fail
+
+  li s0, 0
+fail:
+  mv a0, s0
+  li a7, 93              # exit
+  ecall
@@ -0,0 +1,47 @@
+# Run with --record, then with --replay against the log after the file
+# named by argv[1] is gone: the replayed run must read the recorded
+# "replay" from it all the same. Exits 0, or the number of the failing
+# check.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  ld s1, 16(sp)          # argv[1]
+  addi sp, sp, -16
+
+  li s0, 1
+  li a0, -100            # AT_FDCWD
+  mv a1, s1
+  li a2, 0               # O_RDONLY
+  li a3, 0
+  li a7, 56              # openat
+  ecall
+  bltz a0, fail
+  mv s1, a0
+
+  li s0, 2
+  sd zero, 0(sp)
+  mv a1, sp
+  li a2, 16
+  li a7, 63              # read
+  ecall
+  li t0, 7
+  bne a0, t0, fail
+
+  li s0, 3
+  ld t0, 0(sp)
+  la t1, want
+  ld t1, 0(t1)
+  bne t0, t1, fail
+
+  li s0, 0
+fail:
+  mv a0, s0
+  li a7, 93              # exit
+  ecall
+
+  .section .rodata
+  .align 3
+want:
+  .ascii "replay\n\0"
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Runs the guest test programs under rvemu, then the host-side tests in
+# tests/unit: each must exit 0 (a failing check exits with its number)
+# and, where tests/<name>.out exists, print exactly that. The VFS,
+# snapshot and replay tests take two runs each, with their pack, snapshot
+# or log in a scratch directory. Run from the top of the tree, as make
+# test does.
+
+RVEMU=${RVEMU:-./rvemu}
+fails=0
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+check() {
+  name=$1
+  shift
+  out=$("$@" 2>/dev/null)
+  code=$?
+  if [ $code -ne 0 ]; then
+    echo "FAIL $name: exit $code"
+    fails=$((fails + 1))
+  elif [ -f "tests/$name.out" ] && [ "$out" != "$(cat "tests/$name.out")" ]; then
+    echo "FAIL $name: output differs from tests/$name.out"
+    fails=$((fails + 1))
+  else
+    echo "ok   $name"
+  fi
+}
+
+check test $RVEMU tests/test
+check fence $RVEMU tests/fence
+check text $RVEMU tests/text
+check exit $RVEMU tests/exit
+check syscall $RVEMU tests/syscall
+check atomic $RVEMU tests/atomic
+check fp $RVEMU tests/fp
+check vector $RVEMU tests/vector
+
+$RVEMU --pack "$tmp/cow.pack" tests/vfs
+check cow $RVEMU --vfs "$tmp/cow.pack" tests/cow
+# the first run's write must not have reached the pack.
+check cow $RVEMU --vfs "$tmp/cow.pack" tests/cow
+
+# snapshot at snap, the instruction after the entry point's jump.
+entry=$(od -An -tx8 -j24 -N8 tests/snapshot | tr -d ' ')
+check snapshot $RVEMU --snapshot "$tmp/snapshot" \
+  --snapshot-at $((0x$entry + 4)) tests/snapshot
+check restore $RVEMU --restore "$tmp/snapshot"
+
+printf 'replay\n' >"$tmp/replay.in"
+check record $RVEMU --record "$tmp/replay.log" tests/replay "$tmp/replay.in"
+rm "$tmp/replay.in"
+check replay $RVEMU --replay "$tmp/replay.log" tests/replay "$tmp/replay.in"
+
+check dirty tests/unit/dirty
+check fpround tests/unit/fpround
+
+if [ $fails -ne 0 ]; then
+  echo "$fails failed"
+  exit 1
+fi
@@ -0,0 +1,74 @@
+# Run with --snapshot-at <_start + 4>, then --restore the snapshot. Before
+# snap, the guest leaves values in a register, .data, the stack and the
+# heap and prints "before"; from snap on, both the first run and the
+# restored one must find them all, print "after" and exit 0, or exit with
+# the number of the failing check.
+
+  .option norelax
+  .option norvc
+  .text
+  .globl _start
+_start:
+  j setup
+snap:
+  li s0, 1
+  li t0, 41
+  bne s1, t0, fail
+
+  li s0, 2
+  la t1, word
+  ld t1, 0(t1)
+  bne t1, t0, fail
+
+  li s0, 3
+  ld t1, 0(sp)
+  bne t1, t0, fail
+
+  li s0, 4
+  ld t1, 0(s2)
+  bne t1, t0, fail
+
+  la a1, after
+  li a2, 6
+  call print
+  li s0, 0
+fail:
+  mv a0, s0
+  li a7, 93              # exit
+  ecall
+
+setup:
+  li s1, 41
+  la t1, word
+  sd s1, 0(t1)
+  addi sp, sp, -16
+  sd s1, 0(sp)
+  li a0, 0
+  li a7, 214             # brk
+  ecall
+  mv s2, a0
+  addi a0, a0, 64
+  li a7, 214
+  ecall
+  sd s1, 0(s2)
+  la a1, before
+  li a2, 7
+  call print
+  j snap
+
+print:
+  li a0, 1
+  li a7, 64              # write
+  ecall
+  ret
+
+  .section .rodata
+before:
+  .ascii "before\n"
+after:
+  .ascii "after\n"
+
+  .data
+  .align 3
+word:
+  .dword 0
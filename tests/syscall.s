@@ -0,0 +1,185 @@
+# A walk through the syscall table: process ids, uname, file descriptors,
+# the heap, anonymous memory, randomness, the clocks and an unknown
+# number. Prints "syscall ok" and exits 0, or exits with the number of the
+# failing check.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  addi sp, sp, -1024
+
+  # getpid and gettid agree in a single-threaded guest.
+  li s0, 1
+  li a7, 172             # getpid
+  ecall
+  blez a0, fail
+  mv s1, a0
+  li a7, 178             # gettid
+  ecall
+  bne a0, s1, fail
+
+  # uname reports the guest's machine.
+  li s0, 2
+  mv a0, sp
+  li a7, 160             # uname
+  ecall
+  bnez a0, fail
+  ld t0, 260(sp)         # utsname.machine
+  la t1, riscv64
+  ld t1, 0(t1)
+  bne t0, t1, fail
+
+  # open, read, seek, stat and close a file.
+  li s0, 3
+  li a0, -100            # AT_FDCWD
+  la a1, path
+  li a2, 0               # O_RDONLY
+  li a3, 0
+  li a7, 56              # openat
+  ecall
+  bltz a0, fail
+  mv s1, a0
+  mv a1, sp
+  li a2, 1
+  li a7, 63              # read
+  ecall
+  li t0, 1
+  bne a0, t0, fail
+  lbu t0, 0(sp)
+  li t1, '#'
+  bne t0, t1, fail
+
+  li s0, 4
+  mv a0, s1
+  li a1, 0
+  li a2, 2               # SEEK_END
+  li a7, 62              # lseek
+  ecall
+  blez a0, fail
+  mv s2, a0
+  mv a0, s1
+  mv a1, sp
+  li a7, 80              # fstat
+  ecall
+  bnez a0, fail
+  ld t0, 48(sp)          # stat.st_size
+  bne t0, s2, fail
+
+  li s0, 5
+  mv a0, s1
+  li a7, 57              # close
+  ecall
+  bnez a0, fail
+  mv a0, s1
+  li a7, 57
+  ecall
+  li t0, -9              # EBADF
+  bne a0, t0, fail
+
+  # writev through a dup of stdout.
+  li s0, 6
+  li a0, 1
+  li a7, 23              # dup
+  ecall
+  bltz a0, fail
+  mv s1, a0
+  la t0, msg
+  sd t0, 0(sp)
+  li t1, 8
+  sd t1, 8(sp)
+  addi t0, t0, 8
+  sd t0, 16(sp)
+  li t1, 3
+  sd t1, 24(sp)
+  mv a0, s1
+  mv a1, sp
+  li a2, 2
+  li a7, 66              # writev
+  ecall
+  li t0, 11
+  bne a0, t0, fail
+  mv a0, s1
+  li a7, 57
+  ecall
+  bnez a0, fail
+
+  # grow the heap and write to its last byte.
+  li s0, 7
+  li a0, 0
+  li a7, 214             # brk
+  ecall
+  beqz a0, fail
+  li t0, 8192
+  add s1, a0, t0
+  mv a0, s1
+  li a7, 214
+  ecall
+  bne a0, s1, fail
+  li t0, 1
+  sb t0, -1(s1)
+
+  # map, write and unmap anonymous memory.
+  li s0, 8
+  li a0, 0
+  li a1, 8192
+  li a2, 3               # PROT_READ | PROT_WRITE
+  li a3, 0x22            # MAP_PRIVATE | MAP_ANONYMOUS
+  li a4, -1
+  li a5, 0
+  li a7, 222             # mmap
+  ecall
+  li t0, -4096
+  bgeu a0, t0, fail
+  mv s1, a0
+  li t0, 4096
+  add t0, s1, t0
+  sd t0, 0(t0)
+  mv a0, s1
+  li a1, 8192
+  li a7, 215             # munmap
+  ecall
+  bnez a0, fail
+
+  li s0, 9
+  mv a0, sp
+  li a1, 16
+  li a2, 0
+  li a7, 278             # getrandom
+  ecall
+  li t0, 16
+  bne a0, t0, fail
+
+  li s0, 10
+  li a0, 1               # CLOCK_MONOTONIC
+  mv a1, sp
+  li a7, 113             # clock_gettime
+  ecall
+  bnez a0, fail
+  mv a0, sp
+  li a1, 0
+  li a7, 169             # gettimeofday
+  ecall
+  bnez a0, fail
+  ld t0, 0(sp)
+  blez t0, fail
+
+  li s0, 11
+  li a7, 1000            # not a syscall
+  ecall
+  li t0, -38             # ENOSYS
+  bne a0, t0, fail
+
+  li s0, 0
+fail:
+  mv a0, s0
+  li a7, 93              # exit
+  ecall
+
+  .section .rodata
+path:
+  .asciz "tests/syscall.s"
+riscv64:
+  .asciz "riscv64"
+msg:
+  .ascii "syscall ok\n"
@@ -0,0 +1,49 @@
+# Text is mapped like on Linux: a guest can mprotect it writable, patch an
+# instruction and run the new one, not a block decoded before the write.
+# Exits 0, or the number of the failing check.
+
+  .option norelax
+  .option norvc
+  .text
+  .globl _start
+_start:
+  call target            # decode (and cache) the block before patching
+  li t0, 1
+  bne a0, t0, fail1
+
+  la a0, _start
+  li t1, -4096
+  and a0, a0, t1
+  li a1, 4096
+  li a2, 7               # read, write, exec
+  li a7, 226             # mprotect
+  ecall
+  bnez a0, fail2
+
+  la t0, target
+  lw t1, patch
+  sw t1, 0(t0)
+  fence.i
+  call target
+  li t0, 2
+  bne a0, t0, fail3
+
+  li a0, 0
+  j exit
+fail1:
+  li a0, 1
+  j exit
+fail2:
+  li a0, 2
+  j exit
+fail3:
+  li a0, 3
+exit:
+  li a7, 93
+  ecall
+
+target:
+  li a0, 1
+  ret
+patch:
+  li a0, 2
@@ -0,0 +1,169 @@
+#include "rvemu.h"
+
+/*
+    Dirty page tracking test.
+
+    Maps a region and grows the heap, starts tracking, then writes a few
+    pages and checks that exactly those are reported, before and after a
+    reset, and that memory mapped after a reset is reported whole. Shared
+    anonymous memory is tracked like private memory; a shared file mapping
+    is not tracked at all. Under the dirty_all fallback every tracked page
+    counts as written. Exits 0, or with the number of the failing check.
+
+      make test, or make tests/unit/dirty && tests/unit/dirty
+*/
+
+#define REGION     0x100000
+#define REGION_LEN 8
+#define LATE       0x200000
+#define LATE_LEN   2
+#define SHARED     0x300000
+#define SHARED_LEN 4
+#define FILE_MAP   0x400000
+#define HEAP       0x10000
+#define HEAP_LEN   4
+
+typedef struct {
+  u64 addr;
+  u64 len;
+} range_t;
+
+static range_t ranges[256];
+static int num_ranges;
+static int page_size;
+static enum dirty_mode_t mode;
+
+static void collect(u64 addr, u64 len, void *arg) {
+  (void)arg;
+  if (num_ranges == ARRAY_SIZE(ranges)) {
+    fatal("too many dirty ranges");
+  }
+  ranges[num_ranges++] = (range_t){addr, len};
+}
+
+static bool reported(u64 addr) {
+  for (int i = 0; i < num_ranges; i++) {
+    if (addr >= ranges[i].addr && addr < ranges[i].addr + ranges[i].len) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void touch(mmu_t *mmu, u64 addr) {
+  *(volatile u8 *)TO_HOST(mmu->mem_base, addr) = 1;
+}
+
+// whether the pages of [addr, addr + n pages) reported dirty are exactly
+// those set in mask.
+static bool pages_match(u64 addr, int n, u32 mask) {
+  for (int i = 0; i < n; i++) {
+    bool want = mode == dirty_all || (mask & (1 << i));
+    if (reported(addr + (u64)i * page_size) != want) {
+      fprintf(stderr, "page %lx: want %s\n", addr + (u64)i * page_size,
+              want ? "dirty" : "clean");
+      return false;
+    }
+  }
+  return true;
+}
+
+static void scan(mmu_t *mmu) {
+  num_ranges = 0;
+  mmu_dirty_foreach(mmu, collect, NULL);
+}
+
+int main(void) {
+  page_size = getpagesize();
+
+  mmu_t mmu;
+  if (mmu_init(&mmu)) {
+    fatal(strerror(errno));
+  }
+  mmu.base = mmu.alloc = HEAP;
+  mmu.host_alloc = TO_HOST(mmu.mem_base, HEAP);
+  if (!mmu_alloc(&mmu, HEAP_LEN * page_size) ||
+      mmu_map(&mmu, REGION, REGION_LEN * page_size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != REGION) {
+    fatal("failed to set up guest memory");
+  }
+  // populated before tracking starts, so these must not show up.
+  touch(&mmu, REGION);
+  touch(&mmu, HEAP + page_size);
+
+  mode = mmu_dirty_start(&mmu);
+  if (mode == dirty_none) {
+    return 1;
+  }
+
+  scan(&mmu);
+  if (!pages_match(REGION, REGION_LEN, 0) || !pages_match(HEAP, HEAP_LEN, 0)) {
+    return 2;
+  }
+
+  touch(&mmu, REGION + page_size);
+  touch(&mmu, REGION + 5 * page_size);
+  touch(&mmu, HEAP);
+  scan(&mmu);
+  if (!pages_match(REGION, REGION_LEN, 1 << 1 | 1 << 5) ||
+      !pages_match(HEAP, HEAP_LEN, 1 << 0)) {
+    return 3;
+  }
+
+  mmu_dirty_reset(&mmu);
+  touch(&mmu, REGION + 3 * page_size);
+  scan(&mmu);
+  if (!pages_match(REGION, REGION_LEN, 1 << 3) ||
+      !pages_match(HEAP, HEAP_LEN, 0)) {
+    return 4;
+  }
+
+  // new memory counts as written until the next reset.
+  mmu_dirty_reset(&mmu);
+  if (mmu_map(&mmu, LATE, LATE_LEN * page_size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != LATE) {
+    fatal("failed to map guest memory");
+  }
+  scan(&mmu);
+  if (!pages_match(LATE, LATE_LEN, 3) || !pages_match(REGION, REGION_LEN, 0)) {
+    return 5;
+  }
+
+  mmu_dirty_reset(&mmu);
+  touch(&mmu, LATE + page_size);
+  scan(&mmu);
+  if (!pages_match(LATE, LATE_LEN, 1 << 1)) {
+    return 6;
+  }
+
+  // a guest's shared anonymous memory is its own, like private memory.
+  if (mmu_map(&mmu, SHARED, SHARED_LEN * page_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != SHARED) {
+    fatal("failed to map guest memory");
+  }
+  touch(&mmu, SHARED);
+  mmu_dirty_reset(&mmu);
+  touch(&mmu, SHARED + 2 * page_size);
+  scan(&mmu);
+  if (!pages_match(SHARED, SHARED_LEN, 1 << 2)) {
+    return 7;
+  }
+
+  // writes to a shared file mapping are the file's.
+  FILE *f = tmpfile();
+  if (!f || ftruncate(fileno(f), page_size) == -1 ||
+      mmu_map(&mmu, FILE_MAP, page_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_FIXED, fileno(f), 0) != FILE_MAP) {
+    fatal("failed to map a file");
+  }
+  mmu_dirty_reset(&mmu);
+  touch(&mmu, FILE_MAP);
+  scan(&mmu);
+  if (reported(FILE_MAP)) {
+    return 8;
+  }
+  fclose(f);
+
+  mmu_free(&mmu);
+  return 0;
+}
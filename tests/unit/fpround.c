@@ -0,0 +1,34 @@
+#include <fenv.h>
+
+#include "rvemu.h"
+
+/*
+    Host rounding mode test.
+
+    A run of guest blocks may switch the host thread to the guest's frm;
+    fp_leave has to give the thread back the mode it had before fp_enter,
+    whatever that was. Exits 0, or with the number of the failing check.
+
+      make test, or make tests/unit/fpround && tests/unit/fpround
+*/
+
+static const int modes[] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD,
+                            FE_UPWARD};
+
+int main(void) {
+  state_t state = {0};
+
+  for (int i = 0; i < ARRAY_SIZE(modes); i++) {
+    for (u32 frm = rne; frm <= rmm; frm++) {
+      fesetround(modes[i]);
+      state.frm = frm;
+      fp_enter(&state);
+      fp_leave(&state);
+      if (fegetround() != modes[i]) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
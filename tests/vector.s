@@ -0,0 +1,56 @@
+# Vector decoding: the shift immediates are unsigned five-bit values, so
+# vsll.vi by 31 is not a shift by -1, and whole-register loads, stores and
+# moves cover every register of the group. Exits 0, or the number of the
+# failing check. Assumes the default VLEN of 128.
+
+  .option norelax
+  .text
+  .globl _start
+_start:
+  la s1, src
+  la s2, dst
+  vsetivli zero, 2, e64, m1, ta, ma
+  vle64.v v1, (s1)
+
+  li s0, 1
+  vsll.vi v2, v1, 31
+  vse64.v v2, (s2)
+  ld t0, 0(s2)
+  li t1, 0x80000000
+  bne t0, t1, fail
+
+  li s0, 2
+  vsrl.vi v3, v2, 31
+  vse64.v v3, (s2)
+  ld t0, 8(s2)
+  li t1, 1
+  bne t0, t1, fail
+
+  # four registers of 16 bytes each.
+  li s0, 3
+  vl4re32.v v8, (s1)
+  vmv4r.v v12, v8
+  vs4r.v v12, (s2)
+  li t2, 0
+  li t3, 64
+1:
+  add t4, s1, t2
+  add t5, s2, t2
+  ld t4, 0(t4)
+  ld t5, 0(t5)
+  bne t4, t5, fail
+  addi t2, t2, 8
+  blt t2, t3, 1b
+
+  li s0, 0
+fail:
+  mv a0, s0
+  li a7, 93              # exit
+  ecall
+
+  .data
+  .align 3
+src:
+  .dword 1, 1, 3, 4, 5, 6, 7, 8
+dst:
+  .space 64